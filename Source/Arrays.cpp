@@ -0,0 +1,584 @@
+#include "Assembly.h"
+
+#include <windows.h>
+#include <malloc.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "TyroDebug.h"
+
+
+//*** Kernels
+
+// every kernel has a plain version and an SSE2 and an AVX2 version, the best
+// one the cpu supports is picked when the first kernel runs
+// the sums are added up in Lanes partial sums, where lane k adds the elements
+// k, k + Lanes, k + 2 * Lanes and so on, whatever the version, and the lanes are
+// added in order at the end, so that floats add up to the same result on every cpu
+
+#define tofloat(x) (*((float *)x))
+#define todword(x) (*((dword *)x))
+
+enum { Lanes = 8 };
+
+struct KernelTable
+{
+  // by ELEMENTTYPE
+  void (*add[2])(dword *d, const dword *a, const dword *b, dword n);
+  void (*mul[2])(dword *d, const dword *a, const dword *b, dword n);
+  void (*less[2])(dword *d, const dword *a, const dword *b, dword n);
+
+  // the lanes of the first blocks * Lanes elements
+  void (*dot[2])(const dword *a, const dword *b, dword blocks, dword *lanes);
+  void (*sum[2])(const dword *a, dword blocks, dword *lanes);
+
+  void (*select)(dword *d, const dword *m, const dword *a, const dword *b, dword n);
+  void (*fill)(dword *d, dword v, dword n);
+};
+
+
+// plain versions, the SIMD versions use them for the elements that are left over
+
+static void AddInt(dword *d, const dword *a, const dword *b, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    d[i] = a[i] + b[i];
+}
+
+static void AddFloat(dword *d, const dword *a, const dword *b, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    ((float *)d)[i] = ((const float *)a)[i] + ((const float *)b)[i];
+}
+
+static void MulInt(dword *d, const dword *a, const dword *b, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    d[i] = a[i] * b[i];
+}
+
+static void MulFloat(dword *d, const dword *a, const dword *b, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    ((float *)d)[i] = ((const float *)a)[i] * ((const float *)b)[i];
+}
+
+static void LessInt(dword *d, const dword *a, const dword *b, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    d[i] = ((const long *)a)[i] < ((const long *)b)[i] ? 1 : 0;
+}
+
+static void LessFloat(dword *d, const dword *a, const dword *b, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    d[i] = ((const float *)a)[i] < ((const float *)b)[i] ? 1 : 0;
+}
+
+static void DotInt(const dword *a, const dword *b, dword blocks, dword *lanes)
+{
+  memset(lanes, 0, sizeof(dword) * Lanes);
+  for(dword i = 0; i < blocks * Lanes; i ++)
+    lanes[i % Lanes] += a[i] * b[i];
+}
+
+static void DotFloat(const dword *a, const dword *b, dword blocks, dword *lanes)
+{
+  float sums[Lanes] = { 0 };
+  for(dword i = 0; i < blocks * Lanes; i ++) {
+    float product = ((const float *)a)[i] * ((const float *)b)[i];
+    sums[i % Lanes] += product;
+  }
+
+  memcpy(lanes, sums, sizeof(sums));
+}
+
+static void SumInt(const dword *a, dword blocks, dword *lanes)
+{
+  memset(lanes, 0, sizeof(dword) * Lanes);
+  for(dword i = 0; i < blocks * Lanes; i ++)
+    lanes[i % Lanes] += a[i];
+}
+
+static void SumFloat(const dword *a, dword blocks, dword *lanes)
+{
+  float sums[Lanes] = { 0 };
+  for(dword i = 0; i < blocks * Lanes; i ++)
+    sums[i % Lanes] += ((const float *)a)[i];
+
+  memcpy(lanes, sums, sizeof(sums));
+}
+
+static void Select(dword *d, const dword *m, const dword *a, const dword *b, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    d[i] = m[i] != 0 ? a[i] : b[i];
+}
+
+static void Fill(dword *d, dword v, dword n)
+{
+  for(dword i = 0; i < n; i ++)
+    d[i] = v;
+}
+
+static const KernelTable plain = {
+  { AddInt, AddFloat }, { MulInt, MulFloat }, { LessInt, LessFloat },
+  { DotInt, DotFloat }, { SumInt, SumFloat }, Select, Fill
+};
+
+
+// SSE2 versions, 4 elements at a time
+
+#define load4(p) _mm_loadu_si128((const __m128i *)(p))
+#define loadf4(p) _mm_loadu_ps((const float *)(p))
+#define store4(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define storef4(p, v) _mm_storeu_ps((float *)(p), v)
+
+// SSE2 only multiplies the even lanes into 64 bits, so the odd ones are
+// shifted down and multiplied separately
+static inline __m128i MulLo(__m128i a, __m128i b)
+{
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static void AddIntSSE2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 4 <= n; i += 4)
+    store4(d + i, _mm_add_epi32(load4(a + i), load4(b + i)));
+
+  AddInt(d + i, a + i, b + i, n - i);
+}
+
+static void AddFloatSSE2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 4 <= n; i += 4)
+    storef4(d + i, _mm_add_ps(loadf4(a + i), loadf4(b + i)));
+
+  AddFloat(d + i, a + i, b + i, n - i);
+}
+
+static void MulIntSSE2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 4 <= n; i += 4)
+    store4(d + i, MulLo(load4(a + i), load4(b + i)));
+
+  MulInt(d + i, a + i, b + i, n - i);
+}
+
+static void MulFloatSSE2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 4 <= n; i += 4)
+    storef4(d + i, _mm_mul_ps(loadf4(a + i), loadf4(b + i)));
+
+  MulFloat(d + i, a + i, b + i, n - i);
+}
+
+static void LessIntSSE2(dword *d, const dword *a, const dword *b, dword n)
+{
+  __m128i one = _mm_set1_epi32(1);
+
+  dword i = 0;
+  for(; i + 4 <= n; i += 4)
+    store4(d + i, _mm_and_si128(_mm_cmplt_epi32(load4(a + i), load4(b + i)), one));
+
+  LessInt(d + i, a + i, b + i, n - i);
+}
+
+static void LessFloatSSE2(dword *d, const dword *a, const dword *b, dword n)
+{
+  __m128i one = _mm_set1_epi32(1);
+
+  dword i = 0;
+  for(; i + 4 <= n; i += 4)
+    store4(d + i, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(loadf4(a + i), loadf4(b + i))), one));
+
+  LessFloat(d + i, a + i, b + i, n - i);
+}
+
+static void DotIntSSE2(const dword *a, const dword *b, dword blocks, dword *lanes)
+{
+  __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes) {
+    low = _mm_add_epi32(low, MulLo(load4(a + i), load4(b + i)));
+    high = _mm_add_epi32(high, MulLo(load4(a + i + 4), load4(b + i + 4)));
+  }
+
+  store4(lanes, low);
+  store4(lanes + 4, high);
+}
+
+static void DotFloatSSE2(const dword *a, const dword *b, dword blocks, dword *lanes)
+{
+  __m128 low = _mm_setzero_ps(), high = _mm_setzero_ps();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes) {
+    low = _mm_add_ps(low, _mm_mul_ps(loadf4(a + i), loadf4(b + i)));
+    high = _mm_add_ps(high, _mm_mul_ps(loadf4(a + i + 4), loadf4(b + i + 4)));
+  }
+
+  storef4(lanes, low);
+  storef4(lanes + 4, high);
+}
+
+static void SumIntSSE2(const dword *a, dword blocks, dword *lanes)
+{
+  __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes) {
+    low = _mm_add_epi32(low, load4(a + i));
+    high = _mm_add_epi32(high, load4(a + i + 4));
+  }
+
+  store4(lanes, low);
+  store4(lanes + 4, high);
+}
+
+static void SumFloatSSE2(const dword *a, dword blocks, dword *lanes)
+{
+  __m128 low = _mm_setzero_ps(), high = _mm_setzero_ps();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes) {
+    low = _mm_add_ps(low, loadf4(a + i));
+    high = _mm_add_ps(high, loadf4(a + i + 4));
+  }
+
+  storef4(lanes, low);
+  storef4(lanes + 4, high);
+}
+
+static void SelectSSE2(dword *d, const dword *m, const dword *a, const dword *b, dword n)
+{
+  __m128i zero = _mm_setzero_si128();
+
+  dword i = 0;
+  for(; i + 4 <= n; i += 4) {
+    __m128i none = _mm_cmpeq_epi32(load4(m + i), zero);
+    store4(d + i, _mm_or_si128(_mm_and_si128(none, load4(b + i)), _mm_andnot_si128(none, load4(a + i))));
+  }
+
+  Select(d + i, m + i, a + i, b + i, n - i);
+}
+
+static void FillSSE2(dword *d, dword v, dword n)
+{
+  __m128i value = _mm_set1_epi32(v);
+
+  dword i = 0;
+  for(; i + 4 <= n; i += 4)
+    store4(d + i, value);
+
+  Fill(d + i, v, n - i);
+}
+
+static const KernelTable sse2 = {
+  { AddIntSSE2, AddFloatSSE2 }, { MulIntSSE2, MulFloatSSE2 }, { LessIntSSE2, LessFloatSSE2 },
+  { DotIntSSE2, DotFloatSSE2 }, { SumIntSSE2, SumFloatSSE2 }, SelectSSE2, FillSSE2
+};
+
+
+// AVX2 versions, 8 elements at a time, they clear the upper halves of the
+// registers before they return, so that the SSE code that follows isn't slowed down
+
+#define load8(p) _mm256_loadu_si256((const __m256i *)(p))
+#define loadf8(p) _mm256_loadu_ps((const float *)(p))
+#define store8(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define storef8(p, v) _mm256_storeu_ps((float *)(p), v)
+
+static void AddIntAVX2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 8 <= n; i += 8)
+    store8(d + i, _mm256_add_epi32(load8(a + i), load8(b + i)));
+
+  _mm256_zeroupper();
+  AddInt(d + i, a + i, b + i, n - i);
+}
+
+static void AddFloatAVX2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 8 <= n; i += 8)
+    storef8(d + i, _mm256_add_ps(loadf8(a + i), loadf8(b + i)));
+
+  _mm256_zeroupper();
+  AddFloat(d + i, a + i, b + i, n - i);
+}
+
+static void MulIntAVX2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 8 <= n; i += 8)
+    store8(d + i, _mm256_mullo_epi32(load8(a + i), load8(b + i)));
+
+  _mm256_zeroupper();
+  MulInt(d + i, a + i, b + i, n - i);
+}
+
+static void MulFloatAVX2(dword *d, const dword *a, const dword *b, dword n)
+{
+  dword i = 0;
+  for(; i + 8 <= n; i += 8)
+    storef8(d + i, _mm256_mul_ps(loadf8(a + i), loadf8(b + i)));
+
+  _mm256_zeroupper();
+  MulFloat(d + i, a + i, b + i, n - i);
+}
+
+static void LessIntAVX2(dword *d, const dword *a, const dword *b, dword n)
+{
+  __m256i one = _mm256_set1_epi32(1);
+
+  // there is only a greater than compare for ints, a < b is b > a
+  dword i = 0;
+  for(; i + 8 <= n; i += 8)
+    store8(d + i, _mm256_and_si256(_mm256_cmpgt_epi32(load8(b + i), load8(a + i)), one));
+
+  _mm256_zeroupper();
+  LessInt(d + i, a + i, b + i, n - i);
+}
+
+static void LessFloatAVX2(dword *d, const dword *a, const dword *b, dword n)
+{
+  __m256i one = _mm256_set1_epi32(1);
+
+  dword i = 0;
+  for(; i + 8 <= n; i += 8)
+    store8(d + i, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(loadf8(a + i), loadf8(b + i), _CMP_LT_OQ)), one));
+
+  _mm256_zeroupper();
+  LessFloat(d + i, a + i, b + i, n - i);
+}
+
+static void DotIntAVX2(const dword *a, const dword *b, dword blocks, dword *lanes)
+{
+  __m256i sum = _mm256_setzero_si256();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes)
+    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(load8(a + i), load8(b + i)));
+
+  store8(lanes, sum);
+  _mm256_zeroupper();
+}
+
+static void DotFloatAVX2(const dword *a, const dword *b, dword blocks, dword *lanes)
+{
+  __m256 sum = _mm256_setzero_ps();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes)
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(loadf8(a + i), loadf8(b + i)));
+
+  storef8(lanes, sum);
+  _mm256_zeroupper();
+}
+
+static void SumIntAVX2(const dword *a, dword blocks, dword *lanes)
+{
+  __m256i sum = _mm256_setzero_si256();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes)
+    sum = _mm256_add_epi32(sum, load8(a + i));
+
+  store8(lanes, sum);
+  _mm256_zeroupper();
+}
+
+static void SumFloatAVX2(const dword *a, dword blocks, dword *lanes)
+{
+  __m256 sum = _mm256_setzero_ps();
+  for(dword i = 0; i < blocks * Lanes; i += Lanes)
+    sum = _mm256_add_ps(sum, loadf8(a + i));
+
+  storef8(lanes, sum);
+  _mm256_zeroupper();
+}
+
+static void SelectAVX2(dword *d, const dword *m, const dword *a, const dword *b, dword n)
+{
+  __m256i zero = _mm256_setzero_si256();
+
+  dword i = 0;
+  for(; i + 8 <= n; i += 8) {
+    __m256i none = _mm256_cmpeq_epi32(load8(m + i), zero);
+    store8(d + i, _mm256_blendv_epi8(load8(a + i), load8(b + i), none));
+  }
+
+  _mm256_zeroupper();
+  Select(d + i, m + i, a + i, b + i, n - i);
+}
+
+static void FillAVX2(dword *d, dword v, dword n)
+{
+  __m256i value = _mm256_set1_epi32(v);
+
+  dword i = 0;
+  for(; i + 8 <= n; i += 8)
+    store8(d + i, value);
+
+  _mm256_zeroupper();
+  Fill(d + i, v, n - i);
+}
+
+static const KernelTable avx2 = {
+  { AddIntAVX2, AddFloatAVX2 }, { MulIntAVX2, MulFloatAVX2 }, { LessIntAVX2, LessFloatAVX2 },
+  { DotIntAVX2, DotFloatAVX2 }, { SumIntAVX2, SumFloatAVX2 }, SelectAVX2, FillAVX2
+};
+
+
+// SSE2 is cpuid function 1 edx bit 26, AVX2 is function 7 ebx bit 5, which
+// also needs the os to save the upper halves of the registers (osxsave and
+// avx are ecx bits 27 and 28 of function 1, xgetbv tells what the os saves)
+static const KernelTable* SelectKernels()
+{
+  int info[4];
+  __cpuid(info, 0);
+  int functions = info[0];
+
+  __cpuid(info, 1);
+  bool hassse2 = (info[3] & (1 << 26)) != 0;
+  bool hasavx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+
+  bool hasavx2 = false;
+  if(hasavx && functions >= 7) {
+    __cpuidex(info, 7, 0);
+    hasavx2 = (info[1] & (1 << 5)) != 0;
+  }
+
+  return hasavx2 ? &avx2 : hassse2 ? &sse2 : &plain;
+}
+
+// adds up the lanes of a dot product or a sum and the elements after the last
+// block, b is null for a sum
+static dword Reduce(ELEMENTTYPE type, dword *lanes, const dword *a, const dword *b, dword from, dword n)
+{
+  if(type == ET_FLOAT) {
+    float sum = 0;
+    for(dword k = 0; k < Lanes; k ++)
+      sum += tofloat(&lanes[k]);
+
+    for(dword i = from; i < n; i ++) {
+      float value = b != null ? tofloat(&a[i]) * tofloat(&b[i]) : tofloat(&a[i]);
+      sum += value;
+    }
+
+    return todword(&sum);
+  }
+
+  dword sum = 0;
+  for(dword k = 0; k < Lanes; k ++)
+    sum += lanes[k];
+
+  for(dword i = from; i < n; i ++)
+    sum += b != null ? a[i] * b[i] : a[i];
+
+  return sum;
+}
+
+
+//*** VirtualMachine
+
+dword VirtualMachine::NewArray(dword length)
+{
+  // negative lengths are too long as well
+  if(length > MaxArrayLength) return 0;
+
+  // every array has memory of its own, even an empty one
+  size_t size = sizeof(dword) * (length > 0 ? length : 1);
+  void *block = _aligned_malloc(size, ArrayAlignment);
+  if(block == null) return 0;
+
+  memset(block, 0, size);
+
+  Array array = { (dword *)block, length, block };
+  arrays.push_back(array);
+  return (dword)arrays.size();
+}
+
+dword VirtualMachine::Slice(dword handle, dword from, dword to)
+{
+  if(handle - 1 >= arrays.size()) return 0;
+
+  Array array = arrays[handle - 1];
+  if(from > to || to > array.length) return 0;
+
+  Array slice = { array.data + from, to - from, null };
+  arrays.push_back(slice);
+  return (dword)arrays.size();
+}
+
+bool VirtualMachine::Kernel(OPCODE opcode, ELEMENTTYPE type)
+{
+  static const KernelTable *kernels = SelectKernels();
+
+  if(type != ET_INT && type != ET_FLOAT) return false;
+
+  if(opcode == AFILL) {
+    dword value = *(stackpos --);
+    if(*stackpos - 1 >= arrays.size()) return false;
+
+    Array& array = arrays[*stackpos - 1];
+    kernels->fill(array.data, value, array.length);
+    return true;
+  }
+
+  // the operands replace each other on the stack, the first one is d
+  dword count = opcode == VSELECT ? 4 : opcode == VDOT ? 2 : opcode == VSUM ? 1 : 3;
+  stackpos -= count - 1;
+
+  Array *operands[4];
+  for(dword k = 0; k < count; k ++) {
+    if(stackpos[k] - 1 >= arrays.size()) return false;
+
+    operands[k] = &arrays[stackpos[k] - 1];
+    if(operands[k]->length != operands[0]->length) return false;
+  }
+
+  dword n = operands[0]->length;
+  dword lanes[Lanes];
+
+  switch(opcode) {
+    case VDOT:
+      kernels->dot[type](operands[0]->data, operands[1]->data, n / Lanes, lanes);
+      *stackpos = Reduce(type, lanes, operands[0]->data, operands[1]->data, n - n % Lanes, n);
+      return true;
+
+    case VSUM:
+      kernels->sum[type](operands[0]->data, n / Lanes, lanes);
+      *stackpos = Reduce(type, lanes, operands[0]->data, null, n - n % Lanes, n);
+      return true;
+  }
+
+  // an operand that overlaps d without being d is copied first, so that the
+  // kernels see the elements as they were before the first one was written
+  dword *d = operands[0]->data;
+  const dword *sources[3];
+  vector<dword> copies[3];
+
+  for(dword k = 1; k < count; k ++) {
+    sources[k - 1] = operands[k]->data;
+    if(sources[k - 1] != d && sources[k - 1] < d + n && d < sources[k - 1] + n) {
+      copies[k - 1].assign(sources[k - 1], sources[k - 1] + n);
+      sources[k - 1] = &copies[k - 1][0];
+    }
+  }
+
+  switch(opcode) {
+    case VADD:    kernels->add[type](d, sources[0], sources[1], n); break;
+    case VMUL:    kernels->mul[type](d, sources[0], sources[1], n); break;
+    case VLESS:   kernels->less[type](d, sources[0], sources[1], n); break;
+    case VSELECT: kernels->select(d, sources[0], sources[1], sources[2], n); break;
+    default:      return false;
+  }
+
+  return true;
+}
+
+void VirtualMachine::ClearArrays()
+{
+  for(dword i = 0; i < arrays.size(); i ++) {
+    if(arrays[i].block != null) _aligned_free(arrays[i].block);
+  }
+
+  arrays.clear();
+}
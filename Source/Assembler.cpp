@@ -1,4 +1,9 @@
+#include <ctype.h>
+
 #include "Assembly.h"
+#include "Compiler.h"
+
+#include <windows.h>
 
 #include "TyroDebug.h"
 
@@ -7,7 +12,7 @@ struct OpDesc
 {
   dword code;       // opcode, see enum OPCODE in "VirtualMachine.h"
   const char *name; // the name of the opcode as a lowercase string
-  byte paramcount;  // the number of parameters that the op takes (0 or 1)
+  byte paramcount;  // the number of parameters that the op takes (0 to 3)
 
 } opcodes[] = {
   // these are stored in order of appearance i.e.: opcodes[opcode].code == opcode
@@ -55,95 +60,216 @@ struct OpDesc
   {FDIV, "fdiv", 0},
 
   {FCMP, "fcmp", 0},
+
+  {JEQ, "jeq", 1},
+  {JNE, "jne", 1},
+  {JLT, "jlt", 1},
+  {JLE, "jle", 1},
+  {JGT, "jgt", 1},
+  {JGE, "jge", 1},
+
+  {SHL, "shl", 0},
+  {SHR, "shr", 0},
+  {SAR, "sar", 0},
+  {BAND, "band", 0},
+  {BOR, "bor", 0},
+  {BXOR, "bxor", 0},
+
+  {POPCNT, "popcnt", 0},
+  {CLZ, "clz", 0},
+  {CTZ, "ctz", 0},
+  {ROTL, "rotl", 0},
+  {ROTR, "rotr", 0},
+  {BSWAP, "bswap", 0},
+
+  {LOOPINC, "loopinc", 3},
+  {LOOPINCC, "loopincc", 3},
+
+  {TABLESWITCH, "tableswitch", 3},
+
+  {CALLS, "calls", 1},
+  {RET, "ret", 0},
+  {FRAME, "frame", 2},
+
+  {CALLM, "callm", 1},
+
+  {ANEW, "anew", 0},
+  {ALEN, "alen", 0},
+  {ALOAD, "aload", 0},
+  {ASTORE, "astore", 0},
+  {ALOADU, "aloadu", 0},
+  {ASTOREU, "astoreu", 0},
+  {AFILL, "afill", 0},
+  {ASLICE, "aslice", 0},
+
+  {VADD, "vadd", 1},
+  {VMUL, "vmul", 1},
+  {VLESS, "vless", 1},
+  {VSELECT, "vselect", 1},
+  {VDOT, "vdot", 1},
+  {VSUM, "vsum", 1},
+
+  {SLIT, "slit", 1},
+  {SCAT, "scat", 0},
+  {SEQ, "seq", 0},
+  {SCMP, "scmp", 0},
+  {SLEN, "slen", 0},
+  {SHASH, "shash", 0},
+  {SCHAR, "schar", 0},
+  {SSUB, "ssub", 0},
+  {SFIND, "sfind", 0},
 };
 
-struct Label
+// a perfect hash of the names of the ops, the table is built when the program
+// starts with the first seed that gives every name a slot of its own, so it
+// follows opcodes[] when ops are added
+class MnemonicTable
 {
-  string label;
-  dword pos;
+  enum Constant { Size = 1024, Empty = 0xff };
+
+  byte slots[Size];   // the index of the op in opcodes[], or Empty
+  dword seed;
+
+  static dword Hash(const char *name, size_t length, dword seed)
+  {
+    dword hash = 2166136261u ^ seed;
+    for(size_t i = 0; i < length; i ++) {
+      hash ^= (byte)tolower(name[i]);
+      hash *= 16777619;
+    }
+
+    return hash ^ (hash >> 16);
+  }
+
+public:
+
+  // returns the op with the given name, the case doesn't matter, or null
+  OpDesc* Find(const char *name, size_t length)
+  {
+    byte index = slots[Hash(name, length, seed) & (Size - 1)];
+    if(index == Empty) return null;
+
+    const char *opname = opcodes[index].name;
+    for(size_t i = 0; i < length; i ++) {
+      if(opname[i] != tolower(name[i])) return null;
+    }
+
+    return opname[length] == '\0' ? &opcodes[index] : null;
+  }
 
-  Label(string l) : label(l), pos(-1)
+  MnemonicTable() : seed(0)
   {
+    dword count = sizeof(opcodes)/sizeof(OpDesc);
+
+    for(bool collision = true; collision; seed ++) {
+      memset(slots, Empty, sizeof(slots));
+      collision = false;
+
+      for(dword i = 0; i < count && !collision; i ++) {
+        byte& slot = slots[Hash(opcodes[i].name, strlen(opcodes[i].name), seed) & (Size - 1)];
+        if(slot != Empty)
+          collision = true;
+        else
+          slot = (byte)i;
+      }
+    }
+
+    seed --;
   }
 };
 
-int Assembler::AddLabel(string& name, LabelVector& labels)
+static MnemonicTable mnemonics;
+
+struct Label
 {
-  int index = 0;
-  LabelVector::iterator i;
-  for (i = labels.begin(); i != labels.end(); i ++, index ++) {
-    if(i->label == name)
-      return index;
-  }
+  const char *name;   // kept by the table of the labels
+  dword pos;
+};
 
-  labels.push_back(Label(name));
+// the labels of the source, the jumps refer to them by index until the
+// positions of all of them are known
+struct Labels
+{
+  vector<Label> labels;
+  NameTable<dword> indices;   // by name
+};
+
+dword Assembler::AddLabel(const char *name, size_t length, Labels& labels)
+{
+  NameTable<dword>::iterator i = labels.indices.find(name, length);
+  if(i != labels.indices.end()) return (*i).second;
+
+  dword index = (dword)labels.labels.size();
+  i = labels.indices.insert(make_pair(string(name, length), index)).first;
+
+  Label label = { (*i).first, (dword)-1 };
+  labels.labels.push_back(label);
   return index;
 }
 
-bool Assembler::SetLabels(Assembly& assembly, LabelVector& labels)
+bool Assembler::SetLabels(Assembly& assembly, Labels& labels)
 {
   dword *bytecode = assembly.bytecode;
   dword curpos = assembly.curpos;
 
-  size_t size = labels.size();
-  for(dword *cp = bytecode; cp < bytecode + curpos; cp += 2) {
+  size_t size = labels.labels.size();
+  for(dword *cp = bytecode; cp < bytecode + curpos; cp += OpSize(cp[0])) {
     if(IsJumpOp(cp[0])) {
       if(cp[1] < size) {
-        dword pos = labels.at(cp[1]).pos;
+        dword pos = labels.labels[cp[1]].pos;
         if(pos != -1)
           cp[1] = pos;
         else {
           // this is a common error
-          printf("Label not found: %s\n", labels.at(cp[1]).label.c_str());
-          labels.clear();
+          printf("Label not found: %s\n", labels.labels[cp[1]].name);
           return false;
         }
       } else {
         // if we get here, there's a bug in the assembler ;(
         printf("Label index not found: %d\n", cp[1]);
-        labels.clear();
         return false;
       }
     }
   }
   
-  labels.clear();
   return true;
 }
 
 bool Assembler::IsJumpOp(dword opcode)
 {
-  return (opcode >= GOTO && opcode <= IFF);
+  return (opcode >= GOTO && opcode <= IFF) || (opcode >= JEQ && opcode <= JGE) ||
+    (opcode >= LOOPINC && opcode <= CALLS);
+}
+
+dword Assembler::OpSize(dword opcode)
+{
+  return opcode < sizeof(opcodes)/sizeof(OpDesc) && opcodes[opcode].paramcount > 1 ? 4 : 2;
 }
 
-int Assembler::NextWord(string& s, string& w, int p)
-{      
-  int slength = (int)s.length();
-  if(p >= slength) return -1;
 
-  basic_string <char>::iterator i = s.begin() + p;
-  int j = p; while(isspace(*i) && j < slength) { i ++; j ++; }
-  int k = 0; while(!isspace(*i) && j + k < slength) { i ++; k ++; }
+bool Assembler::NextWord(const char *&p, const char *end, const char *&word, size_t& length)
+{
+  while(p < end && isspace((byte)*p)) p ++;
+  if(p == end) return false;
 
-  if(j == slength) k = -1;
-  else w = s.substr(j, k);
-  return k;
+  word = p;
+  while(p < end && !isspace((byte)*p)) p ++;
+  length = p - word;
+  return true;
 }
 
-dword Assembler::StringToOperand(string& s, OpDesc *opcode)
+dword Assembler::StringToOperand(const char *s, size_t length)
 {
-  const char *cstr = s.c_str();
-  size_t slength = s.length();
-  if(slength == 0) return 0;
+  if(length == 0) return 0;
 
   // chars are quoted with single quotes, e.g. "push 'A'"
-  if(slength == 3) {
-    if(cstr[0] == '\'' && cstr[2] == '\'')
-      return (dword)cstr[1];
-  } else if(slength == 4) {
+  if(length == 3) {
+    if(s[0] == '\'' && s[2] == '\'')
+      return (dword)s[1];
+  } else if(length == 4) {
     // also take into account newlines '\n' and such
-    if(cstr[0] == '\'' && cstr[1] == '\\' && cstr[3] == '\'') {
-      switch(cstr[2]) {
+    if(s[0] == '\'' && s[1] == '\\' && s[3] == '\'') {
+      switch(s[2]) {
         case 'n': return (dword)'\n';
         case 'r': return (dword)'\r';
         case 'b': return (dword)'\b';
@@ -153,8 +279,20 @@ dword Assembler::StringToOperand(string& s, OpDesc *opcode)
     }
   }
 
+  // the conversions need a terminated string, operands are short
+  char buffer[64];
+  string copy;
+  const char *cstr = buffer;
+  if(length < sizeof(buffer)) {
+    memcpy(buffer, s, length);
+    buffer[length] = '\0';
+  } else {
+    copy.assign(s, length);
+    cstr = copy.c_str();
+  }
+
   // all float operands end with an 'f', e.g. "1.23f" or contain a decimal point
-  if(tolower(cstr[slength - 1]) == 'f' || s.find(".") != string::npos) {
+  if(tolower(s[length - 1]) == 'f' || memchr(s, '.', length) != null) {
     float f = (float)atof(cstr);
     return *((dword *)&f);
   }
@@ -167,52 +305,55 @@ dword Assembler::StringToOperand(string& s, OpDesc *opcode)
   return *((dword *)&i);
 }
 
-bool Assembler::ParseLine(string& line, int linecount, Assembly& assembly, LabelVector& labels)
+bool Assembler::ParseLine(const char *line, const char *end, Assembly& assembly, Labels& labels)
 {
-  string op;
-  int i = NextWord(line, op);
+  const char *op, *param;
+  size_t oplength, paramlength;
   
   // skip commented and empty lines
-  if(i == -1 || op == "//" || op == ";") return true;
-
-  // this is a a very slow way of doing things, but then this code will only
-  // be used during development and for debugging
-  OpDesc *opcode;
-  int codecount = sizeof(opcodes)/sizeof(OpDesc); 
-  int j = 0;
-  for(; j < codecount; j ++) {
-    if(stricmp(opcodes[j].name, op.c_str()) == 0) {
-      opcode = &opcodes[j];      
-      break;
-    }
-  }
+  if(!NextWord(line, end, op, oplength)) return true;
+  if((oplength == 2 && op[0] == '/' && op[1] == '/') || (oplength == 1 && op[0] == ';')) return true;
+
+  OpDesc *opcode = mnemonics.Find(op, oplength);
 
   // is this a label?
-  if(j == codecount) {
-    size_t k = op.length() - 1;
-    if(op.find_first_of(":") == k) {
-      string name = op.substr(0, k);
-      labels.at(AddLabel(name, labels)).pos = assembly.curpos;
-      return true;
-    } else
-      return false; 
+  if(opcode == null) {
+    const char *colon = (const char *)memchr(op, ':', oplength);
+    if(colon != op + oplength - 1) return false;
 
-  } else {
+    labels.labels[AddLabel(op, oplength - 1, labels)].pos = assembly.curpos;
+    return true;
+  }
+
+  assembly.WriteDword(opcode->code);
 
-    assembly.WriteDword(opcode->code);
+  bool more = NextWord(line, end, param, paramlength);
 
-    string param;
-    i = NextWord(line, param, i);
+  if(IsJumpOp(opcode->code)) {
+    // write the label index, we'll later replace this with the code position
+    assembly.WriteDword(AddLabel(more ? param : "", more ? paramlength : 0, labels));
 
-    if(IsJumpOp(opcode->code)) {
-      // write the label index, we'll later replace this with the code position
-      assembly.WriteDword(AddLabel(param, labels)); 
-    } else {  
-      if(i == -1) {
-        assembly.WriteDword(0);
-        if(opcode->paramcount > 0) return false; // if we need more params, bail
-      } else
-        assembly.WriteDword(StringToOperand(param, opcode));
+    // "loopinc label i n" has two more parameters
+    for(int k = 1; k < opcode->paramcount; k ++) {
+      if(!NextWord(line, end, param, paramlength)) return false;
+      assembly.WriteDword(StringToOperand(param, paramlength));
+    }
+  } else {  
+    if(!more) {
+      assembly.WriteDword(0);
+      if(opcode->paramcount > 0) return false; // if we need more params, bail
+    } else
+      assembly.WriteDword(StringToOperand(param, paramlength));
+
+    // "frame p n" is padded to a second pair
+    if(opcode->paramcount > 1) {
+      for(int k = 1; k < 3; k ++) {
+        if(k < opcode->paramcount) {
+          if(!NextWord(line, end, param, paramlength)) return false;
+          assembly.WriteDword(StringToOperand(param, paramlength));
+        } else
+          assembly.WriteDword(0);
+      }
     }
   }
 
@@ -222,31 +363,48 @@ bool Assembler::ParseLine(string& line, int linecount, Assembly& assembly, Label
 bool Assembler::Assemble(const char *filename, Assembly& assembly)
 {
   assembly.Clear();
-  LabelVector labels;
+  Labels labels;
+
+  HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, null, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, null);
+  if(file == INVALID_HANDLE_VALUE) return false;
+
+  // the source is scanned where it is mapped, an empty file can't be mapped
+  DWORD size = GetFileSize(file, null);
+  if(size == 0 || size == INVALID_FILE_SIZE) {
+    CloseHandle(file);
+    return size == 0;
+  }
+
+  HANDLE mapping = CreateFileMapping(file, null, PAGE_READONLY, 0, 0, null);
+  CloseHandle(file);
+  if(mapping == null) return false;
 
-  FILE *in = fopen(filename, "rt");
-  if(in == null) return false;
- 
-  char buffer[256];
+  const char *source = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if(source == null) return false;
+
+  bool ok = true;
+  const char *end = source + size;
 
   int linecount = 0;
-  while(fgets(buffer, sizeof(buffer), in)) {
-    size_t lc = strlen(buffer) - 1;
-    if(buffer[lc] == '\n') buffer[lc] = '\0';
-
-    string line(buffer);
-    if(ParseLine(line, linecount, assembly, labels) == false) {
-      printf("Syntax error on line %d: \"%s\"\n", linecount + 1, buffer);
-      fclose(in);
-      return false;
+  for(const char *line = source; line < end && ok; ) {
+    const char *next = (const char *)memchr(line, '\n', end - line);
+    if(next == null) next = end;
+
+    if(ParseLine(line, next, assembly, labels) == false) {
+      const char *last = next > line && next[-1] == '\r' ? next - 1 : next;
+      printf("Syntax error on line %d: \"%.*s\"\n", linecount + 1, (int)(last - line), line);
+      ok = false;
     }
+
+    line = next + 1;
     linecount ++;
   }
 
-  fclose(in);
+  UnmapViewOfFile((void *)source);
 
   // replace label indices with code positions
-  return SetLabels(assembly, labels);
+  return ok && SetLabels(assembly, labels);
 }
 
 bool Assembler::Disassemble(const char *filename, Assembly& assembly, bool hexops)
@@ -259,15 +417,28 @@ bool Assembler::Disassemble(const char *filename, Assembly& assembly, bool hexop
   dword *pos = bytecode;
   dword *end = bytecode + assembly.curpos;
 
-  while(pos < end) {
-    dword opcode = *(pos ++);
-    dword operand = *(pos ++);
-    if(IsJumpOp(opcode)) operand = (operand / 2) + 1;
+  // jump targets are written as line numbers, ops aren't all the same size
+  vector<dword> lines(assembly.curpos + 1, 0);
+  dword line = 1;
+  for(pos = bytecode; pos < end; pos += OpSize(*pos))
+    lines[pos - bytecode] = line ++;
 
-    if(opcodes[opcode].paramcount > 0)
+  pos = bytecode;
+  while(pos < end) {
+    dword opcode = pos[0];
+    dword operand = pos[1];
+    if(IsJumpOp(opcode) && operand <= assembly.curpos) operand = lines[operand];
+
+    if(opcodes[opcode].paramcount > 2)
+      fprintf(out, hexops ? "%s\t0x%08x\t0x%08x\t0x%08x\n" : "%s\t%d\t%d\t%d\n", opcodes[opcode].name, operand, pos[2], pos[3]);
+    else if(opcodes[opcode].paramcount > 1)
+      fprintf(out, hexops ? "%s\t0x%08x\t0x%08x\n" : "%s\t%d\t%d\n", opcodes[opcode].name, operand, pos[2]);
+    else if(opcodes[opcode].paramcount > 0)
       fprintf(out, hexops ? "%s\t0x%08x\n" : "%s\t%d\n", opcodes[opcode].name, operand);
     else
       fprintf(out, "%s\n", opcodes[opcode].name);
+
+    pos += OpSize(opcode);
   }
 
   fclose(out);
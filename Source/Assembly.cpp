@@ -2,22 +2,47 @@
 #include <stdlib.h>
 
 #include "Assembly.h"
+#include "Compiler.h"
+
+#include <windows.h>
+#include <algorithm>
 
 #include "TyroDebug.h"
 
 
 
-Assembly::Assembly() : curpos(0), bytecode(null), functioncount(0), functions(null)
+Assembly::Assembly() : curpos(0), capacity(0), bytecode(null), functioncount(0), functions(null), linker(null),
+  view(null), mapped(false), pendingdebug(false)
 {
 }
 
 void Assembly::Clear()
 {
-  safe_delete_array(bytecode);
+  if(mapped)
+    bytecode = null;
+  else
+    safe_delete_array(bytecode);
+
+  if(view != null) UnmapViewOfFile(view);
+  view = null;
+  mapped = false;
+  pendingdebug = false;
+
   safe_delete_array(functions);
 
   functioncount = 0;
   curpos = 0;
+  capacity = 0;
+
+  lines.clear();
+  names.clear();
+
+  exports.clear();
+  externals.clear();
+  literals.clear();
+  literalindices.clear();
+  modules.clear();
+  linker = null;
 }
 
 
@@ -29,18 +54,18 @@ Assembly::~Assembly()
 
 bool Assembly::WriteDword(dword value)
 {
-  if(bytecode == null) bytecode = new dword[BufferSize];
-
-  bytecode[curpos ++] = value;
-
-  // expand the buffer on demand
-  if(curpos % BufferSize == 0) {
-    dword *buffer = new dword[curpos + BufferSize];
-    memcpy(buffer, bytecode, sizeof(dword) * curpos);
-    delete[] bytecode;
+  // expand the buffer on demand, doubling it keeps the cost of writing
+  // large programs linear
+  if(curpos == capacity) {
+    capacity = capacity < BufferSize ? BufferSize : capacity * 2;
+    dword *buffer = new dword[capacity];
+    if(bytecode != null) memcpy(buffer, bytecode, sizeof(dword) * curpos);
+    if(!mapped) delete[] bytecode;
     bytecode = buffer;
+    mapped = false;
   }
 
+  bytecode[curpos ++] = value;
   return true;
 }
 
@@ -62,32 +87,373 @@ dword Assembly::GetSize()
   return curpos;
 }
 
+void Assembly::AddLine(dword offset, dword line)
+{
+  ReadDebugInfo();
+  if(!lines.empty() && lines.back().second == line) return;
+  lines.push_back(make_pair(offset, line));
+}
+
+dword Assembly::GetLine(dword offset)
+{
+  ReadDebugInfo();
+
+  // the last change at or before offset
+  vector<pair<dword, dword> >::iterator i = upper_bound(lines.begin(), lines.end(), make_pair(offset, (dword)-1));
+  return i == lines.begin() ? 0 : (i - 1)->second;
+}
+
+void Assembly::AddName(dword offset, const string& name)
+{
+  ReadDebugInfo();
+  names[offset] = name;
+}
+
+const char* Assembly::GetName(dword offset)
+{
+  ReadDebugInfo();
+  map<dword, string>::iterator i = names.find(offset);
+  return i != names.end() ? (*i).second.c_str() : null;
+}
+
+dword Assembly::AddExternal(const string& name)
+{
+  vector<string>::iterator i = find(externals.begin(), externals.end(), name);
+  if(i != externals.end()) return (dword)(i - externals.begin());
+
+  externals.push_back(name);
+  return (dword)externals.size() - 1;
+}
+
+dword Assembly::AddLiteral(const string& text)
+{
+  if(literalindices.size() != literals.size()) {
+    literalindices.clear();
+    for(dword i = 0; i < literals.size(); i ++)
+      literalindices[literals[i]] = i;
+  }
+
+  map<string, dword>::iterator i = literalindices.find(text);
+  if(i != literalindices.end()) return (*i).second;
+
+  literals.push_back(text);
+  literalindices[text] = (dword)literals.size() - 1;
+  return (dword)literals.size() - 1;
+}
+
+
+//*** Files
+
+dword Assembly::Checksum(const byte *data, size_t size, dword adler)
+{
+  dword a = adler & 0xffff, b = adler >> 16;
+
+  // the sums can go 5552 bytes before they have to be reduced
+  while(size > 0) {
+    size_t count = size < 5552 ? size : 5552;
+    size -= count;
+
+    while(count -- > 0) {
+      a += *(data ++);
+      b += a;
+    }
+
+    a %= 65521;
+    b %= 65521;
+  }
+
+  return (b << 16) | a;
+}
+
+// appends a string to the dwords of a section, padded to a whole dword
+static void AddString(vector<dword>& data, const string& s)
+{
+  data.push_back((dword)s.size());
+
+  size_t start = data.size();
+  data.resize(start + (s.size() + sizeof(dword) - 1) / sizeof(dword), 0);
+  if(!s.empty()) memcpy(&data[start], s.c_str(), s.size());
+}
 
-bool Assembly::Save(const char *filename)
+bool Assembly::Save(const char *filename, bool debug)
 {
+  vector<dword> sections[SectionCount];
+
+  sections[CodeSection].assign(bytecode, bytecode + curpos);
+
+  vector<dword>& imports = sections[ImportSection];
+  imports.push_back(functioncount);
+  for(dword i = 0; i < functioncount; i ++) {
+    AddString(imports, functions[i]->name);
+    imports.push_back(functions[i]->paramcount);
+    imports.push_back(functions[i]->returncount);
+    imports.push_back(functions[i]->popparams);
+  }
+
+  sections[ExternalSection].push_back((dword)externals.size());
+  for(dword i = 0; i < externals.size(); i ++)
+    AddString(sections[ExternalSection], externals[i]);
+
+  sections[LiteralSection].push_back((dword)literals.size());
+  for(dword i = 0; i < literals.size(); i ++)
+    AddString(sections[LiteralSection], literals[i]);
+
+  vector<dword>& exported = sections[ExportSection];
+  exported.push_back((dword)exports.size());
+  for(dword i = 0; i < exports.size(); i ++) {
+    AddString(exported, exports[i].name);
+    exported.push_back(exports[i].offset);
+    exported.push_back(exports[i].returntype);
+    exported.push_back((dword)exports[i].paramtypes.size());
+    exported.insert(exported.end(), exports[i].paramtypes.begin(), exports[i].paramtypes.end());
+  }
+
+  if(debug) {
+    ReadDebugInfo();
+
+    sections[LineSection].push_back((dword)lines.size());
+    for(dword i = 0; i < lines.size(); i ++) {
+      sections[LineSection].push_back(lines[i].first);
+      sections[LineSection].push_back(lines[i].second);
+    }
+
+    sections[NameSection].push_back((dword)names.size());
+    for(map<dword, string>::iterator i = names.begin(); i != names.end(); i ++) {
+      sections[NameSection].push_back((*i).first);
+      AddString(sections[NameSection], (*i).second);
+    }
+  }
+
+  // the file is put together in memory, the checksum covers the padding too
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = Magic;
+  header.version = Version;
+  header.byteorder = ByteOrder;
+
+  dword size = PageSize;
+  for(dword i = 0; i < SectionCount; i ++) {
+    if(sections[i].empty()) continue;
+
+    header.sections[i][0] = size;
+    header.sections[i][1] = (dword)(sections[i].size() * sizeof(dword));
+    size += (header.sections[i][1] + PageSize - 1) & ~(PageSize - 1);
+  }
+
+  vector<byte> data(size, 0);
+  for(dword i = 0; i < SectionCount; i ++) {
+    if(!sections[i].empty())
+      memcpy(&data[header.sections[i][0]], &sections[i][0], header.sections[i][1]);
+  }
+
+  header.codechecksum = Checksum(&data[header.sections[CodeSection][0]], header.sections[CodeSection][1]);
+  header.checksum = HeaderChecksum(header, &data[0]);
+  memcpy(&data[0], &header, sizeof(header));
+
   FILE *out = fopen(filename, "wb");
   if(out == null) return false;
-  fwrite(&curpos, sizeof(dword), 1, out);
-  fwrite(bytecode, sizeof(dword), curpos, out);
-  fclose(out);
-  return true;
+
+  bool ok = fwrite(&data[0], 1, size, out) == size;
+  ok = fclose(out) == 0 && ok;
+  return ok;
+}
+
+// reads the dwords of a section, failing once past the end of it
+struct SectionReader
+{
+  const dword *p, *end;
+
+  bool Read(dword& value)
+  {
+    if(p == end) return false;
+    value = *(p ++);
+    return true;
+  }
+
+  bool Read(string& s)
+  {
+    dword length;
+    if(!Read(length) || length > (dword)(end - p) * sizeof(dword)) return false;
+
+    s.assign((const char *)p, length);
+    p += (length + sizeof(dword) - 1) / sizeof(dword);
+    return true;
+  }
+};
+
+dword Assembly::HeaderChecksum(const FileHeader& header, const byte *data)
+{
+  FileHeader copy = header;
+  copy.checksum = 0;
+
+  dword adler = Checksum((const byte *)&copy, sizeof(copy));
+  for(dword i = ImportSection; i <= LiteralSection; i ++)
+    adler = Checksum(data + header.sections[i][0], header.sections[i][1], adler);
+
+  return adler;
 }
 
-bool Assembly::Load(const char *filename)
+bool Assembly::Load(const char *filename, ImportList& importlist, bool verify)
 {
   Clear();
 
-  FILE *in = fopen(filename, "rb");
-  if(in == null) return false;
+  HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, null, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, null);
+  if(file == INVALID_HANDLE_VALUE) return false;
+
+  // a copy on write view, the pages that are written to become private
+  DWORD size = GetFileSize(file, null);
+  HANDLE mapping = size >= sizeof(FileHeader) && size != INVALID_FILE_SIZE ?
+    CreateFileMapping(file, null, PAGE_WRITECOPY, 0, 0, null) : null;
+  CloseHandle(file);
+  if(mapping == null) return false;
+
+  view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(mapping);
+  if(view == null) return false;
+
+  if(!ReadSections(size, importlist, verify)) {
+    Clear();
+    return false;
+  }
+
+  return true;
+}
+
+bool Assembly::ReadSections(dword size, ImportList& importlist, bool verify)
+{
+  const byte *data = (const byte *)view;
+  FileHeader& header = *(FileHeader *)view;
+
+  if(header.magic != Magic || header.version != Version || header.byteorder != ByteOrder) return false;
+
+  SectionReader sections[SectionCount];
+  for(dword i = 0; i < SectionCount; i ++) {
+    dword offset = header.sections[i][0], length = header.sections[i][1];
+    if(offset % PageSize != 0 || length % sizeof(dword) != 0 || offset > size || length > size - offset)
+      return false;
+
+    sections[i].p = (const dword *)(data + offset);
+    sections[i].end = sections[i].p + length / sizeof(dword);
+  }
+
+  // only the pages of the code that run are read, unless the code is verified
+  if(HeaderChecksum(header, data) != header.checksum) return false;
+
+  // the code is used where it is, it ends with an exit at least
+  dword codesize = (dword)(sections[CodeSection].end - sections[CodeSection].p);
+  if(codesize < 2) return false;
+
+  if(verify && Checksum(data + header.sections[CodeSection][0], header.sections[CodeSection][1]) != header.codechecksum)
+    return false;
+
+  bytecode = (dword *)sections[CodeSection].p;
+  curpos = capacity = codesize;
+  mapped = true;
+
+  SectionReader& imports = sections[ImportSection];
+  dword count;
+  if(!imports.Read(count) || count > (dword)(imports.end - imports.p)) return false;
+
+  Function **pointers = new Function*[count];
+  SetFunctions(pointers, count);
+
+  for(dword i = 0; i < count; i ++) {
+    string name;
+    dword paramcount, returncount, popparams;
+    if(!imports.Read(name) || !imports.Read(paramcount) || !imports.Read(returncount) || !imports.Read(popparams))
+      return false;
+
+    Function *function = importlist.Find(name);
+    if(function == null || function->paramcount != paramcount || function->returncount != returncount ||
+      function->popparams != (popparams != 0))
+      return false;
+
+    pointers[i] = function;
+  }
+
+  // the ops have to end with the code and call the imports there are
+  if(verify) {
+    const dword *cp = sections[CodeSection].p, *end = sections[CodeSection].end;
+    while(cp < end) {
+      dword opsize = Assembler::OpSize(cp[0]);
+      if(opsize > (dword)(end - cp) || (cp[0] == CALL && cp[1] >= count)) return false;
+      cp += opsize;
+    }
+  }
+
+  // the sections that are left out are empty
+  SectionReader& external = sections[ExternalSection];
+  if(external.Read(count)) {
+    if(count > (dword)(external.end - external.p)) return false;
+
+    externals.resize(count);
+    for(dword i = 0; i < count; i ++)
+      if(!external.Read(externals[i])) return false;
+  }
+
+  SectionReader& exported = sections[ExportSection];
+  if(exported.Read(count)) {
+    for(dword i = 0; i < count; i ++) {
+      Export function;
+      dword paramcount;
+      if(!exported.Read(function.name) || !exported.Read(function.offset) || !exported.Read(function.returntype) ||
+        !exported.Read(paramcount) || paramcount > (dword)(exported.end - exported.p) ||
+        function.offset >= codesize)
+        return false;
+
+      function.paramtypes.assign(exported.p, exported.p + paramcount);
+      exported.p += paramcount;
+      exports.push_back(function);
+    }
+  }
 
-  fread(&curpos, sizeof(dword), 1, in);
-  bytecode = new dword[curpos];
+  SectionReader& literal = sections[LiteralSection];
+  if(literal.Read(count)) {
+    if(count > (dword)(literal.end - literal.p)) return false;
 
-  fread(bytecode, sizeof(dword), curpos, in);
-  fclose(in);
+    literals.resize(count);
+    for(dword i = 0; i < count; i ++)
+      if(!literal.Read(literals[i])) return false;
+  }
+
+  pendingdebug = true;
   return true;
 }
 
+void Assembly::ReadDebugInfo()
+{
+  if(!pendingdebug) return;
+  pendingdebug = false;
+
+  // the bounds and the checksum were checked by ReadSections()
+  FileHeader& header = *(FileHeader *)view;
+  SectionReader sections[SectionCount];
+  for(dword i = LineSection; i <= NameSection; i ++) {
+    sections[i].p = (const dword *)((const byte *)view + header.sections[i][0]);
+    sections[i].end = sections[i].p + header.sections[i][1] / sizeof(dword);
+  }
+
+  dword count;
+  SectionReader& line = sections[LineSection];
+  if(line.Read(count)) {
+    for(dword i = 0; i < count; i ++) {
+      dword offset, number;
+      if(!line.Read(offset) || !line.Read(number)) break;
+      lines.push_back(make_pair(offset, number));
+    }
+  }
+
+  SectionReader& name = sections[NameSection];
+  if(name.Read(count)) {
+    for(dword i = 0; i < count; i ++) {
+      dword offset;
+      string s;
+      if(!name.Read(offset) || !name.Read(s)) break;
+      names[offset] = s;
+    }
+  }
+}
+
 bool Assembly::SetFunctions(Function **functions, dword functioncount)
 {
   safe_delete_array(this->functions);
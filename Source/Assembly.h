@@ -5,6 +5,7 @@
 
 #include <string>
 #include <vector>
+#include <map>
 
 using namespace std;
 
@@ -28,18 +29,91 @@ public:
 };
 
 
+// a function of a module that the scripts linked with the module can call
+// (see Linker), the types are the DataType values the compiler inferred
+struct Export
+{
+  string name;
+  dword offset;               // the offset of the FRAME op of the function
+  vector<dword> paramtypes;   // the type of every parameter
+  dword returntype;           // the type of the values it returns
+};
+
+class Linker;
+class ImportList;
+
 class Assembly
 {
   friend class Assembler;
+  friend class Linker;
 
   Function **functions;
   dword functioncount;
 
   dword *bytecode;
   dword curpos;
+  dword capacity;   // the size of the bytecode buffer in dwords
+
+  // the source lines and the names of the variables the ops access, written
+  // by the compiler, the profiles refer to them (see Profile)
+  vector<pair<dword, dword> > lines;  // (offset, line) where the line changes
+  map<dword, string> names;           // by offset
+
+  // the functions of a module, and the names of the functions of other
+  // modules the CALLM ops call, by operand
+  vector<Export> exports;
+  vector<string> externals;
+
+  // the constant pool of the string literals, by the operand of the SLIT
+  // ops, every literal is there once
+  vector<string> literals;
+  map<string, dword> literalindices;  // rebuilt when it misses some of literals
+
+  // the modules linked into the code and the offsets their code starts at
+  vector<pair<Assembly *, dword> > modules;
+  Linker *linker;     // links in the modules that haven't been yet, or null
+
+  // the view of the file the assembly was loaded from, or null, the
+  // bytecode stays in it until it is written past its end
+  void *view;
+  bool mapped;        // true if the bytecode is in view
+  bool pendingdebug;  // true until the lines and the names in view are read
   
   enum Constant { BufferSize = 1024 };
 
+  // the file Save() writes is a header followed by the sections, each one
+  // starts on a page of its own so that the code can be used where it is mapped
+  // a file written on a machine with the other byte order is rejected
+  enum Format { Magic = 0x43425954, Version = 3, ByteOrder = 0x01020304, PageSize = 4096 };   // "TYBC"
+  enum Section { CodeSection, ImportSection, ExternalSection, ExportSection, LiteralSection, LineSection,
+    NameSection, SectionCount };
+
+  struct FileHeader
+  {
+    dword magic;
+    dword version;
+    dword byteorder;
+    dword checksum;                   // Adler-32 of the header and the sections that are read
+                                      // on load, the code and the debug info are left out
+    dword codechecksum;               // Adler-32 of the code, only a verifying load checks it
+    dword sections[SectionCount][2];  // the offset and the size of every section in bytes
+  };
+
+  // returns the checksum of the header and the sections Load() reads, the
+  // checksum of the header counts as 0
+  static dword HeaderChecksum(const FileHeader& header, const byte *data);
+
+  // reads the sections of the file in view, which is size bytes long
+  bool ReadSections(dword size, ImportList& importlist, bool verify);
+
+  // reads the lines and the names of the file in view the first time they
+  // are needed, a cold start doesn't pay for them
+  void ReadDebugInfo();
+
+  // returns the Adler-32 checksum of the data, adler is the checksum of the
+  // data before it
+  static dword Checksum(const byte *data, size_t size, dword adler = 1);
+
 public:
 
   Function** GetFunctions() { return functions; }
@@ -51,42 +125,77 @@ public:
   dword* GetByteCode();
   dword GetSize();
 
+  // sets the source line of the op at offset and the ones that follow it
+  void AddLine(dword offset, dword line);
+  // returns the source line of the op at offset, 0 if it isn't known
+  dword GetLine(dword offset);
+
+  // sets the name of the variable the op at offset accesses
+  void AddName(dword offset, const string& name);
+  // returns the name of the variable the op at offset accesses, or null
+  const char* GetName(dword offset);
+
+  void AddExport(const Export& function) { exports.push_back(function); }
+  vector<Export>& GetExports() { return exports; }
+
+  // returns the index of the external function with the given name, adding it if necessary
+  dword AddExternal(const string& name);
+  vector<string>& GetExternals() { return externals; }
+
+  // returns the index of the literal in the constant pool, adding it if necessary
+  dword AddLiteral(const string& text);
+  vector<string>& GetLiterals() { return literals; }
+
+  Linker* GetLinker() { return linker; }
+
   void Clear();
 
-  // saves the bytecode to a file
-  bool Save(const char *filename);
+  // saves the assembly to a file, the imports are saved by name along with
+  // their parameters, debug saves the lines and the names of the variables too
+  bool Save(const char *filename, bool debug = true);
 
-  // loads the bytecode from file
-  bool Load(const char *filename);
+  // loads an assembly saved by Save(), the file is mapped rather than read,
+  // the processes that load it share the code until they write to it
+  // the imports are looked up in importlist by name and have to take the same
+  // parameters, fails if one of them doesn't or if the file is damaged
+  // the code is only read as it runs, so a damaged code section goes unnoticed
+  // unless verify is set, which checks its checksum and the calls in it and
+  // touches every page of it
+  bool Load(const char *filename, ImportList& importlist, bool verify = false);
 
   Assembly();
   ~Assembly();
 };
 
-struct Label;
-typedef vector<Label> LabelVector;
+struct Labels;
 
 // static class
 class Assembler
 {
-  static int AddLabel(string& name, LabelVector& labels);
+  // returns the index of the label with the given name, adding it if necessary
+  static dword AddLabel(const char *name, size_t length, Labels& labels);
+
+  // changes the label indices to code positions
+  static bool SetLabels(Assembly& assembly, Labels& labels);
 
-  // changes the label indices to code positions and clears the labels vector
-  static bool SetLabels(Assembly& assembly, LabelVector& labels);
+  // converts the length chars at s to an operand
+  static dword StringToOperand(const char *s, size_t length);
 
-  // converts a string to an operand using the info in opcode
-  static dword StringToOperand(string& s, struct OpDesc *opcode);
+  // finds the next word of the line between p and end, p is moved past it
+  // returns false if there are no more words
+  static bool NextWord(const char *&p, const char *end, const char *&word, size_t& length);
 
-  // reads a single word (w) from a string (s) starting at position (p)
-  static int NextWord(string& s, string& w, int p = 0);
+  // parses a single line of assembly source, end is the end of the line
+  static bool ParseLine(const char *line, const char *end, Assembly& assembly, Labels& labels);
+
+public:
 
   // returns true if this is a control opcode
   static bool IsJumpOp(dword opcode);
 
-  // parses a single line of assembly source
-  static bool ParseLine(string& line, int linecount, Assembly& assembly, LabelVector& labels);
-
-public:
+  // returns the size of an op in dwords, ops with more than one parameter
+  // are followed by a second pair of dwords
+  static dword OpSize(dword opcode);
 
   // converts source assembly to bytecode
   static bool Assemble(const char *filename, Assembly& assembly);
@@ -0,0 +1,93 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include "TyroDebug.h"
+
+
+//*** Batch compilation
+
+// the scripts of a batch, the threads take them one at a time until there
+// are none left, so that a few large ones don't keep the rest waiting
+struct Batch
+{
+  Compiler *settings;       // the compiler the others copy their settings from
+  const char **filenames;
+  Assembly *assemblies;
+  ImportList *importlist;
+  dword count;
+
+  volatile LONG next;       // the index of the next script that hasn't been taken
+  volatile LONG compiled;   // the number of scripts compiled
+
+  CriticalSection lock;     // guards the stats of the settings
+};
+
+DWORD WINAPI Compiler::BatchThread(LPVOID batch)
+{
+  ((Batch *)batch)->settings->CompileScripts((Batch *)batch);
+  return 0;
+}
+
+void Compiler::CompileScripts(Batch *batch)
+{
+  Compiler compiler;
+  compiler.optimization = optimization;
+  compiler.unroll = unroll;
+  compiler.profile = profile;
+  compiler.cache = cache;
+  compiler.linker = linker;
+  compiler.module = module;
+
+  // the threads count on their own and add up at the end
+  CompileStats counts;
+  if(stats != null) compiler.stats = &counts;
+
+  for(;;) {
+    dword i = (dword)InterlockedIncrement(&batch->next) - 1;
+    if(i >= batch->count) break;
+
+    // a failed compilation can leave a part of the code behind
+    if(compiler.Compile(batch->filenames[i], batch->assemblies[i], *batch->importlist))
+      InterlockedIncrement(&batch->compiled);
+    else
+      batch->assemblies[i].Clear();
+  }
+
+  if(stats != null) {
+    batch->lock.Enter();
+    stats->Add(counts);
+    batch->lock.Leave();
+  }
+}
+
+dword Compiler::CompileBatch(const char *filenames[], Assembly assemblies[], dword count,
+  ImportList& importlist, dword threads)
+{
+  if(threads == 0) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threads = info.dwNumberOfProcessors;
+  }
+
+  if(threads > count) threads = count;
+  if(threads > MAXIMUM_WAIT_OBJECTS) threads = MAXIMUM_WAIT_OBJECTS;
+
+  Batch batch = { this, filenames, assemblies, &importlist, count, 0, 0 };
+
+  // the calling thread doesn't wait idly, it compiles as well
+  vector<HANDLE> handles;
+  for(dword i = 1; i < threads; i ++) {
+    HANDLE handle = CreateThread(null, 0, BatchThread, &batch, 0, null);
+    if(handle != null) handles.push_back(handle);
+  }
+
+  CompileScripts(&batch);
+
+  if(!handles.empty()) {
+    WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+    for(dword i = 0; i < handles.size(); i ++)
+      CloseHandle(handles[i]);
+  }
+
+  return (dword)batch.compiled;
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "Assembly.h"
+#include "Compiler.h"
+#include "Cache.h"
+#include "Linker.h"
+
+#include "TyroDebug.h"
+
+
+//*** SHA-256
+
+// the keys have to tell apart any two of the scripts that ever end up in
+// the same cache, which a hash as short as the ones of the symbol tables can't
+class Sha256
+{
+  dword state[8];
+  byte block[64];
+  dword used;           // the number of bytes in block
+  dword bits[2];        // the length of the message in bits, high and low
+
+  void Transform();
+
+public:
+
+  void Add(const void *data, size_t length);
+  void AddDword(dword value) { Add(&value, sizeof(value)); }
+
+  // returns the hash as 64 hex digits
+  string GetHex();
+
+  Sha256();
+};
+
+static const dword roundconstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define Rotate(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+Sha256::Sha256() : used(0)
+{
+  static const dword initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(state, initial, sizeof(state));
+  bits[0] = bits[1] = 0;
+}
+
+void Sha256::Transform()
+{
+  dword w[64];
+  for(dword i = 0; i < 16; i ++)
+    w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+
+  for(dword i = 16; i < 64; i ++) {
+    dword s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    dword s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  dword a = state[0], b = state[1], c = state[2], d = state[3];
+  dword e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for(dword i = 0; i < 64; i ++) {
+    dword t1 = h + (Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25)) + ((e & f) ^ (~e & g)) + roundconstants[i] + w[i];
+    dword t2 = (Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void Sha256::Add(const void *data, size_t length)
+{
+  const byte *p = (const byte *)data;
+
+  // the length counts bits, the low dword carries every 2^29 bytes
+  dword low = bits[1] + (dword)(length << 3);
+  if(low < bits[1]) bits[0] ++;
+  bits[0] += (dword)((unsigned __int64)length >> 29);
+  bits[1] = low;
+
+  while(length > 0) {
+    dword count = 64 - used < length ? 64 - used : (dword)length;
+    memcpy(block + used, p, count);
+    used += count;
+    p += count;
+    length -= count;
+
+    if(used == 64) {
+      Transform();
+      used = 0;
+    }
+  }
+}
+
+string Sha256::GetHex()
+{
+  // the padding, a single one bit, zeros and the length in bits
+  dword high = bits[0], low = bits[1];
+  byte one = 0x80, zero = 0;
+
+  Add(&one, 1);
+  while(used != 56) Add(&zero, 1);
+
+  byte length[8];
+  for(dword i = 0; i < 4; i ++) {
+    length[i] = (byte)(high >> (24 - i * 8));
+    length[i + 4] = (byte)(low >> (24 - i * 8));
+  }
+  Add(length, 8);
+
+  char hex[65];
+  for(dword i = 0; i < 8; i ++)
+    sprintf(hex + i * 8, "%08x", state[i]);
+
+  return hex;
+}
+
+
+//*** CompileCache
+
+CompileCache::CompileCache(const char *directory) : directory(directory)
+{
+}
+
+string CompileCache::GetPath(const string& key)
+{
+  return directory + "/" + key + ".tyc";
+}
+
+string CompileCache::GetKey(const char *source, size_t length, dword optimization, dword unroll,
+  bool module, ImportList& importlist, Linker *linker)
+{
+  Sha256 hash;
+  hash.AddDword(Version);
+  hash.AddDword(optimization);
+  hash.AddDword(unroll);
+  hash.AddDword(module);
+
+  // the imports decide which calls are calls and which are intrinsics, and
+  // the indices of the functions the bytecode calls
+  importlist.lock.Enter();
+  hash.AddDword((dword)importlist.functions.size());
+
+  forEach(FunctionTable, importlist.functions, i) {
+    Function *function = (*i).second;
+    hash.Add(function->name.c_str(), function->name.size() + 1);
+    hash.AddDword(function->paramcount);
+    hash.AddDword(function->returncount);
+    hash.AddDword(function->popparams);
+  }
+  importlist.lock.Leave();
+
+  // the calls to the functions of modules depend on their types
+  hash.AddDword(linker != null ? (dword)linker->functions.size() : 0);
+  if(linker != null) {
+    for(map<string, pair<dword, dword> >::iterator i = linker->functions.begin(); i != linker->functions.end(); i ++) {
+      const Export *function = linker->Find((*i).first);
+      hash.Add(function->name.c_str(), function->name.size() + 1);
+      hash.AddDword(function->returntype);
+      hash.AddDword((dword)function->paramtypes.size());
+      for(dword j = 0; j < function->paramtypes.size(); j ++)
+        hash.AddDword(function->paramtypes[j]);
+    }
+  }
+
+  hash.Add(source, length);
+  return hash.GetHex();
+}
+
+bool CompileCache::Load(const string& key, Assembly& assembly, ImportList& importlist)
+{
+  return assembly.Load(GetPath(key).c_str(), importlist);
+}
+
+bool CompileCache::Save(const string& key, Assembly& assembly)
+{
+  string path = GetPath(key);
+
+  // compilers on other threads may save the same script at the same time
+  char suffix[32];
+  sprintf(suffix, ".%u.tmp", (dword)GetCurrentThreadId());
+  string temp = path + suffix;
+
+  // the rename replaces the file at once, readers see the old or the new one
+  if(!assembly.Save(temp.c_str()) || !MoveFileEx(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+    DeleteFile(temp.c_str());
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Assembly.h"
+
+#include <string>
+
+
+class ImportList;
+class Linker;
+
+// a directory of compiled scripts, each one is stored in a file named after
+// a hash of everything the bytecode depends on: the source, the version of
+// the compiler, its settings and the imports the script can call
+// (see Compiler::SetCache())
+// the files are assemblies (see Assembly::Save()) written to a temporary
+// name and then renamed, so that a compiler never reads a file that is only
+// partly written
+class CompileCache
+{
+  string directory;
+
+  // the version of the compiler, a change that makes the bytecode differ
+  // has to be followed by a new version
+  enum Constant { Version = 2 };
+
+  string GetPath(const string& key);
+
+public:
+
+  // returns the key of the source compiled with the given settings, imports
+  // and modules, linker is null if there are none
+  static string GetKey(const char *source, size_t length, dword optimization, dword unroll,
+    bool module, ImportList& importlist, Linker *linker);
+
+  // loads the compiled script stored under key into assembly, false if there
+  // is none or if it calls a function that isn't in the import list
+  bool Load(const string& key, Assembly& assembly, ImportList& importlist);
+
+  // stores the compiled script under key
+  bool Save(const string& key, Assembly& assembly);
+
+  CompileCache(const char *directory);
+};
@@ -1,8 +1,13 @@
 #include "Assembly.h"
 #include "Compiler.h"
+#include "Profile.h"
+#include "Cache.h"
 #include "Lex.h"
 
 #include <stdarg.h>
+#include <io.h>
+#include <fcntl.h>
+#include <algorithm>
 
 #include "TyroDebug.h"
 
@@ -25,15 +30,23 @@ void yyerror(char *string)
 // extern from Parse.cpp
 int yyparse();
 
-Compiler* Compiler::active = null;
+__declspec(thread) Compiler* Compiler::active = null;
+CriticalSection Compiler::parsing;
 
-Compiler::Compiler() : tree(null), filename(null), errorcount(0)
+Compiler::Compiler() : tree(null), filename(null), errorcount(0), building(null), endline(0), optimization(1), unroll(4), profile(null), cache(null), linker(null), module(false), session(false),
+  stats(null), phaseallocations(0), nodecount(0), opcount(0)
 {
 }
 
 Compiler::~Compiler()
 {
-  safe_delete(tree);
+  // a failed compilation leaves its symbols behind
+  ClearMap(SymbolTable, constants);
+  ClearMap(SymbolTable, variables);
+  ClearMap(SymbolTable, functions);
+  ClearMap(SymbolTable, externals);
+  ClearMap(SymbolTable, literals);
+  ClearFunctions();
 }
 
 Symbol* Compiler::GetVariable(const char *name)
@@ -42,7 +55,7 @@ Symbol* Compiler::GetVariable(const char *name)
   
   // doesn't exist yet - create it
   if(i == variables.end()) {
-    Symbol *symbol = new Symbol (name, lineno);
+    Symbol *symbol = new Symbol (name, GetLine());
     variables.insert(SymbolTable::value_type(name, symbol));
     return symbol;
   }
@@ -55,7 +68,7 @@ Symbol* Compiler::GetConstant(const char *name)
   SymbolTable::iterator i = constants.find(name);
   
   if(i == constants.end()) {
-    Symbol *symbol = new Symbol (name, lineno);
+    Symbol *symbol = new Symbol (name, GetLine());
     constants.insert(SymbolTable::value_type(name, symbol));
     return symbol;
   }
@@ -68,7 +81,7 @@ Symbol* Compiler::GetFunction(const char *name)
   SymbolTable::iterator i = functions.find(name);
   
   if(i == functions.end()) {
-    Symbol *symbol = new Symbol (name, lineno);
+    Symbol *symbol = new Symbol (name, GetLine());
     functions.insert(SymbolTable::value_type(name, symbol));
     return symbol;
   }
@@ -76,22 +89,50 @@ Symbol* Compiler::GetFunction(const char *name)
   return (*i).second;
 }
 
+// a literal can hold any byte, so it is looked up by its length
+Symbol* Compiler::GetLiteral(const char *text, size_t length)
+{
+  SymbolTable::iterator i = literals.find(text, length);
+
+  if(i == literals.end()) {
+    string contents(text, length);
+    Symbol *symbol = new Symbol (contents.c_str(), GetLine());
+    symbol->contents = contents;
+    symbol->type = DT_STRING;
+    literals.insert(SymbolTable::value_type(contents, symbol));
+    return symbol;
+  }
+
+  return (*i).second;
+}
+
+dword Compiler::GetLine()
+{
+  return endline != 0 ? endline : lineno;
+}
+
 void Compiler::Error(const char *message, dword line)
 {
+  string text;
   if(filename != null) { 
-    printf("%s", filename);
+    char number[32];
     if(line != 0) 
-      printf("(%d) : ", line);
+      sprintf(number, "(%d) : ", line);
     else 
-      printf(" : ");
+      sprintf(number, " : ");
+
+    text = filename;
+    text += number;
   }
 
   if(message != null)
-    printf(message);
+    text += message;
   else
-    printf("unknown error");
+    text += "unknown error";
 
-  printf("\n");
+  // the whole message is written at once, so that the messages of
+  // compilers running on other threads don't get mixed up with it
+  printf("%s\n", text.c_str());
   errorcount ++;
 }
 
@@ -101,60 +142,306 @@ void Compiler::Error(const char *message, Node *node)
 }
 
 
-#define ClearMap(type, map) { forEach(type, map, i) delete (*i).second; map.clear(); }
 #define SetIndices(type, map) { dword j = 0; for(type::iterator i = map.begin(); i != map.end(); i ++, j ++) (*i).second->index = j; }
 
+static bool MoreAccesses(const pair<dword, Symbol *>& a, const pair<dword, Symbol *>& b)
+{
+  return a.first > b.first;
+}
+
+void Compiler::SetVariableIndices(SymbolTable& table, SymbolVector& first, const string& prefix)
+{
+  for(dword i = 0; i < first.size(); i ++)
+    first[i]->index = i;
+
+  // the number of accesses of each of the other variables
+  vector<pair<dword, Symbol *> > others;
+  forEach(SymbolTable, table, i) {
+    if(find(first.begin(), first.end(), (*i).second) != first.end()) continue;
+
+    dword accesses = profile != null ? profile->GetAccesses(prefix + (*i).first) : 0;
+    others.push_back(make_pair(accesses, (*i).second));
+  }
+
+  // without a profile the variables keep the order of the table
+  stable_sort(others.begin(), others.end(), MoreAccesses);
+
+  for(dword i = 0; i < others.size(); i ++)
+    others[i].second->index = (dword)first.size() + i;
+}
+
 bool Compiler::Compile(const char *filename, Assembly& assembly, ImportList& importlist)
 {
-  yyin = fopen(filename, "rt");
-  if(yyin == null) return false;
+  FILE *in = fopen(filename, "rt");
+  if(in == null) return false;
+
+  // the key of the cache is a hash of the source, which has to be read first
+  if(cache != null && profile == null && !session) {
+    string source;
+    char buffer[4096];
+    for(size_t count; (count = fread(buffer, 1, sizeof(buffer), in)) > 0; )
+      source.append(buffer, count);
+
+    fclose(in);
+    return Compile(source.c_str(), source.size(), filename, assembly, importlist);
+  }
+
+  // the lexer reads through the stream, a buffer the size of the file
+  // (up to a limit) lets it read the whole file at once
+  fseek(in, 0, SEEK_END);
+  long size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+
+  if(size > BUFSIZ)
+    setvbuf(in, null, _IOFBF, size < MaxReadBuffer ? size + 1 : MaxReadBuffer);
+
+  bool r = Compile(in, filename, assembly, importlist);
+  fclose(in);
+  return r;
+}
+
+// the source of a compilation from memory, that a thread writes to the pipe
+// the lexer reads from, when it doesn't fit the pipe at once
+struct PipeSource
+{
+  const char *source;
+  size_t length;
+  int pipe;         // the end of the pipe that is written to
+};
+
+static DWORD WINAPI WriteSource(LPVOID parameter)
+{
+  PipeSource *source = (PipeSource *)parameter;
+
+  // the write fails once the reader has closed the pipe after an error
+  while(source->length > 0) {
+    unsigned count = source->length < Compiler::PipeSize ? (unsigned)source->length : Compiler::PipeSize;
+    int written = _write(source->pipe, source->source, count);
+    if(written <= 0) break;
+
+    source->source += written;
+    source->length -= written;
+  }
+
+  _close(source->pipe);
+  return 0;
+}
+
+bool Compiler::Compile(const char *source, size_t length, const char *name, Assembly& assembly, ImportList& importlist)
+{
+  string key;
+  if(cache != null && profile == null && !session) {
+    key = CompileCache::GetKey(source, length, optimization, unroll, module, importlist, linker);
+    if(cache->Load(key, assembly, importlist)) return true;
+  }
+
+  // the lexer only reads from a stream, the source is passed to it
+  // through a pipe, so that it never touches the file system
+  int pipes[2];
+  if(_pipe(pipes, PipeSize, _O_BINARY) != 0) return false;
+
+  FILE *in = _fdopen(pipes[0], "rb");
+  if(in == null) {
+    _close(pipes[0]);
+    _close(pipes[1]);
+    return false;
+  }
+
+  PipeSource pipe = { source, length, pipes[1] };
+  HANDLE writer = null;
+
+  // short sources are written before the parse
+  if(length <= PipeSize)
+    WriteSource(&pipe);
+  else {
+    writer = CreateThread(null, 0, WriteSource, &pipe, 0, null);
+    if(writer == null) {
+      fclose(in);
+      _close(pipes[1]);
+      return false;
+    }
+  }
 
+  bool r = Compile(in, name, assembly, importlist);
+  fclose(in);
+
+  if(writer != null) {
+    WaitForSingleObject(writer, INFINITE);
+    CloseHandle(writer);
+  }
+
+  if(r && !key.empty())
+    cache->Save(key, assembly);
+
+  return r;
+}
+
+bool Compiler::Compile(FILE *in, const char *name, Assembly& assembly, ImportList& importlist)
+{
+  bool r = CompileStream(in, name, assembly, importlist);
+  if(!r && session) RestoreSession();
+  return r;
+}
+
+bool Compiler::CompileStream(FILE *in, const char *name, Assembly& assembly, ImportList& importlist)
+{
   active = this;
   errorcount = 0;
-  this->filename = filename;
+  this->filename = name;
+  BeginPhases();
+
+  // drop whatever is left over from a failed compilation
+  tree = null;
+  arena.Clear();
+  ClearMap(SymbolTable, constants);
+  if(!session) ClearMap(SymbolTable, variables);
+  ClearMap(SymbolTable, functions);
+  ClearMap(SymbolTable, externals);
+  ClearMap(SymbolTable, literals);
+  ClearFunctions();
 
   // build the syntax tree from source
+  parsing.Enter();
+  yyin = in;
+  lineno = 1;
+  endline = 0;
+
   yyparse();
 
-  fclose(yyin);
   yyin = null;
+  endline = lineno;
+  parsing.Leave();
 
+  EndPhase(CompileStats::Parse);
   if(tree == null) return false;
 
-  // set symbol indices
-  SetIndices(SymbolTable, variables);
+  // these remove functions from the table, so they go before the indices are set
+  // the functions defined in the script take precedence over the intrinsics
+  CollectFunctions(tree);
+  ResolveModules(tree, importlist);
+  ResolveIntrinsics(tree, importlist);
 
   // set function indices
   SetIndices(SymbolTable, functions);
+  EndPhase(CompileStats::Functions);
 
   // clear the assembly (just in case it contained something)
-  assembly.Clear();
+  // a session appends to the code of the snippets before
+  if(!session) assembly.Clear();
 
   // move the functions from the symbol table to the assembly (using the list of imports)
   // we do it before checking semantics because this function sets Symbol::data which CheckSemantics needs
   MoveFunctions(assembly, importlist);
-
+  EndPhase(CompileStats::Imports);
     
   // check the semantics
   CheckSemantics(tree);
 
+  EndPhase(CompileStats::Semantics);
   if(errorcount > 0) return false;
+
+  // the passes over the tree and the SSA optimizer take the code they see
+  // for the whole program, so a session only runs the peephole optimizer
+  if(optimization > 0 && !session) {
+    ForEachBody(tree, &Compiler::FoldConstants);
+    ForEachBody(tree, &Compiler::RemoveBoundsChecks);
+    ForEachBody(tree, &Compiler::OptimizeLoops);
+    ForEachBody(tree, &Compiler::FormSwitches);
+    FindInlines();
+  }
+
+  EndPhase(CompileStats::Optimize);
+
+  // put the literals in the constant pool, folding may have added some
+  // a session keeps the pool of the snippets before
+  forEach(SymbolTable, literals, i)
+    (*i).second->index = assembly.AddLiteral(string((*i).first, (*i).length));
   
   // build op sequence
   Op *op = Build(tree);
-  if(op == null) return false;
+  if(op == null) {
+    EndPhase(CompileStats::Build);
+    return false;
+  }
+
+  // set variable indices, Build() may have added hidden variables
+  // the variables of the earlier snippets of a session keep theirs
+  SymbolVector none;
+  SetVariableIndices(variables, session ? sessionvariables : none, "");
+  locals = (dword)variables.size();
+
+  if(session)
+    op = ConvertWidened(op);
+
+  // the functions the program calls, all of them in a module
+  if(module) {
+    forEach(SymbolTable, scripts, i)
+      ((ScriptFunction *)(*i).second->data)->called = true;
+  }
+
+  BuildFunctions();
+
+  if(stats != null) {
+    stats->symbols += (dword)(variables.size() + constants.size() + functions.size() + scripts.size());
+    forEach(SymbolTable, scripts, i)
+      stats->symbols += (dword)((ScriptFunction *)(*i).second->data)->locals.size();
+  }
+
+  EndPhase(CompileStats::Build);
+
+  if(optimization > 1 && !session) {
+    op = OptimizeSSA(op, locals, none);
+
+    forEach(SymbolTable, scripts, i) {
+      ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+      if(function->code != null)
+        function->code = OptimizeSSA(function->code, function->localcount, function->params);
+    }
+  }
+
+  EndPhase(CompileStats::SSA);
+
+  op = LinkFunctions(op);
+
+  if(optimization > 0)
+    op = Peephole(op);
+
+  EndPhase(CompileStats::Peephole);
+
+  if(profile != null && !session)
+    op = LayoutBlocks(op);
+
+  EndPhase(CompileStats::Layout);
 
   // convert op sequence to bytecode
+  dword start = assembly.GetSize();
   Assemble(op, assembly);
+  if(module) ExportFunctions(assembly);
+  if(stats != null) stats->code += assembly.GetSize() - start;
+
+  if(session) {
+    sessionvariables.assign(variables.size(), null);
+    forEach(SymbolTable, variables, i)
+      sessionvariables[(*i).second->index] = (*i).second;
+
+    sessiontypes.clear();
+    for(dword i = 0; i < sessionvariables.size(); i ++)
+      sessiontypes.push_back(sessionvariables[i]->type);
+  }
 
   // clear the symbol tables
   ClearMap(SymbolTable, constants);
-  ClearMap(SymbolTable, variables);
+  if(!session) ClearMap(SymbolTable, variables);
 
   ClearMap(SymbolTable, functions);
-
-  // delete the op sequence
-  safe_delete(op);
+  ClearMap(SymbolTable, externals);
+  ClearMap(SymbolTable, literals);
+  ClearFunctions();
+
+  // delete the syntax tree and the op sequence
+  EndPhase(CompileStats::Assemble);
+  tree = null;
+  arena.Clear();
   
   active = null;
   errorcount = 0;
@@ -162,6 +449,59 @@ bool Compiler::Compile(const char *filename, Assembly& assembly, ImportList& imp
   return true;
 }
 
+void Compiler::BeginSession()
+{
+  EndSession();
+  session = true;
+}
+
+void Compiler::EndSession()
+{
+  session = false;
+  sessionvariables.clear();
+  sessiontypes.clear();
+  sessionimports.clear();
+  ClearMap(SymbolTable, variables);
+}
+
+void Compiler::RestoreSession()
+{
+  // the variables of the failed snippet are dropped, the others get back their types
+  vector<string> added;
+  forEach(SymbolTable, variables, i) {
+    if(find(sessionvariables.begin(), sessionvariables.end(), (*i).second) == sessionvariables.end())
+      added.push_back((*i).first);
+  }
+
+  for(dword i = 0; i < added.size(); i ++) {
+    SymbolTable::iterator j = variables.find(added[i]);
+    delete (*j).second;
+    variables.erase(j);
+  }
+
+  for(dword i = 0; i < sessionvariables.size(); i ++)
+    sessionvariables[i]->type = sessiontypes[i];
+}
+
+Op* Compiler::ConvertWidened(Op *op)
+{
+  // a variable an earlier snippet left an int in that now holds floats
+  // is converted before the snippet runs, bools are stored as ints
+  for(dword i = 0; i < sessionvariables.size(); i ++) {
+    Symbol *symbol = sessionvariables[i];
+    if(symbol->type != DT_FLOAT || (sessiontypes[i] != DT_INT && sessiontypes[i] != DT_BOOL)) continue;
+
+    Op *load = new Op(LOAD, symbol), *convert = new Op(I2F), *store = new Op(STORE, symbol), *pop = new Op(POP);
+    load->next = convert;
+    convert->next = store;
+    store->next = pop;
+    pop->next = op;
+    op = load;
+  }
+
+  return op;
+}
+
 bool Compiler::CheckFunctionSemantics(Node *node)
 {
 
@@ -196,15 +536,113 @@ bool Compiler::CheckFunctionSemantics(Node *node)
 }
 
 
+void Compiler::PostOrder(Node *node, NodeVector& order)
+{
+  order.clear();
+  if(node == null) return;
+
+  // nodes are taken off the stack parent first, so the reversed
+  // output has every child before its parent (and left before right)
+  NodeVector stack;
+  stack.push_back(node);
+
+  while(!stack.empty()) {
+    Node *n = stack.back();
+    stack.pop_back();
+    order.push_back(n);
+
+    for(int i = 0; i < sizeof(n->child)/sizeof(Node *); i ++) {
+      if(n->child[i] != null) stack.push_back(n->child[i]);
+    }
+  }
+
+  reverse(order.begin(), order.end());
+}
+
+bool Compiler::CheckScriptCall(Node *node)
+{
+  ScriptFunction *function = (ScriptFunction *)node->symbol->data;
+
+  vector<Node **> args;
+  GetArguments(node->child[0], args);
+
+  if(args.size() == function->params.size()) return true;
+
+  char buffer[256];
+  sprintf(buffer, "\'%s\' : function does not take %d parameters", node->symbol->contents.c_str(), (int)args.size());
+  Error(buffer, node);
+  return false;
+}
+
 bool Compiler::CheckSemantics(Node *node)
 {
-  for(int i = 0; i < sizeof(node->child)/sizeof(Node *); i ++) {
-    if(node->child[i] != null) {
-      CheckSemantics(node->child[i]);
+  // the functions are checked along with the program, the types of their
+  // parameters and return values depend on the calls and the other way round
+  NodeVector order;
+  PostOrderAll(node, order);
+
+  // a variable has the type of the widest value assigned to it, since
+  // types only ever widen this takes a few rounds at most
+  bool changed;
+  do {
+    changed = false;
+    for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+      if(InferType(*i)) changed = true;
     }
+  } while(changed);
+
+  bool r = true;
+  for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+    if(CheckNode(*i) == false) r = false;
   }
 
-  // set the return type
+  return r;
+}
+
+static bool IsArray(DataType type)
+{
+  return type == DT_INTARRAY || type == DT_FLOATARRAY;
+}
+
+// arrays and strings are handles to objects of the virtual machine
+static bool IsHandle(DataType type)
+{
+  return IsArray(type) || type == DT_STRING;
+}
+
+// returns the type of the elements of an array
+static DataType ElementType(DataType type)
+{
+  return type == DT_FLOATARRAY ? DT_FLOAT : DT_INT;
+}
+
+// true if a variable of the first type can hold a value of the second,
+// arrays and strings only go into variables that hold the same type
+static bool Compatible(DataType variable, DataType value)
+{
+  return variable == value || (!IsHandle(variable) && !IsHandle(value));
+}
+
+// returns the type of a variable that is assigned values of both types
+static DataType Join(DataType a, DataType b)
+{
+  if(a == DT_VOID) return b;
+  if(b == DT_VOID) return a;
+
+  // a variable that is assigned an array or a string stays one, CheckNode()
+  // reports the values of other types
+  if(IsHandle(a)) return a;
+  if(IsHandle(b)) return b;
+
+  if(a == DT_FLOAT || b == DT_FLOAT) return DT_FLOAT;
+  if(a == DT_BOOL && b == DT_BOOL) return DT_BOOL;
+  return DT_INT;
+}
+
+bool Compiler::InferType(Node *node)
+{
+  DataType type;
+
   switch (node->type)  {
     case NT_ERROR:
       break;
@@ -215,11 +653,53 @@ bool Compiler::CheckSemantics(Node *node)
     case NT_EXPR:
     case NT_WHILE:
     case NT_DOWHILE:
+    case NT_FOR:
+    case NT_SWITCH:
+    case NT_CASE:
+    case NT_DEFAULT:
     case NT_IFTHEN:
     case NT_IFTHENELSE: 
+    case NT_FUNCTION:
+      node->rettype = DT_VOID;
+      break;
+
+    // a function returns the widest type of the values it returns
+    case NT_RETURN:
       node->rettype = DT_VOID;
+      if(node->symbol == null) break;
+
+      type = Join(node->symbol->type, node->child[0] != null ? node->child[0]->rettype : DT_INT);
+      if(type != node->symbol->type) {
+        node->symbol->type = type;
+        return true;
+      }
+      break;
+
+    // the types of a function of a module are fixed
+    case NT_CALLM:
+      node->rettype = node->symbol->type;
       break;
 
+    // a parameter has the widest type of the arguments passed to it
+    case NT_CALLS:
+      node->rettype = node->symbol->type != DT_VOID ? node->symbol->type : DT_INT;
+      {
+        SymbolVector& params = ((ScriptFunction *)node->symbol->data)->params;
+        vector<Node **> args;
+        GetArguments(node->child[0], args);
+
+        bool changed = false;
+        for(dword i = 0; i < args.size() && i < params.size(); i ++) {
+          type = Join(params[i]->type, (*args[i])->rettype);
+          if(type != params[i]->type) {
+            params[i]->type = type;
+            changed = true;
+          }
+        }
+
+        return changed;
+      }
+
     case NT_EQUAL:
     case NT_NEQUAL:
     case NT_LESS:
@@ -231,20 +711,173 @@ bool Compiler::CheckSemantics(Node *node)
       node->rettype = DT_BOOL;
       break;
 
+    // the operation is done on floats if either operand is a float,
+    // adding strings concatenates them
     case NT_ADD:
+      if(node->child[0]->rettype == DT_STRING || node->child[1]->rettype == DT_STRING) {
+        node->rettype = DT_STRING;
+        break;
+      }
     case NT_SUB:
     case NT_MUL:
     case NT_DIV:
-    case NT_ASSIGN:
-      node->rettype = DT_INT;
+      if(node->child[0]->rettype == DT_FLOAT || node->child[1]->rettype == DT_FLOAT)
+        node->rettype = DT_FLOAT;
+      else
+        node->rettype = DT_INT;
       break;
 
-    case NT_IDENT:
+    case NT_MOD:
+    case NT_BAND:
+    case NT_BOR:
+    case NT_BXOR:
+    case NT_BNOT:
+    case NT_SHL:
+    case NT_SAR:
+    case NT_CALL:
+    case NT_POPCOUNT:
+    case NT_CLZ:
+    case NT_CTZ:
+    case NT_ROTL:
+    case NT_ROTR:
+    case NT_BSWAP:
+    case NT_LENGTH:
+    case NT_STREQUAL:
+    case NT_STRCOMPARE:
+    case NT_CHARAT:
+    case NT_FIND:
+    case NT_HASH:
+    case NT_PRINTS:
     case NT_INT:
       node->rettype = DT_INT;
       break;
+
+    case NT_STRING:
+    case NT_SUBSTRING:
+      node->rettype = DT_STRING;
+      break;
+
+    case NT_ELEMENT:
+    case NT_SETELEMENT:
+    case NT_ELEMENT_INRANGE:
+    case NT_SETELEMENT_INRANGE:
+    case NT_DOT:
+    case NT_SUM:
+      node->rettype = ElementType(node->child[0]->rettype);
+      break;
+
+    case NT_INTARRAY:
+      node->rettype = DT_INTARRAY;
+      break;
+
+    case NT_FLOATARRAY:
+      node->rettype = DT_FLOATARRAY;
+      break;
+
+    // these return the array they are given, the destination of the kernels
+    case NT_FILL:
+    case NT_SLICE:
+    case NT_VADD:
+    case NT_VMUL:
+    case NT_VLESS:
+    case NT_VSELECT:
+      {
+        vector<Node **> operands;
+        GetOperands(node, operands);
+        node->rettype = (*operands[0])->rettype;
+      }
+      break;
+
+    case NT_ASSIGN:
+      type = Join(node->symbol->type, node->child[0]->rettype);
+      node->rettype = type;
+
+      if(type != node->symbol->type) {
+        node->symbol->type = type;
+        return true;
+      }
+      break;
+
+    // variables that are never assigned are ints
+    case NT_IDENT:
+      node->rettype = node->symbol->type != DT_VOID ? node->symbol->type : DT_INT;
+      break;
+
+    case NT_FLOAT:
+    case NT_COERCE_TO_FLOAT:
+      node->rettype = DT_FLOAT;
+      break;
+
+    case NT_BOOL:
+      node->rettype = DT_BOOL;
+      break;
+  }
+
+  return false;
+}
+
+// wraps node in a conversion to float unless it is a float already
+static void CoerceToFloat(Node *&node)
+{
+  if(node->rettype == DT_FLOAT) return;
+
+  Node *coerce = new Node(NT_COERCE_TO_FLOAT, node);
+  coerce->rettype = DT_FLOAT;
+  coerce->line = node->line;
+  node = coerce;
+}
+
+// returns the error of an operator that isn't defined for arrays or strings
+// if one of the operands of node is one, null if there is none
+static const char* HandleOperands(Node *node)
+{
+  for(int i = 0; i < 2 && node->child[i] != null; i ++) {
+    if(IsArray(node->child[i]->rettype)) return "operation is illegal for array operands";
+    if(node->child[i]->rettype == DT_STRING) return "operation is illegal for string operands";
+  }
+
+  return null;
+}
+
+bool Compiler::CheckModuleCall(Node *node)
+{
+  const Export *function = (const Export *)node->symbol->data;
+  char buffer[256];
+
+  vector<Node **> args;
+  GetArguments(node->child[0], args);
+
+  if(args.size() != function->paramtypes.size()) {
+    sprintf(buffer, "\'%s\' : function does not take %d parameters", node->symbol->contents.c_str(), (int)args.size());
+    Error(buffer, node);
+    return false;
+  }
+
+  // the types of the parameters were settled when the module was compiled
+  for(dword i = 0; i < args.size(); i ++) {
+    if(!Compatible((DataType)function->paramtypes[i], (*args[i])->rettype)) {
+      sprintf(buffer, "\'%s\' : parameter %d of the module function has another type", node->symbol->contents.c_str(), i + 1);
+      Error(buffer, node);
+      return false;
+    } else if(function->paramtypes[i] == DT_FLOAT)
+      CoerceToFloat(*args[i]);
+    else if((*args[i])->rettype == DT_FLOAT) {
+      sprintf(buffer, "\'%s\' : parameter %d of the module function is not a float", node->symbol->contents.c_str(), i + 1);
+      Error(buffer, node);
+      return false;
+    }
   }
 
+  return true;
+}
+
+bool Compiler::CheckNode(Node *node)
+{
+  char buffer[256];
+  const char *problem;
+
+  // set the return type
+  InferType(node);
 
   // check semantics
   switch (node->type)  {
@@ -254,291 +887,884 @@ bool Compiler::CheckSemantics(Node *node)
 
     case NT_WHILE:
     case NT_DOWHILE:
+    case NT_FOR:
       break;
 
+    case NT_SWITCH:
+      if(node->child[0]->rettype == DT_FLOAT || IsHandle(node->child[0]->rettype)) {
+        Error("switch value must be an int", node);
+        return false;
+      }
+      {
+        NodeVector cases;
+        dword defaults;
+        GetCases(node, cases, &defaults);
+
+        if(defaults > 1) {
+          Error("switch has more than one default case", node);
+          return false;
+        }
+
+        for(dword i = 1; i < cases.size(); i ++) {
+          if(cases[i]->child[0]->symbol->ToDword() == cases[i - 1]->child[0]->symbol->ToDword()) {
+            sprintf(buffer, "case value \'%s\' is used more than once", cases[i]->child[0]->symbol->contents.c_str());
+            Error(buffer, cases[i]);
+            return false;
+          }
+        }
+      }
+      break;
+
+    // case values are folded here, so that they can be constant expressions
+    case NT_CASE:
+      {
+        NodeVector order;
+        PostOrder(node->child[0], order);
+        for(NodeVector::iterator i = order.begin(); i != order.end(); i ++)
+          FoldNode(*i);
+      }
+
+      if(node->child[0]->type != NT_INT) {
+        Error("case value must be an int constant", node);
+        return false;
+      }
+      break;
+
+    // arrays are only assigned, indexed and passed to functions, strings
+    // are also added and compared
+    case NT_BOOLAND:
+    case NT_BOOLOR:
+      problem = HandleOperands(node);
+      if(problem != null) {
+        Error(problem, node);
+        return false;
+      }
+      break;
+
+    case NT_ADD:
+      if(node->rettype == DT_STRING) {
+        if(node->child[0]->rettype != DT_STRING || node->child[1]->rettype != DT_STRING) {
+          Error("a string can only be added to a string", node);
+          return false;
+        }
+        break;
+      }
+
+      problem = HandleOperands(node);
+      if(problem != null) {
+        Error(problem, node);
+        return false;
+      }
+
+      if(node->child[0]->rettype == DT_FLOAT || node->child[1]->rettype == DT_FLOAT) {
+        CoerceToFloat(node->child[0]);
+        CoerceToFloat(node->child[1]);
+      }
+      break;
+
+    // a comparison of strings becomes a comparison of the int the string
+    // comparison returns with a constant, so the other passes only see ints
     case NT_EQUAL:
     case NT_NEQUAL:
     case NT_LESS:
     case NT_LEQUAL:
     case NT_GREATER:
     case NT_GEQUAL:
-    case NT_BOOLAND:
-    case NT_BOOLOR:
-      break;
+      if(node->child[0]->rettype == DT_STRING && node->child[1]->rettype == DT_STRING) {
+        bool equality = node->type == NT_EQUAL || node->type == NT_NEQUAL;
 
-    case NT_ADD:
+        Node *compare = new Node(equality ? NT_STREQUAL : NT_STRCOMPARE, node->child[0], node->child[1]);
+        compare->rettype = DT_INT;
+        compare->line = node->line;
+        node->child[0] = compare;
+
+        node->child[1] = new Node(NT_INT);
+        node->child[1]->line = node->line;
+        MakeLiteral(node->child[1], NT_INT, equality ? 1 : 0);
+        break;
+      }
+
+    // int operands are converted when mixed with floats
     case NT_SUB:
     case NT_MUL:
     case NT_DIV:
+      problem = HandleOperands(node);
+      if(problem != null) {
+        Error(problem, node);
+        return false;
+      }
+
+      if(node->child[0]->rettype == DT_FLOAT || node->child[1]->rettype == DT_FLOAT) {
+        CoerceToFloat(node->child[0]);
+        CoerceToFloat(node->child[1]);
+      }
+      break;
+
+    case NT_MOD:
+      problem = HandleOperands(node);
+      if(problem != null) {
+        Error(problem, node);
+        return false;
+      }
+
+      if(node->child[0]->rettype == DT_FLOAT || node->child[1]->rettype == DT_FLOAT) {
+        Error("'%%' : illegal for float operands", node);
+        return false;
+      }
+      break;
+
+    // bit operations only work on ints
+    case NT_BAND:
+    case NT_BOR:
+    case NT_BXOR:
+    case NT_BNOT:
+    case NT_SHL:
+    case NT_SAR:
+    case NT_POPCOUNT:
+    case NT_CLZ:
+    case NT_CTZ:
+    case NT_ROTL:
+    case NT_ROTR:
+    case NT_BSWAP:
+      problem = HandleOperands(node);
+      if(problem != null) {
+        Error(problem, node);
+        return false;
+      }
+
+      if(node->child[0]->rettype == DT_FLOAT || (node->child[1] != null && node->child[1]->rettype == DT_FLOAT)) {
+        Error("bit operations are illegal for float operands", node);
+        return false;
+      }
+      break;
+
+    case NT_ELEMENT:
+    case NT_SETELEMENT:
+    case NT_ELEMENT_INRANGE:
+    case NT_SETELEMENT_INRANGE:
+    case NT_INTARRAY:
+    case NT_FLOATARRAY:
+    case NT_LENGTH:
+    case NT_FILL:
+    case NT_SLICE:
+    case NT_VADD:
+    case NT_VMUL:
+    case NT_VLESS:
+    case NT_VSELECT:
+    case NT_DOT:
+    case NT_SUM:
+    case NT_CHARAT:
+    case NT_SUBSTRING:
+    case NT_FIND:
+    case NT_HASH:
+    case NT_PRINTS:
+      if(!CheckOperands(node)) return false;
       break;
 
     case NT_ASSIGN: 
+      if(!Compatible(node->symbol->type, node->child[0]->rettype)) {
+        sprintf(buffer, "\'%s\' : variable is assigned an array or a string and a value of another type", node->symbol->contents.c_str());
+        Error(buffer, node);
+        return false;
+      }
+
+      if(node->symbol->type == DT_FLOAT) CoerceToFloat(node->child[0]);
       break;
 
     case NT_CALL:
       CheckFunctionSemantics(node);
       break;
+
+    case NT_CALLM:
+      if(!CheckModuleCall(node)) return false;
+      break;
+
+    case NT_CALLS:
+      if(!CheckScriptCall(node)) return false;
+      {
+        SymbolVector& params = ((ScriptFunction *)node->symbol->data)->params;
+        vector<Node **> args;
+        GetArguments(node->child[0], args);
+
+        for(dword i = 0; i < args.size(); i ++) {
+          if(!Compatible(params[i]->type, (*args[i])->rettype)) {
+            sprintf(buffer, "\'%s\' : parameter %d is passed an array or a string and a value of another type", node->symbol->contents.c_str(), i + 1);
+            Error(buffer, node);
+            return false;
+          }
+
+          if(params[i]->type == DT_FLOAT) CoerceToFloat(*args[i]);
+        }
+      }
+      break;
+
+    case NT_RETURN:
+      if(node->symbol == null) {
+        Error("return is only allowed in a function", node);
+        return false;
+      }
+
+      if(!Compatible(node->symbol->type, node->child[0] != null ? node->child[0]->rettype : DT_INT)) {
+        sprintf(buffer, "\'%s\' : function returns an array or a string and a value of another type", node->symbol->contents.c_str());
+        Error(buffer, node);
+        return false;
+      }
+
+      if(node->symbol->type == DT_FLOAT && node->child[0] != null) CoerceToFloat(node->child[0]);
+      break;
   }
 
   return true;
 }
 
-Op* Compiler::Build(Node *node)
+// an entry of the Build() work stack, either a node that still has to be
+// expanded or an op that is ready to be appended to the chain
+// conditions are nodes that are built as a jump to target if their value
+// equals jumpif, instead of leaving the value on the stack
+struct BuildItem
 {
-  Op *a, *b, *c, *d, *e, *f;
+  Node *node;
+  Op *op;
 
-  switch (node->type)  {
+  Op *target;
+  bool jumpif;
 
-    case NT_ERROR:
-      return new Op(NOOP);
+  BuildItem(Node *n) : node(n), op(null), target(null), jumpif(false) { }
+  BuildItem(Op *o) : node(null), op(o), target(null), jumpif(false) { }
+  BuildItem(Node *n, bool j, Op *t) : node(n), op(null), target(t), jumpif(j) { }
+};
 
-    case NT_STMT:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      
-      a->Concat(b);
-      return a;
+// returns the compare and branch op for a comparison node
+static OPCODE CompareOp(NodeType type, bool jumpif)
+{
+  switch(type) {
+    case NT_EQUAL:   return jumpif ? JEQ : JNE;
+    case NT_NEQUAL:  return jumpif ? JNE : JEQ;
+    case NT_LESS:    return jumpif ? JLT : JGE;
+    case NT_LEQUAL:  return jumpif ? JLE : JGT;
+    case NT_GREATER: return jumpif ? JGT : JLE;
+    case NT_GEQUAL:  return jumpif ? JGE : JLT;
+  }
 
-    case NT_EMPTY:
-      return new Op(NOOP);
+  return NOOP;
+}
 
-    case NT_PARAM:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      
-      a->Concat(b);
-      return a;
+static bool IsCondition(Node *node)
+{
+  switch(node->type) {
+    case NT_EQUAL:
+    case NT_NEQUAL:
+    case NT_LESS:
+    case NT_LEQUAL:
+    case NT_GREATER:
+    case NT_GEQUAL:
+    case NT_BOOLAND:
+    case NT_BOOLOR:
+      return true;
+  }
 
-    case NT_CALL:
-      a = Build(node->child[0]);
-      b = new Op(CALL, node->symbol->index);
+  return false;
+}
 
-      a->Concat(b);
-      return a;
+// expands a condition, && and || are short circuited
+static void BuildCondition(BuildItem& item, vector<BuildItem>& work)
+{
+  Node *node = item.node;
+  Op *skip;
 
-    case NT_EXPR:
-      a = Build(node->child[0]);
-      b = new Op(POP);
+  switch(node->type) {
+    case NT_BOOLAND:
+      if(item.jumpif) {
+        skip = new Op(NOOP);
+        work.push_back(BuildItem(skip));
+        work.push_back(BuildItem(node->child[1], true, item.target));
+        work.push_back(BuildItem(node->child[0], false, skip));
+      } else {
+        work.push_back(BuildItem(node->child[1], false, item.target));
+        work.push_back(BuildItem(node->child[0], false, item.target));
+      }
+      break;
 
-      a->Concat(b);
-      return a;
-          
-    case NT_WHILE:
-      a = Build(node->child[0]);
-      b = new Op(IFF);
-      c = Build(node->child[1]);
-      d = new Op(GOTO, a);
-      e = new Op(NOOP);
+    case NT_BOOLOR:
+      if(item.jumpif) {
+        work.push_back(BuildItem(node->child[1], true, item.target));
+        work.push_back(BuildItem(node->child[0], true, item.target));
+      } else {
+        skip = new Op(NOOP);
+        work.push_back(BuildItem(skip));
+        work.push_back(BuildItem(node->child[1], false, item.target));
+        work.push_back(BuildItem(node->child[0], true, skip));
+      }
+      break;
+
+    case NT_EQUAL:
+    case NT_NEQUAL:
+    case NT_LESS:
+    case NT_LEQUAL:
+    case NT_GREATER:
+    case NT_GEQUAL:
+      // floats are compared by FCMP, which leaves -1, 0 or 1 to compare with 0
+      work.push_back(BuildItem(new Op(CompareOp(node->type, item.jumpif), item.target)));
+      if(node->child[0]->rettype == DT_FLOAT) {
+        work.push_back(BuildItem(new Op(PUSH, (dword)0)));
+        work.push_back(BuildItem(new Op(FCMP)));
+      }
+      work.push_back(BuildItem(node->child[1]));
+      work.push_back(BuildItem(node->child[0]));
+      break;
 
-      b->target = e;
+    default:
+      // any other value, everything but 0 is true
+      if(node->rettype == DT_FLOAT) {
+        // 0.0 and -0.0 are false
+        if(item.jumpif == false) {
+          work.push_back(BuildItem(new Op(IFF, item.target)));
+        } else {
+          work.push_back(BuildItem(new Op(JNE, item.target)));
+          work.push_back(BuildItem(new Op(PUSH, (dword)0)));
+        }
+        work.push_back(BuildItem(new Op(FCMP)));
+        work.push_back(BuildItem(new Op(PUSH, (dword)0)));
+      } else if(item.jumpif == false) {
+        work.push_back(BuildItem(new Op(IFF, item.target)));
+      } else if(node->rettype == DT_BOOL) {
+        work.push_back(BuildItem(new Op(IFT, item.target)));
+      } else {
+        work.push_back(BuildItem(new Op(JNE, item.target)));
+        work.push_back(BuildItem(new Op(PUSH, (dword)0)));
+      }
+      work.push_back(BuildItem(node));
+      break;
+  }
+}
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      d->Concat(e);
-      return a;
+Op* Compiler::Build(Node *node)
+{
+  Op *first = null, *last = null;
+  Op *a, *b;
 
-    case NT_DOWHILE:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(IFT, a);
+  // the line of the node that was built last, the ops that follow belong to it
+  dword line = 0;
 
-      a->Concat(b);
-      b->Concat(c);
-      return a;
+  vector<BuildItem> work;
+  work.push_back(BuildItem(node));
 
-    case NT_IFTHEN:
-      a = Build(node->child[0]);
-      b = new Op(IFF);
-      c = Build(node->child[1]);
-      d = new Op(NOOP);
+  // the parts of each node are pushed in the reverse order of
+  // their appearance in the op chain
+  while(!work.empty()) {
+    BuildItem item = work.back();
+    work.pop_back();
 
-      b->target = d;
+    // append a ready op to the end of the chain
+    if(item.op != null) {
+      if(item.op->line == 0) item.op->line = line;
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      return a;
-      
-    case NT_IFTHENELSE:
-      a = Build(node->child[0]);
-      b = new Op(IFF);
-      c = Build(node->child[1]);
-      d = new Op(GOTO);
-      e = Build(node->child[2]);
-      f = new Op(NOOP);
+      if(last != null) last->next = item.op;
+      else first = item.op;
+      last = item.op;
+      continue;
+    }
+
+    node = item.node;
+    if(node == null) continue;
+    line = node->line;
+
+    if(item.target != null) {
+      BuildCondition(item, work);
+      continue;
+    }
+
+    // the value of a condition, false unless the jump is taken
+    if(IsCondition(node)) {
+      a = new Op(NOOP);
+      b = new Op(NOOP);
+
+      work.push_back(BuildItem(b));
+      work.push_back(BuildItem(new Op(PUSH, (dword)1)));
+      work.push_back(BuildItem(a));
+      work.push_back(BuildItem(new Op(GOTO, b)));
+      work.push_back(BuildItem(new Op(PUSH, (dword)0)));
+      work.push_back(BuildItem(node, true, a));
+      continue;
+    }
+
+    switch (node->type)  {
+
+      case NT_STMT:
+      case NT_PARAM:
+        work.push_back(BuildItem(node->child[1]));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      case NT_CALL:
+        work.push_back(BuildItem(new Op(CALL, node->symbol->index)));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      case NT_CALLS:
+        BuildCall(node, work, false);
+        break;
+
+      case NT_CALLM:
+        {
+          vector<Node **> args;
+          GetArguments(node->child[0], args);
+
+          Op *call = new Op(CALLM, node->symbol->index);
+          call->count = (dword)args.size();
+          work.push_back(BuildItem(call));
+          work.push_back(BuildItem(node->child[0]));
+        }
+        break;
+
+      // a function that returns the result of calling itself starts over instead
+      case NT_RETURN:
+        {
+          Node *value = node->child[0];
+          if(optimization > 0 && value != null && value->type == NT_CALLS && value->symbol->data == building) {
+            BuildCall(value, work, true);
+            break;
+          }
+
+          work.push_back(BuildItem(new Op(RET)));
+          if(value != null)
+            work.push_back(BuildItem(value));
+          else
+            work.push_back(BuildItem(new Op(PUSH, (dword)0)));
+        }
+        break;
+
+      case NT_EXPR:
+        work.push_back(BuildItem(new Op(POP)));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+            
+      case NT_WHILE:
+        a = new Op(NOOP);
+        b = new Op(NOOP);
+        
+        work.push_back(BuildItem(b));
+        work.push_back(BuildItem(new Op(GOTO, a)));
+        work.push_back(BuildItem(node->child[1]));
+        work.push_back(BuildItem(node->child[0], false, b));
+        work.push_back(BuildItem(a));
+        break;
+
+      case NT_FOR:
+        a = new Op(NOOP);
+        b = new Op(NOOP);
+        
+        work.push_back(BuildItem(b));
+        work.push_back(BuildItem(new Op(GOTO, a)));
+        work.push_back(BuildItem(node->child[1]));
+        work.push_back(BuildItem(node->child[2]));
+        work.push_back(BuildItem(node->child[0], false, b));
+        work.push_back(BuildItem(a));
+        break;
+
+      case NT_SWITCH:
+        BuildSwitch(node, work);
+        break;
+
+      case NT_DOWHILE:
+        a = new Op(NOOP);
+
+        work.push_back(BuildItem(node->child[1], true, a));
+        work.push_back(BuildItem(node->child[0]));
+        work.push_back(BuildItem(a));
+        break;
+
+      case NT_IFTHEN:
+        a = new Op(NOOP);
+
+        work.push_back(BuildItem(a));
+        work.push_back(BuildItem(node->child[1]));
+        work.push_back(BuildItem(node->child[0], false, a));
+        break;
+        
+      case NT_IFTHENELSE:
+        a = new Op(NOOP);
+        b = new Op(NOOP);
+
+        work.push_back(BuildItem(b));
+        work.push_back(BuildItem(node->child[2]));
+        work.push_back(BuildItem(a));
+        work.push_back(BuildItem(new Op(GOTO, b)));
+        work.push_back(BuildItem(node->child[1]));
+        work.push_back(BuildItem(node->child[0], false, a));
+        break;
+
+      case NT_ADD:
+      case NT_SUB:
+      case NT_MUL:
+      case NT_DIV:
+      case NT_MOD:
+        if(node->rettype == DT_STRING) {
+          a = new Op(SCAT);
+        } else if(node->rettype == DT_FLOAT) {
+          switch(node->type) {
+            case NT_ADD:   a = new Op(FADD); break;
+            case NT_SUB:   a = new Op(FSUB); break;
+            case NT_MUL:   a = new Op(FMUL); break;
+            default:       a = new Op(FDIV); break;
+          }
+        } else {
+          switch(node->type) {
+            case NT_ADD:   a = new Op(IADD); break;
+            case NT_SUB:   a = new Op(ISUB); break;
+            case NT_MUL:   a = new Op(IMUL); break;
+            case NT_DIV:   a = new Op(IDIV); break;
+            default:       a = new Op(IMOD); break;
+          }
+        }
+
+        work.push_back(BuildItem(a));
+        work.push_back(BuildItem(node->child[1]));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      case NT_BAND:
+      case NT_BOR:
+      case NT_BXOR:
+      case NT_SHL:
+      case NT_SAR:
+      case NT_ROTL:
+      case NT_ROTR:
+        work.push_back(BuildItem(new Op(BitOp(node->type))));
+        work.push_back(BuildItem(node->child[1]));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      case NT_POPCOUNT:
+      case NT_CLZ:
+      case NT_CTZ:
+      case NT_BSWAP:
+        work.push_back(BuildItem(new Op(BitOp(node->type))));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      // the kernels take the type of the elements from the arrays they
+      // compute with, the destination of vless is always an int array
+      case NT_ELEMENT:
+      case NT_SETELEMENT:
+      case NT_ELEMENT_INRANGE:
+      case NT_SETELEMENT_INRANGE:
+      case NT_INTARRAY:
+      case NT_FLOATARRAY:
+      case NT_LENGTH:
+      case NT_FILL:
+      case NT_SLICE:
+      case NT_VADD:
+      case NT_VMUL:
+      case NT_VLESS:
+      case NT_VSELECT:
+      case NT_DOT:
+      case NT_SUM:
+        if(node->type == NT_LENGTH && node->child[0]->rettype == DT_STRING) {
+          work.push_back(BuildItem(new Op(SLEN)));
+          work.push_back(BuildItem(node->child[0]));
+          break;
+        }
+        {
+          vector<Node **> operands;
+          GetOperands(node, operands);
+
+          OPCODE opcode = ArrayOp(node->type);
+          DataType type = (*operands[node->type == NT_VLESS ? 1 : 0])->rettype;
+          bool kernel = opcode == AFILL || (opcode >= VADD && opcode <= VSUM);
+
+          work.push_back(BuildItem(new Op(opcode, kernel && type == DT_FLOATARRAY ? ET_FLOAT : ET_INT)));
+          for(dword i = (dword)operands.size(); i -- > 0; )
+            work.push_back(BuildItem(*operands[i]));
+        }
+        break;
+
+      case NT_STREQUAL:
+      case NT_STRCOMPARE:
+      case NT_CHARAT:
+      case NT_SUBSTRING:
+      case NT_FIND:
+      case NT_HASH:
+        work.push_back(BuildItem(new Op(StringOp(node->type))));
+        for(int i = 3; i -- > 0; )
+          if(node->child[i] != null) work.push_back(BuildItem(node->child[i]));
+        break;
+
+      // prints returns 0 like the other functions that return nothing
+      case NT_PRINTS:
+        work.push_back(BuildItem(new Op(PUSH, (dword)0)));
+        work.push_back(BuildItem(new Op(SYS, SC_PRINTS)));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      case NT_STRING:
+        work.push_back(BuildItem(new Op(SLIT, node->symbol->index)));
+        break;
+
+      // there is no not op, ~a is a ^ 0xffffffff
+      case NT_BNOT:
+        work.push_back(BuildItem(new Op(BXOR)));
+        work.push_back(BuildItem(new Op(PUSH, (dword)0xffffffff)));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      case NT_ASSIGN:
+        work.push_back(BuildItem(new Op(STORE, node->symbol)));
+        work.push_back(BuildItem(node->child[0]));
+        break;
+
+      case NT_IDENT:
+        work.push_back(BuildItem(new Op(LOAD, node->symbol)));
+        break;
+
+      case NT_COERCE_TO_FLOAT:
+        work.push_back(BuildItem(new Op(I2F)));
+        work.push_back(BuildItem(node->child[0]));
+        break;
       
-      b->target = e;
-      d->target = f;
+      case NT_INT:
+        work.push_back(BuildItem(new Op(PUSH, node->symbol->ToDword())));
+        break;
+
+      case NT_FLOAT:
+        {
+          float f = node->symbol->ToFloat();
+          work.push_back(BuildItem(new Op(PUSH, *((dword *)&f))));
+        }
+        break;
+
+      case NT_BOOL:
+        work.push_back(BuildItem(new Op(PUSH, node->symbol->ToBool() ? 1 : 0)));
+        break;
+
+      // NT_ERROR, NT_EMPTY and everything we can't build yet
+      default:
+        work.push_back(BuildItem(new Op(NOOP)));
+        break;
+     }
+  }
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      d->Concat(e);
-      e->Concat(f);
-      return a;
+  return first;
+}
 
-    case NT_EQUAL:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(ISUB);
-      d = new Op(IEQ);
-
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      return a;
-          
-    case NT_NEQUAL:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(ISUB);
-      d = new Op(INE);
+void Compiler::BuildSwitch(Node *node, vector<BuildItem>& work)
+{
+  NodeVector cases;
+  Node *def = GetCases(node, cases);
+  dword count = (dword)cases.size();
+
+  vector<dword> values(count);
+  vector<Op *> labels(count);
+  for(dword i = 0; i < count; i ++) {
+    values[i] = cases[i]->child[0]->symbol->ToDword();
+    labels[i] = new Op(NOOP);
+  }
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      return a;
+  Op *deflabel = new Op(NOOP), *end = new Op(NOOP);
 
-    case NT_LESS:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(ISUB);
-      d = new Op(ILT);
+  // the ops are collected in order and pushed on the work stack at the end
+  vector<BuildItem> items;
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      return a;
+  // a single table uses the value right away, anything else
+  // compares it a number of times, so it is kept in a variable
+  bool direct = count >= MinTableCases && values[count - 1] - values[0] < 2 * count;
 
-    case NT_LEQUAL:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(ISUB);
-      d = new Op(ILE);
+  Symbol *variable = null;
+  if(node->child[0]->type == NT_IDENT)
+    variable = node->child[0]->symbol;
+  else if(!direct) {
+    char name[32];
+    sprintf(name, "$switch%d", (int)variables.size());
+    variable = GetVariable(name);
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      return a;
+    items.push_back(BuildItem(node->child[0]));
+    items.push_back(BuildItem(new Op(STORE, variable)));
+    items.push_back(BuildItem(new Op(POP)));
+  }
 
-    case NT_GREATER:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(ISUB);
-      d = new Op(IGT);
+  // the ranges of cases that are left to dispatch and their labels, ranges with
+  // at least MinTableCases cases that fill half of their table become tables
+  // and the others are split in two until they are small enough to test one by one
+  vector<pair<pair<dword, dword>, Op *> > ranges;
+  ranges.push_back(make_pair(make_pair((dword)0, count), (Op *)null));
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      return a;
+  while(!ranges.empty()) {
+    dword lo = ranges.back().first.first, hi = ranges.back().first.second;
+    Op *label = ranges.back().second;
+    ranges.pop_back();
 
-    case NT_GEQUAL:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(ISUB);
-      d = new Op(IGE);
+    if(label != null) items.push_back(BuildItem(label));
 
-      a->Concat(b);
-      b->Concat(c);
-      c->Concat(d);
-      return a;
+    dword n = hi - lo;
+    if(n >= MinTableCases && values[hi - 1] - values[lo] < 2 * n) {
+      if(variable != null)
+        items.push_back(BuildItem(new Op(LOAD, variable)));
+      else
+        items.push_back(BuildItem(node->child[0]));
+
+      Op *table = new Op(TABLESWITCH, deflabel);
+      table->operand = values[lo];
+      table->count = values[hi - 1] - values[lo] + 1;
+      items.push_back(BuildItem(table));
+
+      for(dword i = 0, k = lo; i < table->count; i ++) {
+        if(values[k] == values[lo] + i)
+          items.push_back(BuildItem(new Op(GOTO, labels[k ++])));
+        else
+          items.push_back(BuildItem(new Op(GOTO, deflabel)));
+      }
+    } else if(n < MinTableCases) {
+      for(dword k = lo; k < hi; k ++) {
+        items.push_back(BuildItem(new Op(LOAD, variable)));
+        items.push_back(BuildItem(new Op(PUSH, values[k])));
+        items.push_back(BuildItem(new Op(JEQ, labels[k])));
+      }
+      items.push_back(BuildItem(new Op(GOTO, deflabel)));
+    } else {
+      dword mid = lo + n / 2;
+      Op *upper = new Op(NOOP);
 
-    case NT_BOOLAND:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(IAND);
+      items.push_back(BuildItem(new Op(LOAD, variable)));
+      items.push_back(BuildItem(new Op(PUSH, values[mid])));
+      items.push_back(BuildItem(new Op(JGE, upper)));
 
-      a->Concat(b);
-      b->Concat(c);
-      return a;
+      ranges.push_back(make_pair(make_pair(mid, hi), upper));
+      ranges.push_back(make_pair(make_pair(lo, mid), (Op *)null));
+    }
+  }
 
-    case NT_BOOLOR:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      c = new Op(IOR);
+  // the cases don't fall through
+  for(dword i = 0; i < count; i ++) {
+    items.push_back(BuildItem(labels[i]));
+    items.push_back(BuildItem(cases[i]->child[1]));
+    items.push_back(BuildItem(new Op(GOTO, end)));
+  }
 
-      a->Concat(b);
-      b->Concat(c);
-      return a;
+  items.push_back(BuildItem(deflabel));
+  if(def != null) items.push_back(BuildItem(def->child[0]));
+  items.push_back(BuildItem(end));
 
-    case NT_ASSIGN:
-      a = Build(node->child[0]);
-      b = new Op(STORE, node->symbol);
+  work.insert(work.end(), items.rbegin(), items.rend());
+}
 
-      a->Concat(b);
-      return a;
-      
-    case NT_ADD:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      a->Concat(b);
-      b->Concat(new Op(IADD));
-      return a;
+void Compiler::BuildCall(Node *node, vector<BuildItem>& work, bool tail)
+{
+  ScriptFunction *function = (ScriptFunction *)node->symbol->data;
 
-    case NT_SUB:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      a->Concat(b);
-      b->Concat(new Op(ISUB));
-      return a;
-    
-    case NT_MUL:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      a->Concat(b);
-      b->Concat(new Op(IMUL));
-      return a;
+  vector<Node **> args;
+  GetArguments(node->child[0], args);
 
-    case NT_DIV:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      a->Concat(b);
-      b->Concat(new Op(IDIV));
-      return a;
+  // the ops are collected in order and pushed on the work stack at the end
+  vector<BuildItem> items;
+  items.push_back(BuildItem(node->child[0]));
 
-    case NT_MOD:
-      a = Build(node->child[0]);
-      b = Build(node->child[1]);
-      a->Concat(b);
-      b->Concat(new Op(IMOD));
-      return a;
+  if(tail) {
+    // the arguments replace the parameters and the body starts over
+    for(dword i = (dword)args.size(); i -- > 0; ) {
+      items.push_back(BuildItem(new Op(STORE, function->params[i])));
+      items.push_back(BuildItem(new Op(POP)));
+    }
 
+    items.push_back(BuildItem(new Op(GOTO, function->body)));
+  } else if(function->inlined != null) {
+    // the variables of the function become variables of the caller,
+    // the calls of a function all share them
+    Node *value = CloneTree(function->inlined);
+    NodeVector order;
+    PostOrder(value, order);
+
+    for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+      Node *n = *i;
+      if(n->type != NT_IDENT && n->type != NT_ASSIGN) continue;
+
+      Symbol *symbol = GetVariable(("$" + node->symbol->contents + "." + n->symbol->contents).c_str());
+      symbol->type = n->symbol->type;
+      n->symbol = symbol;
+    }
 
-    case NT_IDENT:
-      return new Op(LOAD, node->symbol);
-    
-    case NT_INT:
-      return new Op(PUSH, node->symbol->ToDword());
-   }
+    for(dword i = (dword)args.size(); i -- > 0; ) {
+      Symbol *symbol = GetVariable(("$" + node->symbol->contents + "." + function->params[i]->contents).c_str());
+      symbol->type = function->params[i]->type;
+
+      items.push_back(BuildItem(new Op(STORE, symbol)));
+      items.push_back(BuildItem(new Op(POP)));
+    }
+
+    items.push_back(BuildItem(value));
+  } else {
+    Op *call = new Op(CALLS, function->entry);
+    call->count = (dword)args.size();
+    items.push_back(BuildItem(call));
 
-   return new Op(NOOP);
+    function->called = true;
+  }
+
+  work.insert(work.end(), items.rbegin(), items.rend());
 }
 
 bool Compiler::Assemble(Op *op, Assembly& assembly)
 {
   // set the local variable array size
-  Op *first = new Op(LOCAL, (dword)variables.size());
+  Op *first = new Op(LOCAL, locals);
   first->next = op;
 
-  // set the offsets, we need these for jump targets
-  dword coffset = 0;
+  // set the offsets, we need these for jump targets, the code
+  // of a snippet of a session follows the code that is there
+  dword coffset = assembly.GetSize();
   for(Op *cop = first; cop != null; cop = cop->next) {
     cop->offset = coffset;
     if(cop->opcode != NOOP)
-      coffset += 2;
+      coffset += Assembler::OpSize(cop->opcode);
+  }
+
+  // the names of the variables in the profiles, see Profile
+  map<Symbol *, string> names;
+  forEach(SymbolTable, variables, i)
+    names[(*i).second] = (*i).first;
+
+  forEach(SymbolTable, scripts, i) {
+    ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+    forEach(SymbolTable, function->locals, j)
+      names[(*j).second] = string((*i).first) + "." + (*j).first;
   }
 
   for(Op *cop = first; cop != null; cop = cop->next) {
     if(cop->opcode != NOOP) {
+      if(cop->line != 0)
+        assembly.AddLine(cop->offset, cop->line);
+
+      Symbol *variable = cop->symbol != null ? cop->symbol : cop->variable;
+      if(variable != null && (cop->opcode == LOAD || cop->opcode == STORE || cop->limit != null)) {
+        map<Symbol *, string>::iterator name = names.find(variable);
+        if(name != names.end()) assembly.AddName(cop->offset, (*name).second);
+      }
+
       assembly.WriteDword(cop->opcode);
-      if(cop->symbol != null) 
-        assembly.WriteDword(cop->symbol->index);
-      else if(cop->target != null) 
+      if(cop->target != null) 
         assembly.WriteDword(cop->target->offset);
+      else if(cop->symbol != null) 
+        assembly.WriteDword(cop->symbol->index);
       else
         assembly.WriteDword(cop->operand);
     }
+
+    // the second pair of a LOOPINC, the variable and the limit
+    if(cop->limit != null) {
+      assembly.WriteDword(cop->symbol != null ? cop->symbol->index : cop->operand);
+      assembly.WriteDword(cop->limit->symbol != null ? cop->limit->symbol->index : cop->limit->operand);
+    }
+
+    // the second pair of a TABLESWITCH, the lowest value and the size of the table
+    if(cop->opcode == TABLESWITCH) {
+      assembly.WriteDword(cop->operand);
+      assembly.WriteDword(cop->count);
+    }
+
+    // the second pair of a FRAME, the size of the frame
+    if(cop->opcode == FRAME) {
+      assembly.WriteDword(cop->count);
+      assembly.WriteDword(0);
+    }
   }
 
   // force an exit
@@ -546,21 +1772,294 @@ bool Compiler::Assemble(Op *op, Assembly& assembly)
   return true;
 }
 
+// functions that are built as a single op unless the host imports a function of the same name
+// the array intrinsics list the kinds of their operands (see CheckOperands())
+struct Intrinsic
+{
+  const char *name;
+  NodeType type;
+  dword paramcount;
+  const char *operands;
+};
+
+static Intrinsic intrinsics[] = {
+  {"popcount", NT_POPCOUNT, 1, null},
+  {"clz", NT_CLZ, 1, null},
+  {"ctz", NT_CTZ, 1, null},
+  {"rotl", NT_ROTL, 2, null},
+  {"rotr", NT_ROTR, 2, null},
+  {"bswap", NT_BSWAP, 1, null},
+
+  {"intarray", NT_INTARRAY, 1, "n"},
+  {"floatarray", NT_FLOATARRAY, 1, "n"},
+  {"len", NT_LENGTH, 1, "l"},
+  {"fill", NT_FILL, 2, "av"},
+  {"slice", NT_SLICE, 3, "ann"},
+  {"vadd", NT_VADD, 3, "ass"},
+  {"vmul", NT_VMUL, 3, "ass"},
+  {"vless", NT_VLESS, 3, "ias"},
+  {"vselect", NT_VSELECT, 4, "aiss"},
+  {"dot", NT_DOT, 2, "as"},
+  {"sum", NT_SUM, 1, "a"},
+
+  {"charat", NT_CHARAT, 2, "tn"},
+  {"substr", NT_SUBSTRING, 3, "tnn"},
+  {"find", NT_FIND, 2, "tt"},
+  {"hash", NT_HASH, 1, "t"},
+  {"prints", NT_PRINTS, 1, "t"},
+};
+
+static Intrinsic* FindIntrinsic(NodeType type)
+{
+  int intrinsiccount = sizeof(intrinsics)/sizeof(Intrinsic);
+  for(int i = 0; i < intrinsiccount; i ++)
+    if(intrinsics[i].type == type) return &intrinsics[i];
+
+  return null;
+}
+
+OPCODE Compiler::BitOp(NodeType type)
+{
+  switch(type) {
+    case NT_BAND:     return BAND;
+    case NT_BOR:      return BOR;
+    case NT_BXOR:     return BXOR;
+    case NT_SHL:      return SHL;
+    case NT_SAR:      return SAR;
+    case NT_POPCOUNT: return POPCNT;
+    case NT_CLZ:      return CLZ;
+    case NT_CTZ:      return CTZ;
+    case NT_ROTL:     return ROTL;
+    case NT_ROTR:     return ROTR;
+    case NT_BSWAP:    return BSWAP;
+  }
+
+  return NOOP;
+}
+
+OPCODE Compiler::ArrayOp(NodeType type)
+{
+  switch(type) {
+    case NT_INTARRAY:
+    case NT_FLOATARRAY:           return ANEW;
+    case NT_LENGTH:               return ALEN;
+    case NT_ELEMENT:              return ALOAD;
+    case NT_SETELEMENT:           return ASTORE;
+    case NT_ELEMENT_INRANGE:      return ALOADU;
+    case NT_SETELEMENT_INRANGE:   return ASTOREU;
+    case NT_FILL:                 return AFILL;
+    case NT_SLICE:                return ASLICE;
+    case NT_VADD:                 return VADD;
+    case NT_VMUL:                 return VMUL;
+    case NT_VLESS:                return VLESS;
+    case NT_VSELECT:              return VSELECT;
+    case NT_DOT:                  return VDOT;
+    case NT_SUM:                  return VSUM;
+  }
+
+  return NOOP;
+}
+
+OPCODE Compiler::StringOp(NodeType type)
+{
+  switch(type) {
+    case NT_ADD:        return SCAT;
+    case NT_STREQUAL:   return SEQ;
+    case NT_STRCOMPARE: return SCMP;
+    case NT_LENGTH:     return SLEN;
+    case NT_HASH:       return SHASH;
+    case NT_CHARAT:     return SCHAR;
+    case NT_SUBSTRING:  return SSUB;
+    case NT_FIND:       return SFIND;
+  }
+
+  return NOOP;
+}
+
+void Compiler::GetOperands(Node *node, vector<Node **>& operands)
+{
+  if(node->type == NT_VSELECT) {
+    GetArguments(node->child[0], operands);
+    return;
+  }
+
+  for(int i = 0; i < 3 && node->child[i] != null; i ++)
+    operands.push_back(&node->child[i]);
+}
+
+// the operands of the array and string nodes, a character per operand: 'a' is
+// an array, 'i' an int array, 's' an array of the type of the last 'a' operand,
+// 'n' an int, 'v' a value that is stored in the last 'a' operand, 't' a string
+// and 'l' an array or a string
+bool Compiler::CheckOperands(Node *node)
+{
+  const char *name = "[]", *signature;
+
+  switch(node->type) {
+    case NT_ELEMENT:
+    case NT_ELEMENT_INRANGE:
+      signature = "an";
+      break;
+
+    case NT_SETELEMENT:
+    case NT_SETELEMENT_INRANGE:
+      signature = "anv";
+      break;
+
+    default:
+      {
+        Intrinsic *intrinsic = FindIntrinsic(node->type);
+        name = intrinsic->name;
+        signature = intrinsic->operands;
+      }
+  }
+
+  vector<Node **> operands;
+  GetOperands(node, operands);
+
+  DataType array = DT_VOID;
+  for(dword i = 0; i < operands.size(); i ++) {
+    Node *&operand = *operands[i];
+    const char *problem = null;
+
+    switch(signature[i]) {
+      case 'a':
+        if(!IsArray(operand->rettype)) problem = "is not an array";
+        array = operand->rettype;
+        break;
+
+      case 'i':
+        if(operand->rettype != DT_INTARRAY) problem = "is not an int array";
+        break;
+
+      case 's':
+        if(operand->rettype != array) problem = "is not an array of the same type";
+        break;
+
+      case 'n':
+        if(operand->rettype == DT_FLOAT || IsHandle(operand->rettype)) problem = "is not an int";
+        break;
+
+      case 't':
+        if(operand->rettype != DT_STRING) problem = "is not a string";
+        break;
+
+      case 'l':
+        if(!IsHandle(operand->rettype)) problem = "is not an array or a string";
+        break;
+
+      // ints are converted when they are stored in a float array
+      case 'v':
+        if(IsHandle(operand->rettype) || (operand->rettype == DT_FLOAT && array == DT_INTARRAY))
+          problem = "can't be stored in the array";
+        else if(array == DT_FLOATARRAY)
+          CoerceToFloat(operand);
+        break;
+    }
+
+    if(problem != null) {
+      char buffer[256];
+      sprintf(buffer, "\'%s\' : operand %d %s", name, i + 1, problem);
+      Error(buffer, node);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Compiler::ResolveIntrinsics(Node *node, ImportList& importlist)
+{
+  NodeVector order;
+  PostOrderAll(node, order);
+
+  int intrinsiccount = sizeof(intrinsics)/sizeof(Intrinsic);
+  for(int i = 0; i < intrinsiccount; i ++) {
+    SymbolTable::iterator j = functions.find(intrinsics[i].name);
+    if(j == functions.end()) continue;
+
+    // an imported function takes precedence
+    if(importlist.Find(intrinsics[i].name) != null) continue;
+
+    Symbol *symbol = (*j).second;
+    for(NodeVector::iterator k = order.begin(); k != order.end(); k ++) {
+      Node *call = *k;
+      if(call->type != NT_CALL || call->symbol != symbol) continue;
+
+      vector<Node **> args;
+      GetArguments(call->child[0], args);
+      dword paramcount = (dword)args.size();
+
+      if(paramcount != intrinsics[i].paramcount) {
+        char buffer[256];
+        sprintf(buffer, "\'%s\' : function does not take %d parameters", intrinsics[i].name, paramcount);
+        Error(buffer, call);
+        call->type = NT_ERROR;
+      } else {
+        // up to three arguments become the children of the node, the
+        // longer lists stay where they are
+        call->type = intrinsics[i].type;
+        if(paramcount <= 3) {
+          Node *children[3] = {null, null, null};
+          for(dword n = 0; n < paramcount; n ++) children[n] = *args[n];
+          for(dword n = 0; n < 3; n ++) call->child[n] = children[n];
+        }
+      }
+
+      call->symbol = null;
+    }
+
+    functions.erase(j);
+    delete symbol;
+  }
+}
+
 bool Compiler::MoveFunctions(Assembly& assembly, ImportList& importlist)
 {
+  // the CALLM ops call the functions of the modules by the index of their name
+  forEach(SymbolTable, externals, i)
+    (*i).second->index = assembly.AddExternal((*i).first);
+
+  // the code of the earlier snippets of a session keeps the indices of
+  // the functions it calls, the new ones are added after them
+  if(session) {
+    forEach(SymbolTable, functions, i) {
+      Function *function = importlist.Find((*i).second->contents);
+      if(function == null) {
+        char buffer[256];
+        sprintf(buffer, "reference to unknown function \'%s\'\n", (*i).second->contents.c_str());
+        Error(buffer);
+        continue;
+      }
+
+      dword index = (dword)(find(sessionimports.begin(), sessionimports.end(), function) - sessionimports.begin());
+      if(index == sessionimports.size()) sessionimports.push_back(function);
+
+      (*i).second->index = index;
+      (*i).second->data = function;
+    }
+
+    Function **pointers = new Function*[sessionimports.size()];
+    for(dword i = 0; i < sessionimports.size(); i ++)
+      pointers[i] = sessionimports[i];
+
+    assembly.SetFunctions(pointers, (dword)sessionimports.size());
+    return true;
+  }
+
   dword pointercount = (dword)functions.size();
   Function **pointers = new Function*[pointercount];
 
   dword k = 0;
   forEach(SymbolTable, functions, i) {
-    FunctionTable::iterator j = importlist.functions.find((*i).second->contents);
-    if(j == importlist.functions.end()) {
+    Function *function = importlist.Find((*i).second->contents);
+    if(function == null) {
       char buffer[256];
       sprintf(buffer, "reference to unknown function \'%s\'\n", (*i).second->contents.c_str());
       Error(buffer);
     } else {
-      pointers[k] = (*j).second;
-      (*i).second->data = (*j).second;
+      pointers[k] = function;
+      (*i).second->data = function;
     }
     
     k ++;
@@ -8,7 +8,10 @@
 #include "Tyro.h"
 #include "Assembly.h"
 
-#include <hash_map>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <windows.h>
 
 // the syntax tree node types
 enum NodeType  
@@ -22,8 +25,17 @@ enum NodeType
   NT_EXPR,        // single expression as statement [expression]
   NT_WHILE,       // while statement [cond, looping part]
   NT_DOWHILE,     // while statement [looping part, cond]
+  NT_FOR,         // for statement [cond, step statement, looping part], the
+                  // initialization is a statement of its own that precedes the loop
+  NT_SWITCH,      // switch statement [value, cases], the cases are a list of
+                  // NT_CASE and NT_DEFAULT nodes joined by NT_STMT
+  NT_CASE,        // case of a switch [int constant, statement], there is no fall through
+  NT_DEFAULT,     // default case of a switch [statement]
   NT_IFTHEN,      // if statement [cond, if-part]
   NT_IFTHENELSE,  // if statement with else [cond, if-part, else-part]
+  NT_FUNCTION,    // function definition [parameters, body] (link to function table)
+                  // the parameters are NT_IDENT nodes joined by NT_PARAM
+  NT_RETURN,      // return statement [expression or null] (link to the function)
 
   // expressions
   NT_BOOLAND,  
@@ -44,14 +56,63 @@ enum NodeType
   NT_DIV,         // division expression [op1, op2]
   NT_MOD,         // mod expression
 
+  NT_BAND,        // bitwise and [op1, op2]
+  NT_BOR,         // bitwise or [op1, op2]
+  NT_BXOR,        // bitwise exclusive or [op1, op2]
+  NT_BNOT,        // bitwise not [op]
+  NT_SHL,         // shift left [op1, op2]
+  NT_SAR,         // arithmetic shift right [op1, op2]
+
   NT_CALL,        // function call (link to function table)
+  NT_CALLS,       // call of a function defined in the script [parameters]
+                  // (link to the function, see ScriptFunction)
+  NT_CALLM,       // call of a function of a module [parameters]
+                  // (link to the function, see Linker)
+
+  // intrinsics, calls to these functions are built as single ops
+  NT_POPCOUNT,    // number of bits set [op]
+  NT_CLZ,         // number of leading zero bits [op]
+  NT_CTZ,         // number of trailing zero bits [op]
+  NT_ROTL,        // rotate left [op, count]
+  NT_ROTR,        // rotate right [op, count]
+  NT_BSWAP,       // reverse the byte order [op]
+
+  // arrays, the intrinsics that make and use them are built as single ops as well
+  NT_ELEMENT,     // array element [array, index]
+  NT_SETELEMENT,  // assignment to an array element [array, index, value]
+  NT_ELEMENT_INRANGE,     // the same with an index that is known to be in range, so
+  NT_SETELEMENT_INRANGE,  // that it isn't checked (see RemoveBoundsChecks())
+  NT_INTARRAY,    // new int array [length]
+  NT_FLOATARRAY,  // new float array [length]
+  NT_LENGTH,      // length of an array or a string [array or string]
+  NT_FILL,        // sets every element [array, value]
+  NT_SLICE,       // array that shares a range of the elements of another one [array, from, to]
+  NT_VADD,        // element-wise addition [destination, op1, op2]
+  NT_VMUL,        // element-wise multiplication [destination, op1, op2]
+  NT_VLESS,       // element-wise comparison [int array destination, op1, op2]
+  NT_VSELECT,     // element-wise choice [parameters: destination, int array, op1, op2]
+  NT_DOT,         // dot product [op1, op2]
+  NT_SUM,         // sum of the elements [array]
+
+  // strings, + on strings is a concatenation, the comparisons of strings are
+  // changed to comparisons of the ints NT_STREQUAL and NT_STRCOMPARE return
+  NT_STREQUAL,    // 1 if the strings are the same, 0 if not [op1, op2]
+  NT_STRCOMPARE,  // -1, 0 or 1 as op1 sorts before, with or after op2 [op1, op2]
+  NT_CHARAT,      // the byte at an index [string, index]
+  NT_SUBSTRING,   // the bytes of a range [string, from, to]
+  NT_FIND,        // the offset of the first op2 in op1, -1 if there is none [op1, op2]
+  NT_HASH,        // the hash of a string [string]
+  NT_PRINTS,      // prints a string, returns 0 [string]
   
+
   NT_IDENT,       // identifier (link to symbol table)
 
   NT_INT,         // int constant (link to symbol table)
   NT_FLOAT,       // float constant
   NT_BOOL,        // bool constant 
+  NT_STRING,      // string constant (link to the literal table)
 
+  NT_COERCE_TO_FLOAT,   // coercion to float (from int or boolean) [op]
 //   NT_COERCE_TO_STR     // coercion to string (from boolean)
 };
 
@@ -61,13 +122,71 @@ enum DataType
   DT_VOID,
   DT_INT,
   DT_FLOAT,
-  DT_BOOL
+  DT_BOOL,
+  DT_INTARRAY,
+  DT_FLOATARRAY,
+  DT_STRING
+};
+
+
+// a simple bump allocator, all the memory is released at once by Clear()
+// the compiler uses it for the syntax tree and the op sequence, which are
+// both thrown away as a whole at the end of a compilation
+class Arena
+{
+  struct Block
+  {
+    Block *next;
+    size_t size;    // usable size of the block (not counting this header)
+    size_t used;
+  };
+
+  Block *blocks;    // the block we are currently allocating from is the first one
+
+  dword allocations;  // the number of allocations since the last Clear()
+  size_t size;        // the size of the blocks
+
+  enum Constant { BlockSize = 64 * 1024, Alignment = sizeof(void *) };
+
+public:
+
+  // throws std::bad_alloc like new when there is no memory left
+  void* Alloc(size_t size);
+
+  // releases all the memory allocated so far
+  void Clear();
+
+  // exchanges the memory of two arenas
+  void Swap(Arena& arena);
+
+  dword GetAllocations() { return allocations; }
+  size_t GetSize() { return size; }
+
+  Arena();
+  ~Arena();
+};
+
+
+// a lock that one thread at a time can hold
+class CriticalSection
+{
+  CRITICAL_SECTION section;
+
+public:
+
+  void Enter() { EnterCriticalSection(&section); }
+  void Leave() { LeaveCriticalSection(&section); }
+
+  CriticalSection() { InitializeCriticalSection(&section); }
+  ~CriticalSection() { DeleteCriticalSection(&section); }
 };
 
 
 // the syntax tree node
 // this structure is used for generating a syntax tree 
 // based on the input received from the parser
+// nodes are allocated from the arena of the active compiler, so there is
+// no need (and no way) to delete them one by one
 struct Node  
 {
   NodeType type;
@@ -83,13 +202,24 @@ struct Node
   Node(NodeType t, Node *a, Node *b);
   Node(NodeType t, Node *a, Node *b, Node *c);
 
+  static void* operator new(size_t size);
+  static void operator delete(void *p) { }
+
+#if defined(WIN32) && defined(_DEBUG)
+  // TyroDebug.h maps new to the debug version of operator new
+  static void* operator new(size_t size, int, const char *, int) { return operator new(size); }
+  static void operator delete(void *p, int, const char *, int) { }
+#endif
 };
 
+typedef vector<Node *> NodeVector;
+
 
 
 // this structure is used for building the intermeidate op sequence (or chain)
 // the code is easier to optimize in this state
 // this chain is converted to actual bytecode
+// like nodes, ops live in the arena of the active compiler
 struct Op
 {
   dword offset;   // this is the offset from the beginning of the bytecode buffer
@@ -100,6 +230,16 @@ struct Op
   // operands
   Symbol *symbol;
   Op *target;
+  Op *limit;      // the LOAD or PUSH op of the limit of a LOOPINC
+  dword count;    // the number of table entries that follow a TABLESWITCH,
+                  // the number of arguments of a CALLS or the frame size of a FRAME
+
+  dword line;     // the source line the op was built for, 0 if it isn't known
+  Symbol *variable;   // the variable a LOAD or STORE of a slot of the SSA optimizer
+                      // stands for in the profiles, the operand is the slot
+
+  dword refs;     // the number of jumps that target this op
+                  // only valid while the peephole optimizer is running
 
   // the next op in the op chain
   Op *next;
@@ -109,11 +249,18 @@ struct Op
   Op(OPCODE opcode, dword operand);
   Op(OPCODE opcode, Op *target);
   Op(OPCODE opcode, Symbol *symbol);
-  
-  ~Op();
 
   // add op to the end of this chain, returns this
   Op* Concat(Op *op);
+
+  static void* operator new(size_t size);
+  static void operator delete(void *p) { }
+
+#if defined(WIN32) && defined(_DEBUG)
+  // TyroDebug.h maps new to the debug version of operator new
+  static void* operator new(size_t size, int, const char *, int) { return operator new(size); }
+  static void operator delete(void *p, int, const char *, int) { }
+#endif
 };
 
 
@@ -129,31 +276,285 @@ struct Symbol
                       // (each symbol type has its own table)
 
   void *data;         // pointer to additional data
+
+  DataType type;      // the type of a variable, inferred from the values assigned to it,
+                      // or the type of the values a function returns
   
   Symbol(const char *contents, dword line);
 
   dword ToDword();
+  float ToFloat();
+  bool ToBool();
 };
 
 
-// note: MyComp should be less<string>, but since an implementation of "less" for hash tables
-// is missing from MSVC7 we have to use our own class called MyComp
-// This should be fixed in subsequent MSVC releases
-// typedef hash_map<string, Symbol *, less<string> > SymbolTable;
-#include "MyComp.h"
-typedef hash_map<string, Symbol *, MyComp> SymbolTable;
-typedef hash_map<string, Function *, MyComp> FunctionTable;
+// returns a hash of the name, every byte changes all the bits of the hash
+// (see Node.cpp)
+dword HashName(const char *name, size_t length);
+
+// a table of named values, it works like a map from the names to the values
+// the names are interned, every one is kept once in the arena of the table and
+// gets the index of its entry as its id, which stays the same until the table
+// is cleared, the entries keep the order they were added in, so everything that
+// is numbered in the order of a table gets the same numbers everywhere
+// the slots are open addressed and hold the index of an entry plus one, 0 for
+// an empty slot and Removed for a slot that has to be probed past
+template<class T> class NameTable
+{
+public:
+
+  struct Entry
+  {
+    const char *first;    // the name, in the arena
+    T second;
+    dword length;
+    dword hash;
+    bool removed;
+  };
+
+  typedef pair<string, T> value_type;
+
+  class iterator
+  {
+    friend class NameTable;
+
+    NameTable *table;
+    dword index;
+
+    // skips the removed entries
+    void Skip() { while(index < table->entries.size() && table->entries[index].removed) index ++; }
+
+    iterator(NameTable *t, dword i) : table(t), index(i) { Skip(); }
+
+  public:
+
+    iterator() : table(null), index(0) { }
+
+    Entry& operator*() { return table->entries[index]; }
+    Entry* operator->() { return &table->entries[index]; }
+
+    iterator& operator++() { index ++; Skip(); return *this; }
+    iterator operator++(int) { iterator i = *this; ++ *this; return i; }
+
+    bool operator==(const iterator& i) const { return index == i.index; }
+    bool operator!=(const iterator& i) const { return index != i.index; }
+  };
+
+private:
+
+  vector<Entry> entries;
+  vector<dword> slots;      // the number of slots is a power of 2
+  dword used;               // the slots that aren't empty, including the removed ones
+  dword count;              // the entries that aren't removed
+  Arena names;
+
+  enum Constant { Removed = 0xffffffff, MinSlots = 16 };
+
+  // returns the slot of the name, or the empty slot it would go to
+  dword Probe(const char *name, dword length, dword hash)
+  {
+    dword mask = (dword)slots.size() - 1, free = Removed;
+
+    for(dword i = hash & mask; ; i = (i + 1) & mask) {
+      dword slot = slots[i];
+      if(slot == 0) return free != Removed ? free : i;
+
+      if(slot == Removed) {
+        if(free == Removed) free = i;
+        continue;
+      }
+
+      Entry& entry = entries[slot - 1];
+      if(entry.hash == hash && entry.length == length && memcmp(entry.first, name, length) == 0)
+        return i;
+    }
+  }
+
+  // makes room for another entry, the removed slots are dropped on the way
+  void Grow()
+  {
+    if(!slots.empty() && (used + 1) * 4 < slots.size() * 3) return;
+
+    dword size = MinSlots;
+    while(size * 3 <= (count + 1) * 4 * 2) size *= 2;
+
+    slots.assign(size, 0);
+    for(dword i = 0; i < entries.size(); i ++) {
+      if(entries[i].removed) continue;
+
+      dword j = entries[i].hash & (size - 1);
+      while(slots[j] != 0) j = (j + 1) & (size - 1);
+      slots[j] = i + 1;
+    }
+    used = count;
+  }
+
+  // the keys are in the arena, a copy would share them
+  NameTable(const NameTable&);
+  NameTable& operator=(const NameTable&);
+
+public:
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, (dword)entries.size()); }
+
+  dword size() { return count; }
+  bool empty() { return count == 0; }
+
+  iterator find(const char *name, size_t length)
+  {
+    if(count == 0) return end();
+
+    dword hash = HashName(name, length);
+    dword slot = slots[Probe(name, (dword)length, hash)];
+    return slot != 0 && slot != Removed ? iterator(this, slot - 1) : end();
+  }
+
+  iterator find(const char *name) { return find(name, strlen(name)); }
+  iterator find(const string& name) { return find(name.c_str(), name.size()); }
+
+  // adds the value unless there is one with the same name already
+  pair<iterator, bool> insert(const value_type& value)
+  {
+    Grow();
+
+    dword length = (dword)value.first.size(), hash = HashName(value.first.c_str(), length);
+    dword i = Probe(value.first.c_str(), length, hash);
+    if(slots[i] != 0 && slots[i] != Removed) return make_pair(iterator(this, slots[i] - 1), false);
+
+    char *name = (char *)names.Alloc(length + 1);
+    memcpy(name, value.first.c_str(), length + 1);
+
+    Entry entry = { name, value.second, length, hash, false };
+    entries.push_back(entry);
+
+    if(slots[i] == 0) used ++;
+    slots[i] = (dword)entries.size();
+    count ++;
+
+    return make_pair(iterator(this, (dword)entries.size() - 1), true);
+  }
+
+  // the iterators of the other entries stay valid
+  void erase(iterator i)
+  {
+    Entry& entry = entries[i.index];
+    slots[Probe(entry.first, entry.length, entry.hash)] = Removed;
+    entry.removed = true;
+    count --;
+  }
+
+  void erase(const string& name)
+  {
+    iterator i = find(name);
+    if(i != end()) erase(i);
+  }
+
+  void swap(NameTable& table)
+  {
+    entries.swap(table.entries);
+    slots.swap(table.slots);
+    std::swap(used, table.used);
+    std::swap(count, table.count);
+    names.Swap(table.names);
+  }
+
+  void clear()
+  {
+    entries.clear();
+    slots.clear();
+    names.Clear();
+    used = count = 0;
+  }
+
+  NameTable() : used(0), count(0) { }
+};
+
+typedef NameTable<Symbol *> SymbolTable;
+typedef NameTable<Function *> FunctionTable;
 
 #define forEach(type, map, i) for(type::iterator i = map.begin(); i != map.end(); i ++)
+#define ClearMap(type, map) { forEach(type, map, i) delete (*i).second; map.clear(); }
+
+typedef vector<Symbol *> SymbolVector;
+
+// a function defined in the script, the data of its symbol points to this
+// every function has its own variables, the parameters come first
+struct ScriptFunction
+{
+  Node *node;             // the NT_FUNCTION node
+  SymbolTable locals;     // the variables of the function by name
+  SymbolVector params;    // the parameters in order
+  dword localcount;       // the size of the frame, including the parameters
+
+  Op *entry;              // the target of the calls
+  Op *body;               // the target of tail calls, follows the FRAME op
+  Op *code;               // the body, null until it has been built
+  Op *frame;              // the FRAME op, null until the function is linked
+
+  bool called;            // true once a CALLS to the function has been built
+  Node *inlined;          // the returned expression if calls are inlined, or null
+
+  ScriptFunction(Node *n) : node(n), localcount(0), entry(null), body(null), code(null),
+    frame(null), called(false), inlined(null)
+  { }
+};
+
+class Profile;
+class CompileCache;
+class Linker;
+
+// the time and the memory each phase of the compilations took, and the
+// amount of code they went through, see Compiler::SetStats()
+// the counts add up over all the compilations until Clear() is called
+struct CompileStats
+{
+  enum Phase { Parse, Functions, Imports, Semantics, Optimize, Build, SSA, Peephole, Layout, Assemble, PhaseCount };
+
+  struct PhaseStats
+  {
+    double time;          // in milliseconds
+    dword allocations;    // the nodes, ops and other arena allocations made
+    size_t memory;        // the largest size of the arena at the end of the phase, in bytes
+                          // (it only grows until the compilation ends)
+  };
+
+  PhaseStats phases[PhaseCount];
+
+  dword compiles;         // the number of compilations, including the failed ones
+  dword nodes;            // the number of syntax tree nodes created
+  dword ops;              // the number of ops created
+  dword symbols;          // the number of variables, constants and functions
+  dword code;             // the number of dwords of bytecode written
+
+  static const char* GetName(Phase phase);
+
+  // prints the counts as a table with a phase per line
+  void Print(FILE *out = stdout);
+
+  // adds the counts of other stats to these
+  void Add(const CompileStats& stats);
+
+  void Clear();
+
+  CompileStats() { Clear(); }
+};
 
 // this class is global list of available imports
 class ImportList
 {
   friend class Compiler;
+  friend class CompileCache;
   FunctionTable functions;
 
+  // any number of compilers may use the list at the same time
+  CriticalSection lock;
+
 public:
 
+  // returns the function with the given name, null if there is none
+  Function* Find(const string& name);
+
   // adds a single function to the import list
   bool Add(Function *function);
 
@@ -171,26 +572,236 @@ public:
 
 class Compiler
 {
-  static Compiler *active; // the pointer to the currently active compiler
+  static __declspec(thread) Compiler *active; // the active compiler of the current thread
+
+  // the lexer and the parser keep their state in globals, so only
+  // one compiler at a time parses, the rest of a compilation runs
+  // in parallel with other compilers
+  static CriticalSection parsing;
 
   Node *tree;
   SymbolTable variables, constants, functions;
 
+  // the string literals, by their bytes, they are put in the constant pool
+  // of the assembly before the program is built
+  SymbolTable literals;
+
+  // the functions defined in the script, their symbols are not in functions
+  SymbolTable scripts;
+
+  // the functions of modules the script calls, their symbols are not in functions
+  SymbolTable externals;
+
+  // holds the syntax tree and the op sequence of the current compilation
+  Arena arena;
+
   const char *filename;
   dword errorcount;
 
+  dword locals;         // the size of the local variable array
+
+  ScriptFunction *building;   // the function that is being built, null for the program
+
+  dword endline;        // the last line of the source, 0 while it is being parsed
+
+  dword optimization;   // the optimization level, 0 turns all optimizations off
+  dword unroll;         // the number of copies of the body in an unrolled loop
+
+  Profile *profile;     // the execution counts of an earlier run, or null
+  CompileCache *cache;  // the scripts compiled earlier, or null
+
+  Linker *linker;       // the modules the scripts can call, or null
+  bool module;          // true if the scripts are compiled as modules
+
+  CompileStats *stats;  // receives the counts of the phases, or null
+  LARGE_INTEGER phasestart;   // when the current phase started
+  dword phaseallocations;     // the allocations of the arena before the current phase
+  dword nodecount, opcount;   // the nodes and ops created in the current phase
+
+  // what a session keeps from one snippet to the next, see BeginSession()
+  bool session;
+  SymbolVector sessionvariables;      // the variables by index
+  vector<DataType> sessiontypes;      // their types after the last snippet
+  vector<Function *> sessionimports;  // the imports the snippets call by index
+
+  // loops with more nodes than this in their body or a larger step are not unrolled
+  // a switch uses a jump table for at least MinTableCases cases that fill at least
+  // half of the table, if/else chains of MinSwitchCases tests become switches
+  // functions that return an expression of at most MaxInlineNodes nodes are inlined
+  // code that runs less than once per ColdRatio runs of its function is cold
+  // the steps a loop adds to the index of an array that isn't checked add up
+  // to at most MaxIndexStep per iteration
+  enum Constant { MaxUnrollNodes = 40, MaxUnrollStep = 0x10000, MinTableCases = 4, MinSwitchCases = 4,
+    MaxInlineNodes = 24, ColdRatio = 100, MaxIndexStep = 0x10000 };
+
   // checks whether the imported function is called with the right parameters
   bool CheckFunctionSemantics(Node *node);
 
-  // checks overall semantics of the source code
+  // checks whether a script function is called with the right number of arguments
+  bool CheckScriptCall(Node *node);
+
+  // checks the arguments of a call to a function of a module and coerces
+  // the ones of float parameters
+  bool CheckModuleCall(Node *node);
+
+  // checks overall semantics of the source code, including the script functions
   bool CheckSemantics(Node *node);
 
+  // sets the return type and checks the semantics of a single node
+  // the children of the node must have been checked already
+  // operands of mixed int and float operations are coerced to float here
+  bool CheckNode(Node *node);
+
+  // sets the return type of a node from its children and the variable types
+  // an assignment widens the type of its variable, returns true if it did
+  bool InferType(Node *node);
+
+  // fills args with the addresses of the arguments in a parameter list
+  static void GetArguments(Node *&params, vector<Node **>& args);
+
+  // fills operands with the addresses of the operands of an array node,
+  // its children or the parameter list of NT_VSELECT
+  static void GetOperands(Node *node, vector<Node **>& operands);
+
+  // fills order with the nodes of the tree in post order (children first)
+  // none of the passes recurse over the tree, so that very long statement
+  // lists and deeply nested expressions don't overflow the stack
+  static void PostOrder(Node *node, NodeVector& order);
+
+  // the same for the tree followed by the bodies of the script functions
+  void PostOrderAll(Node *node, NodeVector& order);
+
+  // folds operations on literals and propagates the values of variables
+  // that are assigned a constant exactly once (see Folding.cpp)
+  void FoldConstants(Node *node);
+
+  // replaces node with a literal if all of its operands are literals
+  bool FoldNode(Node *node);
+
+  // turns node into a literal of the given type
+  void MakeLiteral(Node *node, NodeType type, dword value);
+
+  // rotates while loops into guarded do-while loops and unrolls small
+  // counting loops (see Loops.cpp)
+  void OptimizeLoops(Node *node);
+  void RotateLoop(Node *loop);
+  bool UnrollLoop(Node *loop);
+
+  // returns a deep copy of the tree
+  Node* CloneTree(Node *node);
+
+  // drops the range check of the array elements a while or for loop indexes
+  // with a variable it compares with the length of the array, see Loops.cpp
+  void RemoveBoundsChecks(Node *node);
+
+  // turns if/else chains that compare a variable with int constants
+  // into switch statements (see Switch.cpp)
+  void FormSwitches(Node *node);
+
+  // fills cases with the NT_CASE nodes of a switch ordered by their values,
+  // returns the default case or null, defaultcount receives the number of defaults
+  static Node* GetCases(Node *node, NodeVector& cases, dword *defaultcount = null);
+
+  // moves the function definitions out of the tree and gives every function
+  // its own variables, calls to them become NT_CALLS (see Functions.cpp)
+  void CollectFunctions(Node *node);
+
+  // runs pass on the tree and on the body of every script function
+  void ForEachBody(Node *node, void (Compiler::*pass)(Node *));
+
+  // decides which functions are inlined, after the bodies have been folded
+  void FindInlines();
+
+  // builds the functions that are called until no new ones turn up and
+  // sets the indices of their variables
+  void BuildFunctions();
+
+  // appends the functions to the op chain of the program
+  Op* LinkFunctions(Op *op);
+
+  // builds a call, an inlined call or a tail call of a script function
+  void BuildCall(Node *node, vector<struct BuildItem>& work, bool tail);
+
+  // deletes the script functions and their variables
+  void ClearFunctions();
+
+  // sets the indices of the variables in table, the ones in first come first
+  // in that order, the others follow from the most to the least accessed in
+  // the profile, where their names start with prefix
+  void SetVariableIndices(SymbolTable& table, SymbolVector& first, const string& prefix);
+
+  // moves the code that the profile says is cold to the end and makes the
+  // hot code fall through the branches around it (see Layout.cpp)
+  // returns the new beginning of the op chain
+  Op* LayoutBlocks(Op *op);
+
   Op* Build(Node *node);
+
+  // builds the dispatch of a switch statement as a jump table, a binary
+  // search or a mix of both, depending on how dense the case values are
+  void BuildSwitch(Node *node, vector<struct BuildItem>& work);
   bool Assemble(Op *op, Assembly& assembly);
 
+  // peephole optimizer, rewrites short op sequences using the patterns
+  // in Peephole.cpp, threads jumps and removes unreachable code
+  // returns the new beginning of the op chain
+  Op* Peephole(Op *op);
+
+  // SSA optimizer, numbers the values of the op chain across the whole
+  // program and moves loop invariant code out of loops (see SSA.cpp)
+  // the chain is the program or the body of a function with the given
+  // parameters, localcount receives the new number of local variables
+  // returns the new beginning of the op chain, or op if it can't be optimized
+  Op* OptimizeSSA(Op *op, dword& localcount, SymbolVector& params);
+
+  // turns calls to intrinsic functions that aren't imported into intrinsic nodes
+  // and removes the intrinsics from the function table
+  void ResolveIntrinsics(Node *node, ImportList& importlist);
+
+  // turns calls to functions of the modules of the linker that aren't imported
+  // into NT_CALLM nodes and moves them from the function table to externals
+  void ResolveModules(Node *node, ImportList& importlist);
+
+  // adds the functions of a module to the exports of the assembly
+  void ExportFunctions(Assembly& assembly);
+
+  // returns the op that implements an intrinsic or bitwise node, NOOP for other nodes
+  static OPCODE BitOp(NodeType type);
+
+  // returns the op that implements an array or a string node, NOOP for other nodes
+  // the length of a string is SLEN rather than ALEN
+  static OPCODE ArrayOp(NodeType type);
+  static OPCODE StringOp(NodeType type);
+
+  // checks the operands of an array or a string node and coerces the values
+  // stored in float arrays
+  bool CheckOperands(Node *node);
+
   // moves function pointers from the import list to the assembly
   bool MoveFunctions(Assembly& assembly, ImportList& importlist);
 
+  // starts the clock of the first phase of a compilation
+  void BeginPhases();
+
+  // adds the time, the allocations and the memory since the end of the
+  // phase before to the stats of the phase, if there are stats
+  void EndPhase(CompileStats::Phase phase);
+
+  // does the work of Compile(), which undoes a failed snippet of a session
+  bool CompileStream(FILE *in, const char *name, Assembly& assembly, ImportList& importlist);
+
+  // drops the variables of a failed snippet and the types it gave the others
+  void RestoreSession();
+
+  // converts the values of the variables that were ints until the snippet
+  // made them floats, returns the new beginning of the op chain
+  Op* ConvertWidened(Op *op);
+
+  // compiles the scripts of a batch that no other thread has taken yet
+  // with a compiler of its own that has the settings of this one
+  void CompileScripts(struct Batch *batch);
+  static DWORD WINAPI BatchThread(LPVOID batch);
+
 public:
 
   void Error(const char *message = null, dword line = 0);
@@ -201,12 +812,90 @@ public:
   Symbol* GetVariable(const char *name);
   Symbol* GetConstant(const char *name);
 
+  // returns the symbol of the string literal with the given bytes, the
+  // parser passes them with the escapes already replaced
+  Symbol* GetLiteral(const char *text, size_t length);
+
   Symbol* GetFunction(const char *name);
 
+  // returns the line of the source the parser is at, the nodes and the symbols
+  // created after the parse get the last line, as only the parser may read the
+  // line counter of the lexer (see parsing)
+  dword GetLine();
+
   static inline Compiler* GetActive() { return active; }
 
+  // allocate the nodes and the ops from the arena
+  void* AllocateNode(size_t size) { nodecount ++; return arena.Alloc(size); }
+  void* AllocateOp(size_t size) { opcount ++; return arena.Alloc(size); }
+
+  // sets the optimization level used by Compile(), the default is 1
+  // 1 runs the peephole optimizer, folds constants and rotates loops
+  // 2 also unrolls small counting loops and runs the SSA optimizer
+  void SetOptimization(dword level) { optimization = level; }
+
+  // sets the unroll factor used at optimization level 2, 1 turns unrolling off
+  void SetUnrollFactor(dword factor) { unroll = factor < 16 ? factor : 16; }
+
+  // sets the profile used by Compile(), null compiles without one
+  // the profile has to be gathered from the code compiled without it
+  // at the same optimization level, see Profile
+  void SetProfile(Profile *profile) { this->profile = profile; }
+
+  // sets the cache the compiled scripts are looked up in and stored to,
+  // null compiles every script, a compiler with a profile doesn't use it
+  void SetCache(CompileCache *cache) { this->cache = cache; }
+
+  // sets the linker whose modules the scripts can call functions of, null
+  // if there are none, the scripts have to be linked before they run
+  void SetLinker(Linker *linker) { this->linker = linker; }
+
+  // compiles the following scripts as modules, which build and export all
+  // of their functions, see Linker
+  void SetModule(bool module) { this->module = module; }
+
+  // sets the stats the time, the memory and the code of every phase of the
+  // following compilations are added to, null turns them off
+  void SetStats(CompileStats *stats) { this->stats = stats; }
+
+  // the size of the pipe a source in memory is compiled through, longer ones
+  // are written by a thread of their own while they're parsed, and the
+  // largest read buffer used for a file
+  enum Buffer { PipeSize = 64 * 1024, MaxReadBuffer = 1024 * 1024 };
+
   bool Compile(const char *filename, Assembly& assembly, ImportList& importlist);
 
+  // starts a session, where Compile() appends the code of every snippet to the
+  // assembly, which has to be the same every time, and compiles it against the
+  // variables and the imports of the snippets before it, VirtualMachine::Resume()
+  // then runs it with the values those left behind
+  // a session only runs the peephole optimizer and doesn't use the cache or
+  // the profile, a snippet can't call the functions defined by earlier ones
+  void BeginSession();
+  void EndSession();
+
+  // compiles the source of the given length in memory, the name is used in the
+  // error messages and may be null
+  bool Compile(const char *source, size_t length, const char *name, Assembly& assembly, ImportList& importlist);
+
+  // compiles the source read from a stream, which is left open
+  bool Compile(FILE *in, const char *name, Assembly& assembly, ImportList& importlist);
+
+  // compiles source in a single pass, the bytecode is written while the source
+  // is parsed, there is no syntax tree, no op chain and no optimization
+  // it's meant for short snippets that have to be compiled as fast as possible
+  // and only handles int and bool code with if, while and do statements and calls
+  // to imports, for anything else it returns false and Compile() has to be used,
+  // which reports the errors as well (see SinglePass.cpp)
+  bool CompileSinglePass(const char *source, Assembly& assembly, ImportList& importlist);
+
+  // compiles count scripts into the matching assemblies on the given number of
+  // threads, 0 uses a thread per processor, the compilers have the settings of
+  // this one, returns the number of scripts compiled, the assemblies of the
+  // others are left empty (see Batch.cpp)
+  dword CompileBatch(const char *filenames[], Assembly assemblies[], dword count,
+    ImportList& importlist, dword threads = 0);
+
   Compiler();
   ~Compiler();
 
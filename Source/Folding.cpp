@@ -0,0 +1,354 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include <map>
+
+#include "TyroDebug.h"
+
+
+//*** Constant folding
+
+#define tofloat(x) (*((float *)x))
+#define tosigned(x) (*((long *)x))  // signed int
+
+static bool IsLiteral(Node *node)
+{
+  return node != null && (node->type == NT_INT || node->type == NT_FLOAT || node->type == NT_BOOL);
+}
+
+// returns the value of a literal the way it is pushed on the stack
+static dword LiteralValue(Node *node)
+{
+  float f;
+  switch(node->type) {
+    case NT_FLOAT:
+      f = node->symbol->ToFloat();
+      return *((dword *)&f);
+
+    case NT_BOOL:
+      return node->symbol->ToBool() ? 1 : 0;
+  }
+
+  return node->symbol->ToDword();
+}
+
+// true if a literal is a true condition, Build() compares floats with 0.0,
+// so -0.0 is false as well
+static bool LiteralTrue(Node *node)
+{
+  if(node->type == NT_FLOAT) {
+    float f = node->symbol->ToFloat();
+    return f < 0.0f || f > 0.0f;
+  }
+
+  return LiteralValue(node) != 0;
+}
+
+void Compiler::MakeLiteral(Node *node, NodeType type, dword value)
+{
+  char buffer[32];
+  switch(type) {
+    case NT_FLOAT:
+      sprintf(buffer, "%.9g", tofloat(&value));
+      node->rettype = DT_FLOAT;
+      break;
+
+    case NT_BOOL:
+      strcpy(buffer, value ? "true" : "false");
+      node->rettype = DT_BOOL;
+      break;
+
+    default:
+      sprintf(buffer, "%ld", tosigned(&value));
+      node->rettype = DT_INT;
+      break;
+  }
+
+  node->type = type;
+  node->symbol = GetConstant(buffer);
+  node->child[0] = node->child[1] = node->child[2] = null;
+}
+
+bool Compiler::FoldNode(Node *node)
+{
+  Node *a = node->child[0], *b = node->child[1];
+
+  // the concatenation of two literals is a literal
+  if(node->type == NT_ADD && a->type == NT_STRING && b->type == NT_STRING) {
+    string text = a->symbol->contents + b->symbol->contents;
+    node->type = NT_STRING;
+    node->symbol = GetLiteral(text.data(), text.size());
+    node->child[0] = node->child[1] = null;
+    return true;
+  }
+
+  // statements with a constant condition
+  switch(node->type) {
+    case NT_IFTHEN:
+      if(!IsLiteral(a)) return false;
+      if(LiteralTrue(a)) *node = *b;
+      else node->type = NT_EMPTY;
+      return true;
+
+    case NT_IFTHENELSE:
+      if(!IsLiteral(a)) return false;
+      *node = LiteralTrue(a) ? *b : *node->child[2];
+      return true;
+
+    case NT_WHILE:
+    case NT_FOR:
+      if(!IsLiteral(a) || LiteralTrue(a)) return false;
+      node->type = NT_EMPTY;
+      return true;
+
+    // only the matching case is left
+    case NT_SWITCH:
+      if(!IsLiteral(a)) return false;
+      {
+        NodeVector cases;
+        Node *def = GetCases(node, cases), *body = def != null ? def->child[0] : null;
+
+        for(NodeVector::iterator i = cases.begin(); i != cases.end(); i ++) {
+          if((*i)->child[0]->symbol->ToDword() == LiteralValue(a)) body = (*i)->child[1];
+        }
+
+        if(body != null) *node = *body;
+        else node->type = NT_EMPTY;
+      }
+      return true;
+
+    case NT_DOWHILE:
+      if(!IsLiteral(b) || LiteralTrue(b)) return false;
+      *node = *a;
+      return true;
+
+    // the comparisons of string literals, the literals they leave unused stay
+    // in the constant pool
+    case NT_STREQUAL:
+      if(a->type != NT_STRING || b->type != NT_STRING) return false;
+      MakeLiteral(node, NT_INT, a->symbol->contents == b->symbol->contents);
+      return true;
+
+    case NT_STRCOMPARE:
+      if(a->type != NT_STRING || b->type != NT_STRING) return false;
+      {
+        int c = a->symbol->contents.compare(b->symbol->contents);
+        MakeLiteral(node, NT_INT, c < 0 ? (dword)-1 : c > 0 ? 1 : 0);
+      }
+      return true;
+
+    case NT_COERCE_TO_FLOAT:
+      if(!IsLiteral(a) || a->type == NT_FLOAT) return false;
+      {
+        dword x = LiteralValue(a);
+        float f = (float)tosigned(&x);
+        MakeLiteral(node, NT_FLOAT, *((dword *)&f));
+      }
+      return true;
+
+    case NT_EQUAL:
+    case NT_NEQUAL:
+    case NT_LESS:
+    case NT_LEQUAL:
+    case NT_GREATER:
+    case NT_GEQUAL:
+    case NT_BOOLAND:
+    case NT_BOOLOR:
+    case NT_ADD:
+    case NT_SUB:
+    case NT_MUL:
+    case NT_DIV:
+    case NT_MOD:
+    case NT_BAND:
+    case NT_BOR:
+    case NT_BXOR:
+    case NT_SHL:
+    case NT_SAR:
+    case NT_ROTL:
+    case NT_ROTR:
+      break;
+
+    // operations with a single int operand
+    case NT_BNOT:
+    case NT_POPCOUNT:
+    case NT_CLZ:
+    case NT_CTZ:
+    case NT_BSWAP:
+      if(!IsLiteral(a)) return false;
+      if(node->type == NT_BNOT)
+        MakeLiteral(node, NT_INT, ~LiteralValue(a));
+      else
+        MakeLiteral(node, NT_INT, VirtualMachine::Evaluate(BitOp(node->type), LiteralValue(a), 0));
+      return true;
+
+    default:
+      return false;
+  }
+
+  // && and || are short circuited, so a literal left operand decides
+  // whether the right one is evaluated at all
+  if((node->type == NT_BOOLAND || node->type == NT_BOOLOR) && IsLiteral(a)) {
+    bool value = LiteralTrue(a);
+    if(value == (node->type == NT_BOOLOR)) {
+      MakeLiteral(node, NT_BOOL, value);
+      return true;
+    }
+
+    // the right operand is the result, as long as it is a bool already
+    if(b->rettype == DT_BOOL) {
+      *node = *b;
+      return true;
+    }
+  }
+
+  // constant factors go to the right, where the peephole optimizer
+  // turns multiplications by powers of two into shifts
+  if(node->type == NT_MUL && IsLiteral(a) && !IsLiteral(b)) {
+    node->child[0] = b;
+    node->child[1] = a;
+    return false;
+  }
+
+  if(!IsLiteral(a) || !IsLiteral(b)) return false;
+
+  dword x = LiteralValue(a), y = LiteralValue(b), r;
+
+  // float operations, CheckNode() has coerced mixed operands already
+  if(a->type == NT_FLOAT || b->type == NT_FLOAT) {
+    if(a->type != b->type) return false;
+
+    float fx = tofloat(&x), fy = tofloat(&y), f;
+    switch(node->type) {
+      case NT_ADD: f = fx + fy; break;
+      case NT_SUB: f = fx - fy; break;
+      case NT_MUL: f = fx * fy; break;
+      case NT_DIV: f = fx / fy; break;
+
+      case NT_EQUAL:   MakeLiteral(node, NT_BOOL, fx == fy); return true;
+      case NT_NEQUAL:  MakeLiteral(node, NT_BOOL, fx != fy); return true;
+      case NT_LESS:    MakeLiteral(node, NT_BOOL, fx < fy); return true;
+      case NT_LEQUAL:  MakeLiteral(node, NT_BOOL, fx <= fy); return true;
+      case NT_GREATER: MakeLiteral(node, NT_BOOL, fx > fy); return true;
+      case NT_GEQUAL:  MakeLiteral(node, NT_BOOL, fx >= fy); return true;
+
+      default:
+        return false;
+    }
+
+    // infinities and NaNs don't survive the trip through the constant table
+    if(f - f != 0) return false;
+
+    MakeLiteral(node, NT_FLOAT, *((dword *)&f));
+    return true;
+  }
+
+  // int and bool operations, these give exactly the same results as the VM
+  switch(node->type) {
+    case NT_ADD: r = x + y; break;
+    case NT_SUB: r = x - y; break;
+    case NT_MUL: r = x * y; break;
+
+    case NT_DIV:
+      if(y == 0) return false;
+      r = x / y;
+      break;
+
+    case NT_MOD:
+      // leave the traps to run time
+      if(y == 0 || (x == 0x80000000 && tosigned(&y) == -1)) return false;
+      r = tosigned(&x) % tosigned(&y);
+      break;
+
+    case NT_BAND: r = x & y; break;
+    case NT_BOR:  r = x | y; break;
+    case NT_BXOR: r = x ^ y; break;
+    case NT_SHL:  r = x << (y & 31); break;
+    case NT_SAR:  r = tosigned(&x) >> (y & 31); break;
+
+    case NT_ROTL:
+    case NT_ROTR:
+      r = VirtualMachine::Evaluate(BitOp(node->type), x, y);
+      break;
+
+    case NT_EQUAL:   MakeLiteral(node, NT_BOOL, x == y); return true;
+    case NT_NEQUAL:  MakeLiteral(node, NT_BOOL, x != y); return true;
+    case NT_LESS:    MakeLiteral(node, NT_BOOL, tosigned(&x) < tosigned(&y)); return true;
+    case NT_LEQUAL:  MakeLiteral(node, NT_BOOL, tosigned(&x) <= tosigned(&y)); return true;
+    case NT_GREATER: MakeLiteral(node, NT_BOOL, tosigned(&x) > tosigned(&y)); return true;
+    case NT_GEQUAL:  MakeLiteral(node, NT_BOOL, tosigned(&x) >= tosigned(&y)); return true;
+
+    case NT_BOOLAND: MakeLiteral(node, NT_BOOL, x && y); return true;
+    case NT_BOOLOR:  MakeLiteral(node, NT_BOOL, x || y); return true;
+
+    default:
+      return false;
+  }
+
+  MakeLiteral(node, NT_INT, r);
+  return true;
+}
+
+void Compiler::FoldConstants(Node *node)
+{
+  NodeVector order, statements, stack;
+  NodeVector::iterator i;
+
+  // count the assignments to every variable
+  map<Symbol *, dword> assignments;
+
+  PostOrder(node, order);
+  for(i = order.begin(); i != order.end(); i ++) {
+    if((*i)->type == NT_ASSIGN) assignments[(*i)->symbol] ++;
+  }
+
+  // collect the top level statements in the order they are executed
+  stack.push_back(node);
+  while(!stack.empty()) {
+    Node *n = stack.back();
+    stack.pop_back();
+    if(n == null) continue;
+
+    if(n->type == NT_STMT) {
+      stack.push_back(n->child[1]);
+      stack.push_back(n->child[0]);
+    } else
+      statements.push_back(n);
+  }
+
+  // the variables known to hold a constant from this statement on
+  map<Symbol *, Node *> values;
+
+  for(i = statements.begin(); i != statements.end(); i ++) {
+    PostOrder(*i, order);
+
+    // the children of a node are folded before the node itself
+    for(NodeVector::iterator j = order.begin(); j != order.end(); j ++) {
+      Node *n = *j;
+
+      for(int k = 0; k < sizeof(n->child)/sizeof(Node *); k ++) {
+        Node *c = n->child[k];
+        if(c == null || c->type != NT_IDENT) continue;
+
+        map<Symbol *, Node *>::iterator v = values.find(c->symbol);
+        if(v != values.end()) {
+          c = new Node(v->second->type);
+          c->symbol = v->second->symbol;
+          c->rettype = v->second->rettype;
+          c->line = n->child[k]->line;
+          n->child[k] = c;
+        }
+      }
+
+      FoldNode(n);
+    }
+
+    // a variable that is assigned a constant once at the top level holds
+    // that value in every statement that follows
+    Node *s = *i;
+    if(s->type == NT_EXPR && s->child[0]->type == NT_ASSIGN) {
+      Node *assign = s->child[0];
+      if(IsLiteral(assign->child[0]) && assignments[assign->symbol] == 1)
+        values[assign->symbol] = assign->child[0];
+    }
+  }
+}
@@ -0,0 +1,297 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include <set>
+#include <algorithm>
+
+#include "TyroDebug.h"
+
+
+//*** Script functions
+
+// returns the variable of the function with the given name, creating it if necessary
+static Symbol* GetLocal(ScriptFunction *function, const string& name, dword line)
+{
+  SymbolTable::iterator i = function->locals.find(name);
+  if(i != function->locals.end()) return (*i).second;
+
+  Symbol *symbol = new Symbol(name.c_str(), line);
+  function->locals.insert(SymbolTable::value_type(name, symbol));
+  return symbol;
+}
+
+void Compiler::GetArguments(Node *&params, vector<Node **>& args)
+{
+  vector<Node **> stack;
+  stack.push_back(&params);
+
+  while(!stack.empty()) {
+    Node **n = stack.back();
+    stack.pop_back();
+    if(*n == null || (*n)->type == NT_EMPTY) continue;
+
+    if((*n)->type == NT_PARAM) {
+      stack.push_back(&(*n)->child[1]);
+      stack.push_back(&(*n)->child[0]);
+    } else
+      args.push_back(n);
+  }
+}
+
+void Compiler::PostOrderAll(Node *node, NodeVector& order)
+{
+  NodeVector body;
+  PostOrder(node, order);
+
+  forEach(SymbolTable, scripts, i) {
+    PostOrder(((ScriptFunction *)(*i).second->data)->node->child[1], body);
+    order.insert(order.end(), body.begin(), body.end());
+  }
+}
+
+void Compiler::CollectFunctions(Node *node)
+{
+  NodeVector order, stack;
+  set<Node *> toplevel;
+  char buffer[256];
+
+  // functions are defined by the top level statements
+  stack.push_back(node);
+  while(!stack.empty()) {
+    Node *n = stack.back();
+    stack.pop_back();
+
+    if(n == null) continue;
+    if(n->type == NT_STMT) {
+      stack.push_back(n->child[1]);
+      stack.push_back(n->child[0]);
+    } else if(n->type == NT_FUNCTION)
+      toplevel.insert(n);
+  }
+
+  PostOrder(node, order);
+  for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+    Node *n = *i;
+    if(n->type != NT_FUNCTION) continue;
+
+    // the definition leaves the tree, an empty statement takes its place
+    Node *definition = new Node(NT_FUNCTION);
+    *definition = *n;
+    n->type = NT_EMPTY;
+    n->symbol = null;
+    n->child[0] = n->child[1] = n->child[2] = null;
+
+    Symbol *symbol = definition->symbol;
+    if(toplevel.find(n) == toplevel.end()) {
+      Error("functions can only be defined at the top level", definition);
+      continue;
+    }
+
+    if(symbol->data != null) {
+      sprintf(buffer, "\'%s\' : function is already defined", symbol->contents.c_str());
+      Error(buffer, definition);
+      continue;
+    }
+
+    // a function defined in the script takes precedence over an import of the same name
+    functions.erase(symbol->contents);
+    scripts.insert(SymbolTable::value_type(symbol->contents, symbol));
+
+    ScriptFunction *function = new ScriptFunction(definition);
+    function->entry = new Op(NOOP);
+    symbol->data = function;
+
+    vector<Node **> params;
+    GetArguments(definition->child[0], params);
+
+    for(dword j = 0; j < params.size(); j ++) {
+      Node *param = *params[j];
+      if(param->type != NT_IDENT) {
+        Error("function parameters must be variable names", definition);
+        continue;
+      }
+
+      Symbol *local = GetLocal(function, param->symbol->contents, param->line);
+      if(find(function->params.begin(), function->params.end(), local) != function->params.end()) {
+        sprintf(buffer, "\'%s\' : parameter is defined more than once", local->contents.c_str());
+        Error(buffer, param);
+        continue;
+      }
+
+      param->symbol = local;
+      function->params.push_back(local);
+    }
+  }
+
+  // the variables of a function are its own, returns know their function
+  forEach(SymbolTable, scripts, i) {
+    ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+
+    PostOrder(function->node->child[1], order);
+    for(NodeVector::iterator j = order.begin(); j != order.end(); j ++) {
+      Node *n = *j;
+      if(n->type == NT_IDENT || n->type == NT_ASSIGN)
+        n->symbol = GetLocal(function, n->symbol->contents, n->symbol->line);
+      else if(n->type == NT_RETURN)
+        n->symbol = (*i).second;
+    }
+  }
+
+  // drop the variables that are only used in functions
+  set<Symbol *> used;
+  PostOrderAll(node, order);
+
+  for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+    Node *n = *i;
+    if(n->type == NT_IDENT || n->type == NT_ASSIGN)
+      used.insert(n->symbol);
+    else if(n->type == NT_CALL && n->symbol->data != null)
+      n->type = NT_CALLS;
+  }
+
+  // the variables of the earlier snippets of a session are kept as well
+  if(session) used.insert(sessionvariables.begin(), sessionvariables.end());
+
+  for(SymbolTable::iterator i = variables.begin(); i != variables.end(); ) {
+    if(used.find((*i).second) != used.end()) {
+      i ++;
+      continue;
+    }
+
+    delete (*i).second;
+    variables.erase(i ++);
+  }
+}
+
+void Compiler::ForEachBody(Node *node, void (Compiler::*pass)(Node *))
+{
+  (this->*pass)(node);
+
+  // the variables of the function are in place while the pass runs
+  // an empty body is null
+  forEach(SymbolTable, scripts, i) {
+    ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+    if(function->node->child[1] == null) continue;
+
+    variables.swap(function->locals);
+    (this->*pass)(function->node->child[1]);
+    variables.swap(function->locals);
+  }
+}
+
+void Compiler::FindInlines()
+{
+  NodeVector stack, statements, order;
+
+  forEach(SymbolTable, scripts, i) {
+    ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+
+    // the body has to be a single return statement
+    statements.clear();
+    stack.push_back(function->node->child[1]);
+
+    while(!stack.empty()) {
+      Node *n = stack.back();
+      stack.pop_back();
+
+      if(n == null || n->type == NT_EMPTY) continue;
+      if(n->type == NT_STMT) {
+        stack.push_back(n->child[1]);
+        stack.push_back(n->child[0]);
+      } else
+        statements.push_back(n);
+    }
+
+    if(statements.size() != 1 || statements[0]->type != NT_RETURN || statements[0]->child[0] == null)
+      continue;
+
+    // of a small expression that doesn't call other script functions
+    Node *value = statements[0]->child[0];
+    PostOrder(value, order);
+    if(order.size() > MaxInlineNodes) continue;
+
+    bool leaf = true;
+    for(NodeVector::iterator j = order.begin(); j != order.end(); j ++) {
+      if((*j)->type == NT_CALLS) leaf = false;
+    }
+
+    if(leaf) function->inlined = value;
+  }
+}
+
+void Compiler::BuildFunctions()
+{
+  // a function is only built once a call to it turns up
+  bool changed;
+  do {
+    changed = false;
+
+    forEach(SymbolTable, scripts, i) {
+      ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+      if(!function->called || function->code != null) continue;
+
+      building = function;
+      variables.swap(function->locals);
+
+      // a function that doesn't return anything returns 0
+      function->body = new Op(NOOP);
+      function->body->next = Build(function->node->child[1]);
+      function->body->Concat(new Op(PUSH, (dword)0));
+      function->body->Concat(new Op(RET));
+      function->code = function->body;
+
+      // the parameters come first, Build() may have added hidden variables
+      SetVariableIndices(variables, function->params, string((*i).first) + ".");
+
+      function->localcount = (dword)variables.size();
+
+      variables.swap(function->locals);
+      building = null;
+      changed = true;
+    }
+  } while(changed);
+}
+
+Op* Compiler::LinkFunctions(Op *op)
+{
+  Op *last = op;
+  while(last->next != null) last = last->next;
+
+  bool first = true;
+  forEach(SymbolTable, scripts, i) {
+    ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+    if(function->code == null) continue;
+
+    // the program doesn't run into the functions
+    if(first) {
+      last->next = new Op(SYS, (dword)SC_EXIT);
+      last = last->next;
+      first = false;
+    }
+
+    Op *frame = new Op(FRAME, (dword)function->params.size());
+    frame->count = function->localcount;
+
+    last->next = function->entry;
+    function->entry->next = frame;
+    function->frame = frame;
+    frame->next = function->code;
+
+    while(last->next != null) last = last->next;
+  }
+
+  return op;
+}
+
+void Compiler::ClearFunctions()
+{
+  forEach(SymbolTable, scripts, i) {
+    ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+    ClearMap(SymbolTable, function->locals);
+
+    delete function;
+    delete (*i).second;
+  }
+
+  scripts.clear();
+}
@@ -0,0 +1,137 @@
+#include "Assembly.h"
+#include "Compiler.h"
+#include "Profile.h"
+
+#include <set>
+
+#include "TyroDebug.h"
+
+
+//*** Profile guided block layout
+
+// a basic block of the op chain
+struct LayoutBlock
+{
+  Op *first, *last;
+  Op *fall;       // the first op of the block control falls through to, or null
+  bool falls;     // false if the block ends with an unconditional jump, a return or an exit
+  bool cold;
+};
+
+// returns the jump with the opposite condition, NOOP if there is none
+static OPCODE InvertJump(OPCODE opcode)
+{
+  switch(opcode) {
+    case IFT: return IFF;
+    case IFF: return IFT;
+    case JEQ: return JNE;
+    case JNE: return JEQ;
+    case JLT: return JGE;
+    case JLE: return JGT;
+    case JGT: return JLE;
+    case JGE: return JLT;
+  }
+
+  return NOOP;
+}
+
+Op* Compiler::LayoutBlocks(Op *op)
+{
+  // the counts only apply to the code as it is assembled without a profile,
+  // which sets the offsets of the ops as well
+  Assembly plain;
+  Assemble(op, plain);
+  if(Profile::Hash(plain) != profile->GetHash()) return op;
+
+  // the jump targets begin blocks
+  set<Op *> targets;
+  for(Op *cop = op; cop != null; cop = cop->next) {
+    if(Assembler::IsJumpOp(cop->opcode) && cop->target != null)
+      targets.insert(cop->target);
+  }
+
+  vector<LayoutBlock> blocks;
+  for(Op *cop = op; cop != null; ) {
+    LayoutBlock block;
+    block.first = cop;
+    block.falls = true;
+    block.cold = false;
+
+    for(;;) {
+      // a jump table stays with its switch
+      if(cop->opcode == TABLESWITCH)
+        for(dword i = 0, count = cop->count; i < count; i ++) cop = cop->next;
+
+      block.last = cop;
+      OPCODE opcode = cop->opcode;
+      cop = cop->next;
+
+      if(opcode == GOTO || opcode == TABLESWITCH || opcode == RET || (opcode == SYS && block.last->operand == SC_EXIT)) {
+        block.falls = false;
+        break;
+      }
+
+      if((Assembler::IsJumpOp(opcode) && opcode != CALLS) || cop == null || targets.find(cop) != targets.end())
+        break;
+    }
+
+    block.fall = block.falls ? cop : null;
+    blocks.push_back(block);
+  }
+
+  // a block is cold if it runs a lot less often than the entry of its function
+  // the first block is where execution starts, so it stays in place
+  dword entry = profile->GetExecuted(blocks[0].first->offset);
+  bool moved = false;
+
+  for(dword i = 0; i < blocks.size(); i ++) {
+    LayoutBlock& block = blocks[i];
+    dword count = profile->GetExecuted(block.first->offset);
+
+    Op *cop = block.first;
+    while(cop != block.last && cop->opcode == NOOP) cop = cop->next;
+    if(cop->opcode == FRAME) entry = count;
+
+    block.cold = i > 0 && (count == 0 || count * ColdRatio < entry);
+    if(block.cold) moved = true;
+  }
+
+  if(!moved) return op;
+
+  // the hot blocks keep their order, the cold ones follow them
+  vector<LayoutBlock *> order;
+  for(dword pass = 0; pass < 2; pass ++) {
+    for(dword i = 0; i < blocks.size(); i ++) {
+      if(blocks[i].cold == (pass == 1)) order.push_back(&blocks[i]);
+    }
+  }
+
+  // blocks that no longer fall through to the right block jump there, a
+  // conditional jump to the block that follows now is inverted instead,
+  // which makes the hot successor of a branch the one that falls through
+  for(dword i = 0; i < order.size(); i ++) {
+    LayoutBlock *block = order[i];
+    Op *next = i + 1 < order.size() ? order[i + 1]->first : null;
+    if(!block->falls || block->fall == next) continue;
+
+    Op *last = block->last, *jump;
+    if(block->fall == null)
+      jump = new Op(SYS, (dword)SC_EXIT);
+    else if(last->target == next && next != null && InvertJump(last->opcode) != NOOP) {
+      last->opcode = InvertJump(last->opcode);
+      last->target = block->fall;
+      continue;
+    } else
+      jump = new Op(GOTO, block->fall);
+
+    jump->line = last->line;
+    jump->next = last->next;
+    last->next = jump;
+    block->last = jump;
+  }
+
+  for(dword i = 0; i < order.size(); i ++)
+    order[i]->last->next = i + 1 < order.size() ? order[i + 1]->first : null;
+
+  return order[0]->first;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+
+#include "Assembly.h"
+#include "Compiler.h"
+#include "Linker.h"
+
+#include <algorithm>
+
+#include "TyroDebug.h"
+
+
+//*** Linker
+
+bool Linker::AddModule(const char *name, Assembly& module)
+{
+  vector<Export>& exports = module.exports;
+  for(dword i = 0; i < exports.size(); i ++) {
+    if(functions.find(exports[i].name) != functions.end()) return false;
+  }
+
+  Module m = { name, &module };
+  modules.push_back(m);
+
+  for(dword i = 0; i < exports.size(); i ++)
+    functions[exports[i].name] = make_pair((dword)modules.size() - 1, i);
+
+  return true;
+}
+
+const Export* Linker::Find(const string& name)
+{
+  map<string, pair<dword, dword> >::iterator i = functions.find(name);
+  if(i == functions.end()) return null;
+
+  return &modules[(*i).second.first].assembly->exports[(*i).second.second];
+}
+
+dword Linker::Place(Assembly& assembly, Assembly& module)
+{
+  dword base = assembly.GetSize();
+  assembly.modules.push_back(make_pair(&module, base));
+
+  // the imports of the module are merged with the ones of the script,
+  // a function both of them import is only there once
+  vector<Function *> imports(assembly.functions, assembly.functions + assembly.functioncount);
+  vector<dword> importindices(module.functioncount);
+
+  for(dword i = 0; i < module.functioncount; i ++) {
+    vector<Function *>::iterator j = find(imports.begin(), imports.end(), module.functions[i]);
+    importindices[i] = (dword)(j - imports.begin());
+    if(j == imports.end()) imports.push_back(module.functions[i]);
+  }
+
+  if(imports.size() != assembly.functioncount) {
+    Function **pointers = new Function*[imports.size()];
+    for(dword i = 0; i < imports.size(); i ++)
+      pointers[i] = imports[i];
+
+    assembly.SetFunctions(pointers, (dword)imports.size());
+  }
+
+  vector<dword> externalindices(module.externals.size());
+  for(dword i = 0; i < module.externals.size(); i ++)
+    externalindices[i] = assembly.AddExternal(module.externals[i]);
+
+  vector<dword> literalindices(module.literals.size());
+  for(dword i = 0; i < module.literals.size(); i ++)
+    literalindices[i] = assembly.AddLiteral(module.literals[i]);
+
+  // the jumps move along with the code, the entries of the jump tables are GOTO ops
+  for(dword *cp = module.bytecode; cp < module.bytecode + module.curpos; cp += Assembler::OpSize(cp[0])) {
+    dword offset = assembly.GetSize();
+    for(dword i = 0; i < Assembler::OpSize(cp[0]); i ++)
+      assembly.WriteDword(cp[i]);
+
+    dword *op = assembly.bytecode + offset;
+    if(Assembler::IsJumpOp(op[0]))
+      op[1] += base;
+    else if(op[0] == CALL)
+      op[1] = importindices[op[1]];
+    else if(op[0] == CALLM)
+      op[1] = externalindices[op[1]];
+    else if(op[0] == SLIT)
+      op[1] = literalindices[op[1]];
+  }
+
+  module.ReadDebugInfo();
+  assembly.ReadDebugInfo();
+
+  for(dword i = 0; i < module.lines.size(); i ++)
+    assembly.lines.push_back(make_pair(module.lines[i].first + base, module.lines[i].second));
+
+  for(map<dword, string>::iterator i = module.names.begin(); i != module.names.end(); i ++)
+    assembly.names[(*i).first + base] = (*i).second;
+
+  return base;
+}
+
+bool Linker::Resolve(Assembly& assembly, dword external, dword& offset)
+{
+  if(external >= assembly.externals.size()) return false;
+
+  map<string, pair<dword, dword> >::iterator i = functions.find(assembly.externals[external]);
+  if(i == functions.end()) return false;
+
+  Assembly *module = modules[(*i).second.first].assembly;
+  Export& function = module->exports[(*i).second.second];
+
+  // a module is only linked in once, all of its functions come with it
+  for(dword j = 0; j < assembly.modules.size(); j ++) {
+    if(assembly.modules[j].first == module) {
+      offset = assembly.modules[j].second + function.offset;
+      return true;
+    }
+  }
+
+  offset = Place(assembly, *module) + function.offset;
+  return true;
+}
+
+bool Linker::Link(Assembly& assembly, bool lazy)
+{
+  for(dword i = 0; i < assembly.externals.size(); i ++) {
+    if(functions.find(assembly.externals[i]) == functions.end()) {
+      printf("%s : unresolved external function\n", assembly.externals[i].c_str());
+      return false;
+    }
+  }
+
+  if(lazy) {
+    assembly.linker = this;
+    return true;
+  }
+
+  // the modules that are linked in may call functions of other modules,
+  // their CALLM ops are resolved as the walk reaches them
+  for(dword offset = 0; offset < assembly.GetSize(); offset += Assembler::OpSize(assembly.bytecode[offset])) {
+    if(assembly.bytecode[offset] != CALLM) continue;
+
+    dword target;
+    if(!Resolve(assembly, assembly.bytecode[offset + 1], target)) return false;
+
+    assembly.bytecode[offset] = CALLS;
+    assembly.bytecode[offset + 1] = target;
+  }
+
+  return true;
+}
+
+
+//*** Compiler
+
+void Compiler::ResolveModules(Node *node, ImportList& importlist)
+{
+  if(linker == null) return;
+
+  // an imported function takes precedence over the functions of the modules
+  for(SymbolTable::iterator i = functions.begin(); i != functions.end(); ) {
+    Symbol *symbol = (*i).second;
+    const Export *function = importlist.Find(symbol->contents) == null ? linker->Find(symbol->contents) : null;
+    if(function == null) {
+      i ++;
+      continue;
+    }
+
+    symbol->data = (void *)function;
+    symbol->type = (DataType)function->returntype;
+    externals.insert(SymbolTable::value_type(symbol->contents, symbol));
+    functions.erase(i ++);
+  }
+
+  if(externals.empty()) return;
+
+  NodeVector order;
+  PostOrderAll(node, order);
+
+  for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+    Node *n = *i;
+    if(n->type == NT_CALL && n->symbol->data != null) n->type = NT_CALLM;
+  }
+}
+
+void Compiler::ExportFunctions(Assembly& assembly)
+{
+  forEach(SymbolTable, scripts, i) {
+    ScriptFunction *function = (ScriptFunction *)(*i).second->data;
+    if(function->frame == null) continue;
+
+    Export e;
+    e.name = (*i).first;
+    e.offset = function->frame->offset;
+    e.returntype = (*i).second->type != DT_VOID ? (*i).second->type : DT_INT;
+
+    for(dword j = 0; j < function->params.size(); j ++)
+      e.paramtypes.push_back(function->params[j]->type != DT_VOID ? function->params[j]->type : DT_INT);
+
+    assembly.AddExport(e);
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Assembly.h"
+
+#include <map>
+#include <string>
+
+
+// joins separately compiled modules with the scripts that call their functions
+// a module is a script compiled with Compiler::SetModule(), all of its functions
+// are built and exported, the types of their parameters are the ones the
+// calls within the module gave them
+// a script compiled with Compiler::SetLinker() calls the functions of the
+// modules with CALLM ops, Link() copies the code of the modules it calls to
+// the end of its code, relocates the jumps, merges the imports and the string
+// literals and turns the CALLM ops into CALLS ops
+// a lazy link leaves the CALLM ops in place, the virtual machine links a
+// module in when one of its functions is called for the first time, so
+// that the modules a run doesn't use are never copied
+// the modules have to outlive the scripts linked with them
+class Linker
+{
+  friend class CompileCache;
+
+  struct Module
+  {
+    string name;
+    Assembly *assembly;
+  };
+
+  vector<Module> modules;
+
+  // the module and the index of the export of every function, by name
+  map<string, pair<dword, dword> > functions;
+
+  // copies the code of the module to the end of the code of assembly,
+  // returns the offset it starts at
+  dword Place(Assembly& assembly, Assembly& module);
+
+public:
+
+  // adds a compiled module, fails if it exports a function another module
+  // exports as well
+  bool AddModule(const char *name, Assembly& module);
+
+  // returns the exported function with the given name, or null
+  const Export* Find(const string& name);
+
+  // links the modules the script calls into assembly, a lazy link only checks
+  // that the functions are there and leaves the rest to the virtual machine
+  // returns false if one of them isn't
+  bool Link(Assembly& assembly, bool lazy = false);
+
+  // links in the module of the function the CALLM ops with the given operand
+  // call if it hasn't been yet, offset receives the offset of the function
+  // the bytecode of assembly may move to a larger buffer
+  bool Resolve(Assembly& assembly, dword external, dword& offset);
+};
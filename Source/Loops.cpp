@@ -0,0 +1,329 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include <map>
+
+#include "TyroDebug.h"
+
+
+//*** Loop optimizations
+
+#define tosigned(x) (*((long *)x))  // signed int
+
+Node* Compiler::CloneTree(Node *node)
+{
+  Node *root = null;
+
+  // each entry is a node to copy and the pointer that receives the copy
+  vector<pair<Node *, Node **> > stack;
+  stack.push_back(make_pair(node, &root));
+
+  while(!stack.empty()) {
+    Node *n = stack.back().first;
+    Node **copy = stack.back().second;
+    stack.pop_back();
+
+    if(n == null) {
+      *copy = null;
+      continue;
+    }
+
+    Node *c = new Node(n->type);
+    *c = *n;
+    *copy = c;
+
+    for(int i = 0; i < sizeof(n->child)/sizeof(Node *); i ++)
+      stack.push_back(make_pair(n->child[i], &c->child[i]));
+  }
+
+  return root;
+}
+
+// returns the number of nodes in the tree and the number of
+// assignments to variable in it
+static dword CountNodes(Node *node, Symbol *variable, dword& assignments)
+{
+  NodeVector stack;
+  dword count = 0;
+
+  assignments = 0;
+  stack.push_back(node);
+
+  while(!stack.empty()) {
+    Node *n = stack.back();
+    stack.pop_back();
+    if(n == null) continue;
+
+    count ++;
+    if(n->type == NT_ASSIGN && n->symbol == variable) assignments ++;
+
+    for(int i = 0; i < sizeof(n->child)/sizeof(Node *); i ++)
+      stack.push_back(n->child[i]);
+  }
+
+  return count;
+}
+
+// if assign is "variable = variable + step" returns the step
+static bool GetIncrement(Node *assign, Symbol *variable, long& step)
+{
+  if(assign->type != NT_ASSIGN || assign->symbol != variable) return false;
+
+  Node *add = assign->child[0];
+  if(add->type != NT_ADD) return false;
+
+  Node *a = add->child[0], *b = add->child[1];
+  if(a->type == NT_INT && b->type == NT_IDENT) { Node *t = a; a = b; b = t; }
+  if(a->type != NT_IDENT || a->symbol != variable || b->type != NT_INT) return false;
+
+  dword value = b->symbol->ToDword();
+  step = tosigned(&value);
+  return true;
+}
+
+// if node is the statement "variable = variable + step;" returns the step
+static bool GetStep(Node *node, Symbol *variable, long& step)
+{
+  return node->type == NT_EXPR && GetIncrement(node->child[0], variable, step);
+}
+
+bool Compiler::UnrollLoop(Node *loop)
+{
+  // only "while(i < n)" and "while(i <= n)" with a constant n
+  Node *cond = loop->child[0], *body = loop->child[1];
+  if(cond->type != NT_LESS && cond->type != NT_LEQUAL) return false;
+  if(cond->child[0]->type != NT_IDENT || cond->child[1]->type != NT_INT) return false;
+
+  Symbol *variable = cond->child[0]->symbol;
+
+  // the body has to end with "i = i + step;" and may not change i anywhere else
+  Node *last = body->type == NT_STMT ? body->child[1] : body;
+
+  long step;
+  if(!GetStep(last, variable, step) || step <= 0 || step > MaxUnrollStep) return false;
+
+  dword assignments;
+  if(CountNodes(body, variable, assignments) > MaxUnrollNodes || assignments != 1) return false;
+
+  // the unrolled loop runs while the last of its iterations would still
+  // pass the original test, i.e. while i + (unroll - 1) * step < n
+  // the limit is adjusted instead of i, so nothing can overflow at run time
+  dword value = cond->child[1]->symbol->ToDword();
+  long limit = tosigned(&value), offset = (long)(unroll - 1) * step;
+  if(limit < (long)0x80000000 + offset) return false;
+
+  Node *unrolledcond = CloneTree(cond);
+  MakeLiteral(unrolledcond->child[1], NT_INT, (dword)(limit - offset));
+
+  Node *unrolledbody = CloneTree(body);
+  for(dword i = 1; i < unroll; i ++)
+    unrolledbody = new Node(NT_STMT, unrolledbody, CloneTree(body));
+
+  // the original loop takes care of the remaining iterations
+  Node *rest = new Node(NT_WHILE, cond, body);
+  Node *unrolled = new Node(NT_WHILE, unrolledcond, unrolledbody);
+  rest->line = unrolled->line = loop->line;
+
+  loop->type = NT_STMT;
+  loop->child[0] = unrolled;
+  loop->child[1] = rest;
+  return true;
+}
+
+void Compiler::RotateLoop(Node *loop)
+{
+  // while(c) s; -> if(c) do s; while(c);
+  // this saves a jump per iteration
+  Node *dowhile = new Node(NT_DOWHILE, loop->child[1], CloneTree(loop->child[0]));
+  dowhile->line = loop->line;
+
+  loop->type = NT_IFTHEN;
+  loop->child[1] = dowhile;
+}
+
+void Compiler::OptimizeLoops(Node *node)
+{
+  NodeVector order;
+  PostOrder(node, order);
+
+  // unrolling turns the loop into a list of two loops, both of which are rotated
+  for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+    Node *loop = *i;
+
+    // for(; c; s) b; -> while(c) { b; s; }
+    // so that the step is the last statement that unrolling looks for
+    if(loop->type == NT_FOR) {
+      Node *body = new Node(NT_STMT, loop->child[2], loop->child[1]);
+      body->line = loop->line;
+
+      loop->type = NT_WHILE;
+      loop->child[1] = body;
+      loop->child[2] = null;
+    }
+
+    if(loop->type != NT_WHILE) continue;
+
+    if(optimization > 1 && unroll > 1 && UnrollLoop(loop)) {
+      RotateLoop(loop->child[0]);
+      RotateLoop(loop->child[1]);
+    } else
+      RotateLoop(loop);
+  }
+}
+
+
+//*** Bounds check removal
+
+// if cond is "i < len(a)" or "len(a) > i", or has one of them as a term
+// of an &&, returns the int variable i and the array a
+static bool GetRangeTest(Node *cond, Symbol *&index, Symbol *&array)
+{
+  NodeVector stack;
+  stack.push_back(cond);
+
+  while(!stack.empty()) {
+    Node *n = stack.back();
+    stack.pop_back();
+
+    if(n->type == NT_BOOLAND) {
+      stack.push_back(n->child[1]);
+      stack.push_back(n->child[0]);
+      continue;
+    }
+
+    Node *i, *length;
+    if(n->type == NT_LESS) {
+      i = n->child[0];
+      length = n->child[1];
+    } else if(n->type == NT_GREATER) {
+      i = n->child[1];
+      length = n->child[0];
+    } else
+      continue;
+
+    if(i->type != NT_IDENT || i->symbol->type != DT_INT) continue;
+    if(length->type != NT_LENGTH || length->child[0]->type != NT_IDENT) continue;
+
+    index = i->symbol;
+    array = length->child[0]->symbol;
+    return true;
+  }
+
+  return false;
+}
+
+// true if node is the statement "variable = c;" with a constant c >= 0
+static bool IsStart(Node *node, Symbol *variable)
+{
+  if(node->type != NT_EXPR) return false;
+
+  Node *assign = node->child[0];
+  if(assign->type != NT_ASSIGN || assign->symbol != variable || assign->child[0]->type != NT_INT) return false;
+
+  dword value = assign->child[0]->symbol->ToDword();
+  return tosigned(&value) >= 0;
+}
+
+// true if the loop only ever adds to index and never assigns array, every
+// assignment to index has to be "i = i + c" with c >= 0 outside the
+// condition and the nested loops, the steps add up to maxstep at most, so
+// that i can't wrap around while it is smaller than the length
+// a call of a script function could change either variable behind its back
+static bool OnlyIncrements(Node *loop, Symbol *index, Symbol *array, long maxstep)
+{
+  // the nodes with their loop depth, the condition counts as nested
+  vector<pair<Node *, dword> > stack;
+  for(int i = 0; i < sizeof(loop->child)/sizeof(Node *); i ++)
+    stack.push_back(make_pair(loop->child[i], i == 0 ? (dword)2 : (dword)1));
+
+  long total = 0;
+  while(!stack.empty()) {
+    Node *n = stack.back().first;
+    dword depth = stack.back().second;
+    stack.pop_back();
+    if(n == null) continue;
+
+    switch(n->type) {
+      case NT_CALLS:
+      case NT_CALLM:
+        return false;
+
+      case NT_ASSIGN:
+        if(n->symbol == array) return false;
+        if(n->symbol == index) {
+          long step;
+          if(depth > 1 || !GetIncrement(n, index, step) || step < 0) return false;
+
+          total += step;
+          if(total > maxstep) return false;
+        }
+        break;
+
+      case NT_WHILE:
+      case NT_DOWHILE:
+      case NT_FOR:
+        depth ++;
+        break;
+    }
+
+    for(int i = 0; i < sizeof(n->child)/sizeof(Node *); i ++)
+      stack.push_back(make_pair(n->child[i], depth));
+  }
+
+  return true;
+}
+
+static bool IsVariable(Node *node, Symbol *variable)
+{
+  return node->type == NT_IDENT && node->symbol == variable;
+}
+
+void Compiler::RemoveBoundsChecks(Node *node)
+{
+  NodeVector order;
+  PostOrder(node, order);
+
+  // the statement that precedes each statement of a list
+  map<Node *, Node *> previous;
+  for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+    if((*i)->type != NT_STMT) continue;
+
+    Node *first = (*i)->child[1], *last = (*i)->child[0];
+    while(first != null && first->type == NT_STMT) first = first->child[0];
+    while(last != null && last->type == NT_STMT) last = last->child[1];
+    if(first == null || last == null) continue;
+
+    previous[first] = last;
+  }
+
+  // while(i < len(a)) with i starting at a constant >= 0 and only ever
+  // growing, a[i] is in range until i is first assigned in an iteration
+  for(NodeVector::iterator i = order.begin(); i != order.end(); i ++) {
+    Node *loop = *i;
+    if(loop->type != NT_WHILE && loop->type != NT_FOR) continue;
+
+    Symbol *index, *array;
+    if(!GetRangeTest(loop->child[0], index, array)) continue;
+
+    map<Node *, Node *>::iterator start = previous.find(loop);
+    if(start == previous.end() || !IsStart((*start).second, index)) continue;
+    if(!OnlyIncrements(loop, index, array, MaxIndexStep)) continue;
+
+    // the body of a for loop runs before its step
+    NodeVector nodes, step;
+    PostOrder(loop->type == NT_FOR ? loop->child[2] : loop->child[1], nodes);
+    if(loop->type == NT_FOR) {
+      PostOrder(loop->child[1], step);
+      nodes.insert(nodes.end(), step.begin(), step.end());
+    }
+
+    for(NodeVector::iterator j = nodes.begin(); j != nodes.end(); j ++) {
+      Node *n = *j;
+      if(n->type == NT_ASSIGN && n->symbol == index) break;
+      if(n->type != NT_ELEMENT && n->type != NT_SETELEMENT) continue;
+
+      if(IsVariable(n->child[0], array) && IsVariable(n->child[1], index))
+        n->type = n->type == NT_ELEMENT ? NT_ELEMENT_INRANGE : NT_SETELEMENT_INRANGE;
+    }
+  }
+}
@@ -1,29 +1,100 @@
 #include "Compiler.h"
-#include "Lex.h"
+
+#include <new>
 
 #include "TyroDebug.h"
 
+//*** Arena
+
+Arena::Arena() : blocks(null), allocations(0), size(0)
+{
+}
+
+Arena::~Arena()
+{
+  Clear();
+}
+
+void* Arena::Alloc(size_t size)
+{
+  size = (size + Alignment - 1) & ~(size_t)(Alignment - 1);
+
+  if(blocks != null && blocks->used + size <= blocks->size) {
+    allocations ++;
+
+    void *p = (byte *)(blocks + 1) + blocks->used;
+    blocks->used += size;
+    return p;
+  }
+
+  // oversized requests get a block of their own, which goes behind the
+  // current block so that the rest of that one is still used
+  // like new, a failed allocation throws
+  size_t blocksize = size > BlockSize ? size : BlockSize;
+  Block *block = (Block *)malloc(sizeof(Block) + blocksize);
+  if(block == null) throw std::bad_alloc();
+
+  block->size = blocksize;
+  block->used = size;
+  this->size += blocksize;
+  allocations ++;
+
+  if(size > BlockSize && blocks != null) {
+    block->next = blocks->next;
+    blocks->next = block;
+  } else {
+    block->next = blocks;
+    blocks = block;
+  }
+
+  return block + 1;
+}
+
+void Arena::Clear()
+{
+  while(blocks != null) {
+    Block *next = blocks->next;
+    free(blocks);
+    blocks = next;
+  }
+
+  allocations = 0;
+  size = 0;
+}
+
+void Arena::Swap(Arena& arena)
+{
+  swap(blocks, arena.blocks);
+  swap(allocations, arena.allocations);
+  swap(size, arena.size);
+}
+
 //*** Node
 
-Node::Node(NodeType t) : type(t), rettype(DT_VOID), symbol(null), line(lineno)
+void* Node::operator new(size_t size)
+{
+  return Compiler::GetActive()->AllocateNode(size);
+}
+
+Node::Node(NodeType t) : type(t), rettype(DT_VOID), symbol(null), line(Compiler::GetActive()->GetLine())
 {
   child[0] = child[1] = child[2] = null;
 }
 
-Node::Node(NodeType t, Node *a) : type(t), rettype(DT_VOID), symbol(null), line(lineno)
+Node::Node(NodeType t, Node *a) : type(t), rettype(DT_VOID), symbol(null), line(Compiler::GetActive()->GetLine())
 {
   child[0] = a;
   child[1] = child[2] = null;
 }
 
-Node::Node(NodeType t, Node *a, Node *b) : type(t), rettype(DT_VOID), symbol(null), line(lineno)
+Node::Node(NodeType t, Node *a, Node *b) : type(t), rettype(DT_VOID), symbol(null), line(Compiler::GetActive()->GetLine())
 {
   child[0] = a;
   child[1] = b;
   child[2] = null;
 }
 
-Node::Node(NodeType t, Node *a, Node *b, Node *c) : type(t), rettype(DT_VOID), symbol(null), line(lineno)
+Node::Node(NodeType t, Node *a, Node *b, Node *c) : type(t), rettype(DT_VOID), symbol(null), line(Compiler::GetActive()->GetLine())
 {
   child[0] = a;
   child[1] = b;
@@ -35,33 +106,33 @@ Node::Node(NodeType t, Node *a, Node *b, Node *c) : type(t), rettype(DT_VOID), s
 //*** Op
 
 Op::Op() : offset(0), opcode(NOOP), operand(0), 
-  target(null), symbol(null), next(null)
+  target(null), symbol(null), limit(null), count(0), line(0), variable(null), refs(0), next(null)
 {
 }
 
 Op::Op(OPCODE oc, dword o) : offset(0), opcode(oc), operand(o), 
-  target(null), symbol(null), next(null)
+  target(null), symbol(null), limit(null), count(0), line(0), variable(null), refs(0), next(null)
 {
 }
 
 Op::Op(OPCODE oc) : offset(0), opcode(oc), operand(0), 
-  target(null), symbol(null), next(null)
+  target(null), symbol(null), limit(null), count(0), line(0), variable(null), refs(0), next(null)
 {
 }
 
 Op::Op(OPCODE oc, Op *t) : offset(0), opcode(oc), operand(0), 
-  target(t), symbol(null), next(null)
+  target(t), symbol(null), limit(null), count(0), line(0), variable(null), refs(0), next(null)
 {
 }
 
 Op::Op(OPCODE oc, Symbol *s) : offset(0), opcode(oc), operand(0), 
-  target(null), symbol(s), next(null)
+  target(null), symbol(s), limit(null), count(0), line(0), variable(null), refs(0), next(null)
 {
 }
 
-Op::~Op()
+void* Op::operator new(size_t size)
 {
-  safe_delete(next);
+  return Compiler::GetActive()->AllocateOp(size);
 }
 
 Op* Op::Concat(Op *op)
@@ -78,22 +149,79 @@ Op* Op::Concat(Op *op)
   return this;
 }
 
+//*** NameTable
+
+typedef unsigned __int64 qword;
+
+// the primes of the 64 bit hash of xxHash
+static const qword Prime1 = ((qword)0x9e3779b1 << 32) | 0x85ebca87;
+static const qword Prime2 = ((qword)0xc2b2ae3d << 32) | 0x27d4eb4f;
+static const qword Prime3 = ((qword)0x165667b1 << 32) | 0x9e3779f9;
+
+#define Rotate64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+// mixes the next 8 bytes into the hash
+static inline qword MixName(qword hash, qword bytes)
+{
+  bytes *= Prime2;
+  hash ^= Rotate64(bytes, 31) * Prime1;
+  return Rotate64(hash, 27) * Prime1 + Prime3;
+}
+
+dword HashName(const char *name, size_t length)
+{
+  const byte *p = (const byte *)name, *end = p + length;
+  qword hash = Prime3 + (qword)length * Prime1, bytes;
+
+  for(; end - p >= 8; p += 8) {
+    memcpy(&bytes, p, 8);
+    hash = MixName(hash, bytes);
+  }
+
+  // the last bytes are padded with zeros, the length tells the names apart
+  bytes = 0;
+  memcpy(&bytes, p, end - p);
+  hash = MixName(hash, bytes);
+
+  // every bit of the result depends on every bit of the name
+  hash ^= hash >> 33;
+  hash *= Prime2;
+  hash ^= hash >> 29;
+  hash *= Prime3;
+  hash ^= hash >> 32;
+
+  return (dword)hash;
+}
+
 //*** ImportList
 
 bool ImportList::Add(Function *function)
 {
+  lock.Enter();
   FunctionTable::iterator i = functions.find(function->name);
   
   // doesn't exist yet - add it
   if(i == functions.end()) {
     functions.insert(FunctionTable::value_type(function->name, function));
+    lock.Leave();
     return true;
   }
    
   // couldn't add it, name already reserved
+  lock.Leave();
   return false;
 }
 
+Function* ImportList::Find(const string& name)
+{
+  lock.Enter();
+  FunctionTable::iterator i = functions.find(name);
+  Function *function = i != functions.end() ? (*i).second : null;
+  lock.Leave();
+
+  return function;
+}
+
 bool ImportList::AddList(Function functions[], dword count)
 {
   bool r = true;
@@ -107,7 +235,9 @@ bool ImportList::AddList(Function functions[], dword count)
 void ImportList::Clear()
 {
   // clear the functions map
+  lock.Enter();
   functions.clear();
+  lock.Leave();
 }
 
 ImportList::~ImportList()
@@ -117,7 +247,7 @@ ImportList::~ImportList()
  
 //*** Symbol
 
-Symbol::Symbol(const char *c, dword l) : contents(c), line(l), index(0), data(null) 
+Symbol::Symbol(const char *c, dword l) : contents(c), line(l), index(0), data(null), type(DT_VOID) 
 { 
 }
 
@@ -128,4 +258,16 @@ dword Symbol::ToDword()
   return *((dword *)&i);
 }
 
+float Symbol::ToFloat()
+{
+  return (float)atof(contents.c_str());
+}
+
+bool Symbol::ToBool()
+{
+  if(contents == "true") return true;
+  if(contents == "false") return false;
+  return atoi(contents.c_str()) != 0;
+}
+
 
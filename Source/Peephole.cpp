@@ -0,0 +1,372 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include "TyroDebug.h"
+
+
+//*** Peephole optimizer
+
+// describes a short op sequence that can be rewritten into something cheaper
+// the ops following the first one may not be jump targets
+struct PeepholePattern
+{
+  byte length;          // the number of ops in the sequence
+  OPCODE opcodes[6];    // the sequence to look for
+
+  // rewrites the sequence starting at op, returns false if the
+  // sequence doesn't qualify after all (e.g. different operands)
+  bool (*rewrite)(Op *op);
+};
+
+// turns op into a NOOP, jumps to it will be moved to the next op later on
+static void Kill(Op *op)
+{
+  if(op->target != null) op->target->refs --;
+
+  op->opcode = NOOP;
+  op->operand = 0;
+  op->symbol = null;
+  op->target = null;
+}
+
+// true if both ops access the same local variable
+static bool SameVariable(Op *a, Op *b)
+{
+  return a->symbol == b->symbol && a->operand == b->operand;
+}
+
+// store x; pop; load x -> store x
+static bool StorePopLoad(Op *op)
+{
+  Op *pop = op->next, *load = pop->next;
+  if(!SameVariable(op, load)) return false;
+
+  Kill(pop);
+  Kill(load);
+  return true;
+}
+
+// push c; pop -> nothing
+// load x; pop -> nothing
+static bool PushPop(Op *op)
+{
+  Kill(op->next);
+  Kill(op);
+  return true;
+}
+
+// load x; store x -> load x
+// store x; store x -> store x
+static bool LoadStore(Op *op)
+{
+  if(!SameVariable(op, op->next)) return false;
+
+  Kill(op->next);
+  return true;
+}
+
+// push c; iff l -> goto l (c is false) or nothing (c is true)
+static bool PushIff(Op *op)
+{
+  Op *jump = op->next;
+  if(op->operand == 0) {
+    Kill(op);
+    jump->opcode = GOTO;
+  } else {
+    Kill(jump);
+    Kill(op);
+  }
+
+  return true;
+}
+
+// push c; ift l -> goto l (c is true) or nothing (c is false)
+static bool PushIft(Op *op)
+{
+  Op *jump = op->next;
+  if(op->operand == 1) {
+    Kill(op);
+    jump->opcode = GOTO;
+  } else {
+    Kill(jump);
+    Kill(op);
+  }
+
+  return true;
+}
+
+// ine; iff l -> iff l
+static bool NeIff(Op *op)
+{
+  Kill(op);
+  return true;
+}
+
+// goto l; l: -> nothing
+static bool GotoNext(Op *op)
+{
+  if(op->target != op->next) return false;
+
+  Kill(op);
+  return true;
+}
+
+// iff l; l: -> pop (the condition still has to be removed from the stack)
+static bool BranchNext(Op *op)
+{
+  if(op->target != op->next) return false;
+
+  op->target->refs --;
+  op->opcode = POP;
+  op->target = null;
+  return true;
+}
+
+// jlt l; l: -> pop; pop
+static bool CompareNext(Op *op)
+{
+  if(op->target != op->next) return false;
+
+  op->target->refs --;
+  op->opcode = POP;
+  op->target = null;
+
+  Op *pop = new Op(POP);
+  pop->next = op->next;
+  op->next = pop;
+  return true;
+}
+
+// returns the compare and branch op with the opposite condition
+static OPCODE InvertCompare(OPCODE opcode)
+{
+  switch(opcode) {
+    case JEQ: return JNE;
+    case JNE: return JEQ;
+    case JLT: return JGE;
+    case JLE: return JGT;
+    case JGT: return JLE;
+    case JGE: return JLT;
+  }
+
+  return opcode;
+}
+
+// jlt l; goto m; l: -> jge m; l:
+static bool CompareOverGoto(Op *op)
+{
+  Op *jump = op->next;
+  if(op->target != jump->next || jump->target == null) return false;
+
+  op->target->refs --;
+  op->opcode = InvertCompare(op->opcode);
+  op->target = jump->target;
+  op->target->refs ++;
+
+  Kill(jump);
+  return true;
+}
+
+// returns k if value is 2^k, -1 otherwise
+static int Log2(dword value)
+{
+  if(value == 0 || (value & (value - 1)) != 0) return -1;
+
+  int k = 0;
+  while(value > 1) {
+    value >>= 1;
+    k ++;
+  }
+
+  return k;
+}
+
+// push 2^k; imul -> push k; shl
+// push 1; imul -> nothing
+static bool MulPowerOfTwo(Op *op)
+{
+  int k = Log2(op->operand);
+  if(k < 0) return false;
+
+  if(k == 0) {
+    Kill(op->next);
+    Kill(op);
+  } else {
+    op->operand = k;
+    op->next->opcode = SHL;
+  }
+
+  return true;
+}
+
+// push 2^k; idiv -> push k; shr (IDIV divides unsigned)
+// push 1; idiv -> nothing
+static bool DivPowerOfTwo(Op *op)
+{
+  int k = Log2(op->operand);
+  if(k < 0) return false;
+
+  if(k == 0) {
+    Kill(op->next);
+    Kill(op);
+  } else {
+    op->operand = k;
+    op->next->opcode = SHR;
+  }
+
+  return true;
+}
+
+// load i; push 1; iadd; store i; load n; jlt l -> loopinc l i n
+// load i; push 1; iadd; store i; push n; jlt l -> loopincc l i n
+// this is the end of a counting loop, the sum is left on the stack
+// by the store and popped by the jump, so the stack is the same
+static bool LoopIncrement(Op *op)
+{
+  Op *step = op->next, *add = step->next, *store = add->next;
+  Op *limit = store->next, *jump = limit->next;
+  if(step->operand != 1 || !SameVariable(op, store)) return false;
+
+  op->opcode = limit->opcode == LOAD ? LOOPINC : LOOPINCC;
+  op->target = jump->target;
+  op->limit = limit;
+  op->next = jump->next;
+  return true;
+}
+
+static PeepholePattern patterns[] = {
+  {3, {STORE, POP, LOAD}, StorePopLoad},
+  {2, {PUSH, POP}, PushPop},
+  {2, {LOAD, POP}, PushPop},
+  {2, {LOAD, STORE}, LoadStore},
+  {2, {STORE, STORE}, LoadStore},
+  {2, {PUSH, IFF}, PushIff},
+  {2, {PUSH, IFT}, PushIft},
+  {2, {INE, IFF}, NeIff},
+  {2, {PUSH, IMUL}, MulPowerOfTwo},
+  {2, {PUSH, IDIV}, DivPowerOfTwo},
+  {1, {GOTO}, GotoNext},
+  {1, {IFT}, BranchNext},
+  {1, {IFF}, BranchNext},
+
+  {1, {JEQ}, CompareNext},
+  {1, {JNE}, CompareNext},
+  {1, {JLT}, CompareNext},
+  {1, {JLE}, CompareNext},
+  {1, {JGT}, CompareNext},
+  {1, {JGE}, CompareNext},
+
+  {2, {JEQ, GOTO}, CompareOverGoto},
+  {2, {JNE, GOTO}, CompareOverGoto},
+  {2, {JLT, GOTO}, CompareOverGoto},
+  {2, {JLE, GOTO}, CompareOverGoto},
+  {2, {JGT, GOTO}, CompareOverGoto},
+  {2, {JGE, GOTO}, CompareOverGoto},
+
+  {6, {LOAD, PUSH, IADD, STORE, LOAD, JLT}, LoopIncrement},
+  {6, {LOAD, PUSH, IADD, STORE, PUSH, JLT}, LoopIncrement},
+};
+
+static bool Match(Op *op, PeepholePattern& pattern)
+{
+  for(byte i = 0; i < pattern.length; i ++, op = op->next) {
+    if(op == null || op->opcode != pattern.opcodes[i]) return false;
+
+    // only the first op of a sequence may be a jump target
+    if(i > 0 && op->refs > 0) return false;
+  }
+
+  return true;
+}
+
+// returns the op a jump to op really ends up at, skipping NOOPs and
+// following unconditional jumps (the hop limit is there for endless loops)
+static Op* Destination(Op *op)
+{
+  for(int hops = 0; hops < 64; hops ++) {
+    while(op->opcode == NOOP && op->next != null) op = op->next;
+    if(op->opcode != GOTO || op->target == null) break;
+    op = op->target;
+  }
+
+  return op;
+}
+
+// returns the last entry of the jump table that follows op
+static Op* SkipTable(Op *op)
+{
+  for(dword i = 0, count = op->count; i < count; i ++) op = op->next;
+  return op;
+}
+
+Op* Compiler::Peephole(Op *op)
+{
+  Op *cop, **link;
+  bool changed;
+
+  do {
+    changed = false;
+
+    // thread the jumps and count the references to every op
+    for(cop = op; cop != null; cop = cop->next)
+      cop->refs = 0;
+
+    for(cop = op; cop != null; cop = cop->next) {
+      if(Assembler::IsJumpOp(cop->opcode) && cop->target != null) {
+        cop->target = Destination(cop->target);
+        cop->target->refs ++;
+      }
+    }
+
+    // now NOOPs are only needed as jump targets at the very end of the chain
+    for(link = &op; *link != null; ) {
+      cop = *link;
+      if(cop->opcode == NOOP && cop->refs == 0)
+        *link = cop->next;
+      else
+        link = &cop->next;
+    }
+
+    // apply the patterns, the entries of jump tables are left alone
+    int patterncount = sizeof(patterns)/sizeof(PeepholePattern);
+    for(cop = op; cop != null; cop = cop->next) {
+      if(cop->opcode == TABLESWITCH) {
+        cop = SkipTable(cop);
+        continue;
+      }
+
+      for(int i = 0; i < patterncount; i ++) {
+        if(Match(cop, patterns[i]) && patterns[i].rewrite(cop)) {
+          changed = true;
+          break;
+        }
+      }
+    }
+
+    // remove the code that follows an unconditional jump and isn't a jump target
+    bool reachable = true;
+    for(cop = op; cop != null; cop = cop->next) {
+      // the functions of a module are called from outside of it
+      if(cop->refs > 0 || cop->opcode == FRAME) reachable = true;
+
+      if(!reachable) {
+        if(cop->opcode != NOOP) {
+          Kill(cop);
+          changed = true;
+        }
+        continue;
+      }
+
+      if(cop->opcode == TABLESWITCH) {
+        cop = SkipTable(cop);
+        reachable = false;
+      }
+
+      if(cop->opcode == GOTO || cop->opcode == RET || (cop->opcode == SYS && cop->operand == SC_EXIT))
+        reachable = false;
+    }
+
+  } while(changed);
+
+  return op;
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "Assembly.h"
+#include "Profile.h"
+
+#include <algorithm>
+
+#include "TyroDebug.h"
+
+
+//*** Profile
+
+Profile::Profile() : hash(0)
+{
+}
+
+void Profile::Clear()
+{
+  hash = 0;
+  entries.clear();
+  variables.clear();
+}
+
+// true for the ops that jump or not depending on a condition
+static bool IsConditional(dword opcode)
+{
+  return opcode == IFT || opcode == IFF || (opcode >= JEQ && opcode <= JGE) ||
+    opcode == LOOPINC || opcode == LOOPINCC;
+}
+
+dword Profile::Hash(Assembly& assembly)
+{
+  dword *bytecode = assembly.GetByteCode();
+  dword size = assembly.GetSize();
+
+  // FNV-1a over the dwords of the code
+  dword value = 2166136261;
+  for(dword offset = 0; offset < size; offset += Assembler::OpSize(bytecode[offset])) {
+    dword opcode = bytecode[offset];
+    dword length = Assembler::OpSize(opcode);
+
+    for(dword i = 0; i < length && offset + i < size; i ++) {
+      // skip the indices of the variables
+      if(i == 1 && (opcode == LOAD || opcode == STORE)) continue;
+      if(i == 2 && (opcode == LOOPINC || opcode == LOOPINCC)) continue;
+      if(i == 3 && opcode == LOOPINC) continue;
+
+      value = (value ^ bytecode[offset + i]) * 16777619;
+    }
+  }
+
+  return value;
+}
+
+void Profile::Add(Assembly& assembly, dword *executed, dword *taken)
+{
+  dword *bytecode = assembly.GetByteCode();
+  dword size = assembly.GetSize();
+
+  dword code = Hash(assembly);
+  if(code != hash || size != entries.size()) {
+    Clear();
+    hash = code;
+
+    Entry empty = { Plain, 0, 0, 0 };
+    entries.assign(size, empty);
+  }
+
+  for(dword offset = 0; offset < size; offset += Assembler::OpSize(bytecode[offset])) {
+    dword opcode = bytecode[offset];
+    dword length = Assembler::OpSize(opcode);
+
+    Entry& entry = entries[offset];
+    entry.line = assembly.GetLine(offset);
+    entry.executed += executed[offset];
+    entry.taken += taken[offset];
+
+    if(IsConditional(opcode))
+      entry.kind = bytecode[offset + 1] <= offset ? Loop : Branch;
+    else if(opcode == GOTO && bytecode[offset + 1] <= offset)
+      entry.kind = Loop;
+
+    for(dword i = 1; i < length && offset + i < size; i ++)
+      entries[offset + i] = entry;
+
+    const char *name = assembly.GetName(offset);
+    if(name != null && executed[offset] != 0)
+      variables[name] += executed[offset];
+  }
+}
+
+dword Profile::GetExecuted(dword offset)
+{
+  return offset < entries.size() ? entries[offset].executed : 0;
+}
+
+dword Profile::GetAccesses(const string& name)
+{
+  map<string, dword>::iterator i = variables.find(name);
+  return i != variables.end() ? (*i).second : 0;
+}
+
+bool Profile::Save(const char *filename)
+{
+  FILE *out = fopen(filename, "wt");
+  if(out == null) return false;
+
+  fprintf(out, "// tyro profile\n");
+  fprintf(out, "code 0x%08x %d\n", hash, entries.size());
+
+  // plain ops are only written where the count changes
+  for(dword offset = 0; offset < entries.size(); offset ++) {
+    Entry& entry = entries[offset];
+    Entry *previous = offset > 0 ? &entries[offset - 1] : null;
+
+    // the operands of an op repeat its counts
+    bool first = previous == null || previous->kind != entry.kind || previous->line != entry.line ||
+      previous->executed != entry.executed || previous->taken != entry.taken;
+
+    if(entry.kind == Branch && first)
+      fprintf(out, "branch %d %d %d %d\n", offset, entry.line, entry.executed, entry.taken);
+    else if(entry.kind == Loop && first)
+      fprintf(out, "loop %d %d %d %d\n", offset, entry.line, entry.executed - entry.taken, entry.taken);
+    else if(entry.kind == Plain && (previous == null || previous->kind != Plain || previous->executed != entry.executed))
+      fprintf(out, "count %d %d %d\n", offset, entry.line, entry.executed);
+  }
+
+  for(map<string, dword>::iterator i = variables.begin(); i != variables.end(); i ++)
+    fprintf(out, "variable %s %d\n", (*i).first.c_str(), (*i).second);
+
+  fclose(out);
+  return true;
+}
+
+bool Profile::Load(const char *filename)
+{
+  Clear();
+
+  FILE *in = fopen(filename, "rt");
+  if(in == null) return false;
+
+  char buffer[256], word[256], name[256];
+  dword size = 0, offset, line, a, b;
+
+  // every entry holds until the next one
+  Entry entry;
+  bool ok = true;
+
+  while(ok && fgets(buffer, sizeof(buffer), in)) {
+    if(sscanf(buffer, "%255s", word) != 1 || strcmp(word, "//") == 0) continue;
+
+    if(strcmp(word, "code") == 0) {
+      ok = sscanf(buffer, "code %x %d", &hash, &size) == 2;
+      continue;
+    }
+
+    if(strcmp(word, "variable") == 0) {
+      ok = sscanf(buffer, "variable %255s %d", name, &a) == 2;
+      if(ok) variables[name] = a;
+      continue;
+    }
+
+    if(strcmp(word, "count") == 0) {
+      ok = sscanf(buffer, "count %d %d %d", &offset, &line, &a) == 3;
+      entry.kind = Plain;
+      entry.executed = a;
+      entry.taken = 0;
+    } else if(strcmp(word, "branch") == 0) {
+      ok = sscanf(buffer, "branch %d %d %d %d", &offset, &line, &a, &b) == 4;
+      entry.kind = Branch;
+      entry.executed = a;
+      entry.taken = b;
+    } else if(strcmp(word, "loop") == 0) {
+      // the exits and the trips
+      ok = sscanf(buffer, "loop %d %d %d %d", &offset, &line, &a, &b) == 4;
+      entry.kind = Loop;
+      entry.executed = a + b;
+      entry.taken = b;
+    } else
+      ok = false;
+
+    // the entries come in the order of their offsets
+    ok = ok && offset >= entries.size() && offset < size;
+    if(!ok) break;
+
+    Entry empty = { Plain, 0, 0, 0 };
+    entries.resize(offset, entries.empty() ? empty : entries.back());
+    entry.line = line;
+    entries.push_back(entry);
+  }
+
+  fclose(in);
+
+  if(!ok) {
+    Clear();
+    return false;
+  }
+
+  if(!entries.empty()) entries.resize(size, entries.back());
+  return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Assembly.h"
+
+#include <map>
+
+
+// the execution counts of a program, the virtual machine gathers them
+// (see VirtualMachine::SetProfile()) and the compiler uses them to lay out
+// the code and to number the variables (see Compiler::SetProfile())
+// the counts are keyed to the offsets of the ops, so they only describe the
+// code they were gathered for, a hash of that code is kept with them
+// the layout only uses the counts of code compiled without a profile,
+// the variables are looked up by name and work with any code
+class Profile
+{
+public:
+
+  // what the counts of an op describe
+  enum Kind { Plain, Branch, Loop };
+
+  // the counts of the op at a single offset, the counts of an op
+  // are repeated for the dwords of its operands
+  struct Entry
+  {
+    byte kind;        // see Kind, jumps to a lower offset close loops
+    dword line;       // the source line of the op
+    dword executed;   // the number of times the op was executed
+    dword taken;      // the number of times the op jumped
+  };
+
+private:
+
+  dword hash;                     // the hash of the code, see Hash()
+  vector<Entry> entries;          // by offset
+
+  // the number of accesses to each variable, the names of the variables
+  // of a script function are prefixed with the name of the function and a dot
+  map<string, dword> variables;
+
+public:
+
+  // adds the counts of a run of assembly, the counts of other code are dropped
+  void Add(Assembly& assembly, dword *executed, dword *taken);
+
+  dword GetHash() { return hash; }
+
+  // returns the number of times the op at offset was executed
+  dword GetExecuted(dword offset);
+
+  // returns the number of loads and stores of the variable
+  dword GetAccesses(const string& name);
+
+  // returns a hash of the code of assembly, the indices of the variables
+  // are left out so that numbering them differently keeps the hash
+  static dword Hash(Assembly& assembly);
+
+  // saves the counts as text, one op, branch, loop or variable per line
+  bool Save(const char *filename);
+
+  // loads counts saved by Save()
+  bool Load(const char *filename);
+
+  void Clear();
+
+  Profile();
+};
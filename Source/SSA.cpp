@@ -0,0 +1,1764 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include <map>
+#include <algorithm>
+
+#include "TyroDebug.h"
+
+
+//*** SSA optimizer
+
+// the op chain is split into basic blocks and converted into SSA form, local
+// variables and the values left on the stack between blocks become SSA values,
+// which gives copy propagation and dead store elimination for free
+// values are numbered while the form is built (global value numbering and
+// common subexpression elimination), loop invariant values are moved to the
+// loop preheaders and the result is lowered back into stack code, keeping
+// every value that is used more than once in a local variable slot
+
+#define tofloat(x) (*((float *)x))
+#define tosigned(x) (*((long *)x))  // signed int
+
+struct SSABlock;
+
+struct SSAValue
+{
+  enum Kind { Constant, Undefined, Param, Phi, Pure, Call, Sys };
+
+  Kind kind;
+  OPCODE opcode;
+  dword operand;              // the constant, the function index, the system code,
+                              // the number of arguments of a CALLS, the index of the name a CALLM
+                              // calls, the element type of an array op or the index of a parameter
+  Op *target;                 // the function a CALLS calls
+  vector<SSAValue *> args;    // a phi has one argument per predecessor of its block
+
+  SSABlock *block;            // the block that computes the value
+  SSAValue *forward;          // the value that replaced this one
+  dword id;
+
+  dword line;                 // the source line of the op the value was built for, 0 if it isn't known
+  Symbol *variable;           // the variable the value was first stored in, the slot it is kept in
+                              // is counted as that variable in the profiles
+
+  // used when lowering
+  bool live;
+  bool shared;                // used by a phi or outside of its block
+  dword uses;
+  long slot;                  // the (virtual) local variable holding the value, -1 if none
+
+  SSAValue(Kind kind, OPCODE opcode, dword operand, SSABlock *block, dword id) :
+    kind(kind), opcode(opcode), operand(operand), target(null), block(block), forward(null), id(id),
+    line(0), variable(null), live(false), shared(false), uses(0), slot(-1)
+  { }
+};
+
+struct SSABlock
+{
+  dword begin, end;           // the ops of the block
+  OPCODE branch;              // the op that ends the block, NOOP if control falls through,
+                              // SYS if the program stops and RET if the function returns
+  SSABlock *target;           // the jump target, the default of a TABLESWITCH
+  SSABlock *next;             // the block control falls through to
+  vector<SSABlock *> cases;   // the targets of the table entries of a TABLESWITCH
+  dword low;                  // the value of the first table entry
+  SSAValue *cond[2];          // the operands of the branch
+  dword line;                 // the source line of the branch
+
+  vector<SSABlock *> preds, succs;
+
+  long depth;                 // the stack depth on entry, -1 if the block is unreachable
+  SSABlock *idom;             // the immediate dominator
+  dword order;                // reverse post order number
+  dword enter, leave;         // the interval of the block in a walk of the dominator tree
+  dword loop;                 // the last loop the block was found to be a part of
+
+  vector<SSAValue *> phis;
+  vector<SSAValue *> code;    // the pure values and the side effects in execution order
+
+  map<dword, SSAValue *> defs;                    // the current value of variables and stack slots
+  vector<pair<dword, SSAValue *> > incomplete;    // phis waiting for the block to be sealed
+  bool sealed, filled;
+
+  Op *label;
+
+  SSABlock(dword begin, dword end) :
+    begin(begin), end(end), branch(NOOP), target(null), next(null), low(0), line(0),
+    depth(-1), idom(null), order(0), enter(0), leave(0), loop(0), sealed(false), filled(false), label(null)
+  {
+    cond[0] = cond[1] = null;
+  }
+};
+
+class SSAForm
+{
+  vector<Op *> ops;
+  vector<SSABlock *> blocks;    // the blocks in the order they are laid out
+  vector<SSABlock *> rpo;       // the reachable blocks in reverse post order
+  vector<SSAValue *> values;
+
+  vector<Function *>& functions;
+  SymbolVector& params;         // the parameters hold the arguments on entry
+  map<Symbol *, dword> variables;
+  SymbolVector symbols;         // the variables by their ids in variables
+  map<dword, SSAValue *> constants;
+  SSAValue *undefined;
+
+  typedef pair<dword, pair<dword, dword> > ValueKey;
+  map<ValueKey, vector<SSAValue *> > numbers;   // value numbers of the pure values
+
+  // the lowered op chain
+  Op *first, *last;
+  dword slots;
+
+  // the source line of the op that is being filled in or of the ops that
+  // are being emitted, the lowered ops keep the lines of the original ones
+  dword line;
+
+  struct Trampoline
+  {
+    Op *label;
+    SSABlock *from, *to;
+  };
+  vector<Trampoline> trampolines;
+
+  SSAValue* NewValue(SSAValue::Kind kind, OPCODE opcode, dword operand, SSABlock *block);
+  SSAValue* GetConstant(dword value);
+  SSAValue* GetPure(OPCODE opcode, SSAValue *a, SSAValue *b, SSABlock *block);
+  static SSAValue* Resolve(SSAValue *value);
+
+  static bool Dominates(SSABlock *a, SSABlock *b);
+  void Dominators();
+
+  // SSA construction, see "Simple and Efficient Construction of Static Single
+  // Assignment Form" by Braun et al.
+  SSAValue* Read(dword variable, SSABlock *block);
+  SSAValue* ReadRecursive(dword variable, SSABlock *block);
+  SSAValue* AddPhiOperands(dword variable, SSAValue *phi);
+  SSAValue* TryRemoveTrivialPhi(SSAValue *phi);
+  void Seal(SSABlock *block);
+  void TrySeal(SSABlock *block);
+  bool Fill(SSABlock *block);
+
+  void RemoveTrivialPhis();
+  void HoistInvariants();
+  void HoistInvariants(SSABlock *header, dword loop);
+  void MarkLive();
+
+  void Emit(Op *op);
+  void EmitValue(SSAValue *value, bool compute);
+  void EmitSlot(OPCODE opcode, SSAValue *value);
+  void EmitCopies(SSABlock *from, SSABlock *to);
+  bool HasCopies(SSABlock *from, SSABlock *to);
+  Op* EdgeLabel(SSABlock *from, SSABlock *to);
+  void EmitBlock(SSABlock *block, SSABlock *following);
+  static void ReadSlots(SSAValue *value, vector<long>& slots);
+
+public:
+
+  // programs with more blocks or values in slots than this are left alone
+  enum Constant { MaxBlocks = 4096, MaxSlots = 1024 };
+
+  // returns false if the op chain contains something that can't be optimized
+  bool Build(Op *op);
+
+  void Optimize();
+
+  // returns the new op chain, slotcount receives the number of virtual slots
+  Op* Lower(dword& slotcount);
+
+  SSAForm(vector<Function *>& functions, SymbolVector& params);
+  ~SSAForm();
+};
+
+
+//*** Values
+
+// returns the number of operands of an op that computes a value
+// from the stack without side effects, 0 for any other op
+static int PureOperands(OPCODE opcode)
+{
+  switch(opcode) {
+    case IEQ:
+    case INE:
+    case ILT:
+    case ILE:
+    case IGT:
+    case IGE:
+    case I2F:
+    case F2I:
+    case POPCNT:
+    case CLZ:
+    case CTZ:
+    case BSWAP:
+    case ALEN:
+    case SLEN:
+    case SHASH:
+      return 1;
+
+    case IAND:
+    case IOR:
+    case IADD:
+    case ISUB:
+    case IMUL:
+    case IDIV:
+    case IMOD:
+    case FADD:
+    case FSUB:
+    case FMUL:
+    case FDIV:
+    case FCMP:
+    case SHL:
+    case SHR:
+    case SAR:
+    case BAND:
+    case BOR:
+    case BXOR:
+    case ROTL:
+    case ROTR:
+    case SEQ:
+    case SCMP:
+    case SFIND:
+      return 2;
+  }
+
+  return 0;
+}
+
+// returns the number of operands of an array or string op, which are kept in
+// order like calls, since they allocate, write or trap, 0 for any other op
+// SLIT has no operands and is handled on its own
+static int ObjectOperands(OPCODE opcode)
+{
+  switch(opcode) {
+    case ANEW:
+    case VSUM:
+      return 1;
+
+    case ALOAD:
+    case ALOADU:
+    case AFILL:
+    case VDOT:
+    case SCAT:
+    case SCHAR:
+      return 2;
+
+    case ASTORE:
+    case ASTOREU:
+    case ASLICE:
+    case SSUB:
+    case VADD:
+    case VMUL:
+    case VLESS:
+      return 3;
+
+    case VSELECT:
+      return 4;
+  }
+
+  return 0;
+}
+
+static bool IsCommutative(OPCODE opcode)
+{
+  switch(opcode) {
+    case IAND:
+    case IOR:
+    case IADD:
+    case IMUL:
+    case FADD:
+    case FMUL:
+    case BAND:
+    case BOR:
+    case BXOR:
+      return true;
+  }
+
+  return false;
+}
+
+// ops that may trap are not moved out of loops
+static bool MayTrap(OPCODE opcode)
+{
+  return opcode == IDIV || opcode == IMOD;
+}
+
+static bool IsCompareOp(OPCODE opcode)
+{
+  return opcode >= JEQ && opcode <= JGE;
+}
+
+// computes what the VM would, returns false if the result is left to run time
+static bool Evaluate(OPCODE opcode, dword x, dword y, dword& r)
+{
+  float fx = tofloat(&x), fy = tofloat(&y), f;
+
+  switch(opcode) {
+    case IEQ: r = x == 0; return true;
+    case INE: r = x != 0; return true;
+    case ILT: r = tosigned(&x) < 0; return true;
+    case ILE: r = tosigned(&x) <= 0; return true;
+    case IGT: r = tosigned(&x) > 0; return true;
+    case IGE: r = tosigned(&x) >= 0; return true;
+
+    case I2F:
+      f = (float)tosigned(&x);
+      r = *((dword *)&f);
+      return true;
+
+    case F2I:
+      if(!(fx >= -2147483648.0f && fx < 2147483648.0f)) return false;
+      r = (dword)(long)fx;
+      return true;
+
+    case IAND: r = (x && y) ? 1 : 0; return true;
+    case IOR:  r = (x || y) ? 1 : 0; return true;
+    case IADD: r = x + y; return true;
+    case ISUB: r = x - y; return true;
+    case IMUL: r = x * y; return true;
+
+    case IDIV:
+      if(y == 0) return false;
+      r = x / y;
+      return true;
+
+    case IMOD:
+      if(y == 0 || (x == 0x80000000 && tosigned(&y) == -1)) return false;
+      r = tosigned(&x) % tosigned(&y);
+      return true;
+
+    case FADD: f = fx + fy; r = *((dword *)&f); return true;
+    case FSUB: f = fx - fy; r = *((dword *)&f); return true;
+    case FMUL: f = fx * fy; r = *((dword *)&f); return true;
+    case FDIV: f = fx / fy; r = *((dword *)&f); return true;
+
+    case FCMP:
+      r = fx < fy ? (dword)-1 : (fx > fy ? 1 : 0);
+      return true;
+
+    case SHL: r = x << (y & 31); return true;
+    case SHR: r = x >> (y & 31); return true;
+    case SAR: r = tosigned(&x) >> (y & 31); return true;
+    case BAND: r = x & y; return true;
+    case BOR: r = x | y; return true;
+    case BXOR: r = x ^ y; return true;
+
+    case POPCNT:
+    case CLZ:
+    case CTZ:
+    case ROTL:
+    case ROTR:
+    case BSWAP:
+      r = VirtualMachine::Evaluate(opcode, x, y);
+      return true;
+
+    case JEQ: r = x == y; return true;
+    case JNE: r = x != y; return true;
+    case JLT: r = tosigned(&x) < tosigned(&y); return true;
+    case JLE: r = tosigned(&x) <= tosigned(&y); return true;
+    case JGT: r = tosigned(&x) > tosigned(&y); return true;
+    case JGE: r = tosigned(&x) >= tosigned(&y); return true;
+
+    case IFT: r = x == 1; return true;
+    case IFF: r = x == 0; return true;
+  }
+
+  return false;
+}
+
+static OPCODE InvertCompare(OPCODE opcode)
+{
+  switch(opcode) {
+    case JEQ: return JNE;
+    case JNE: return JEQ;
+    case JLT: return JGE;
+    case JLE: return JGT;
+    case JGT: return JLE;
+    case JGE: return JLT;
+  }
+
+  return opcode;
+}
+
+SSAValue* SSAForm::NewValue(SSAValue::Kind kind, OPCODE opcode, dword operand, SSABlock *block)
+{
+  SSAValue *value = new SSAValue(kind, opcode, operand, block, (dword)values.size());
+  value->line = line;
+  values.push_back(value);
+  return value;
+}
+
+SSAValue* SSAForm::GetConstant(dword value)
+{
+  map<dword, SSAValue *>::iterator i = constants.find(value);
+  if(i != constants.end()) return i->second;
+
+  return constants[value] = NewValue(SSAValue::Constant, PUSH, value, null);
+}
+
+SSAValue* SSAForm::Resolve(SSAValue *value)
+{
+  SSAValue *v = value;
+  while(v->forward != null) v = v->forward;
+
+  // shorten the path for the next time
+  while(value->forward != null) {
+    SSAValue *next = value->forward;
+    value->forward = v;
+    value = next;
+  }
+
+  return v;
+}
+
+SSAValue* SSAForm::GetPure(OPCODE opcode, SSAValue *a, SSAValue *b, SSABlock *block)
+{
+  a = Resolve(a);
+  if(b != null) b = Resolve(b);
+
+  // operands of commutative ops are put in a fixed order, constants last
+  // so that the peephole optimizer sees them right before the op
+  if(b != null && IsCommutative(opcode)) {
+    bool constant = a->kind == SSAValue::Constant, other = b->kind == SSAValue::Constant;
+    if((constant && !other) || (other == constant && a->id > b->id)) swap(a, b);
+  }
+
+  // constant folding
+  dword r;
+  if(a->kind == SSAValue::Constant && (b == null || b->kind == SSAValue::Constant)
+    && Evaluate(opcode, a->operand, b != null ? b->operand : 0, r))
+    return GetConstant(r);
+
+  // algebraic identities
+  if(b != null && b->kind == SSAValue::Constant) {
+    if((opcode == IADD || opcode == ISUB || opcode == BOR || opcode == BXOR) && b->operand == 0) return a;
+    if((opcode == IMUL || opcode == IDIV) && b->operand == 1) return a;
+    if((opcode == IMUL || opcode == BAND) && b->operand == 0) return b;
+  }
+
+  // the same computation in a dominating block can be reused
+  ValueKey key(opcode, make_pair(a->id, b != null ? b->id : (dword)-1));
+  vector<SSAValue *>& list = numbers[key];
+
+  for(vector<SSAValue *>::iterator i = list.begin(); i != list.end(); i ++) {
+    if(Dominates((*i)->block, block)) return *i;
+  }
+
+  SSAValue *value = NewValue(SSAValue::Pure, opcode, 0, block);
+  value->args.push_back(a);
+  if(b != null) value->args.push_back(b);
+
+  block->code.push_back(value);
+  list.push_back(value);
+  return value;
+}
+
+
+//*** Control flow graph
+
+// only valid for the blocks that existed when Dominators() ran
+bool SSAForm::Dominates(SSABlock *a, SSABlock *b)
+{
+  return a->enter <= b->enter && b->leave <= a->leave;
+}
+
+// true if the target of the jump op is part of the chain
+static bool HasTarget(Op *op, vector<Op *>& ops)
+{
+  return op->target != null && op->target->offset < ops.size() && ops[op->target->offset] == op->target;
+}
+
+bool SSAForm::Build(Op *op)
+{
+  // the entry block can't be a jump target, the parameters are defined there
+  Op *entry = new Op(NOOP);
+  entry->next = op;
+
+  for(dword i = 0; i < params.size(); i ++) {
+    variables[params[i]] = i;
+    symbols.push_back(params[i]);
+  }
+
+  for(Op *cop = entry; cop != null; cop = cop->next) {
+    cop->offset = (dword)ops.size();
+    ops.push_back(cop);
+  }
+
+  dword count = (dword)ops.size();
+  vector<bool> leader(count + 1, false);
+  leader[0] = leader[count] = true;
+
+  // the jump tables by the index of the op that follows them
+  map<dword, Op *> tables;
+
+  // check the ops and find the beginnings of the blocks
+  for(dword i = 0; i < count; i ++) {
+    Op *cop = ops[i];
+
+    switch(cop->opcode) {
+      case NOOP:
+      case PUSH:
+      case POP:
+      case CALL:
+      case CALLS:
+      case CALLM:
+        break;
+
+      case RET:
+        leader[i + 1] = true;
+        break;
+
+      case LOAD:
+      case STORE:
+        if(cop->symbol == null) return false;
+        if(variables.find(cop->symbol) == variables.end()) {
+          dword id = (dword)variables.size();
+          variables[cop->symbol] = id;
+          symbols.push_back(cop->symbol);
+        }
+        break;
+
+      case SYS:
+        if(cop->operand > SC_PRINTS) return false;
+        if(cop->operand == SC_EXIT) leader[i + 1] = true;
+        break;
+
+      case GOTO:
+      case IFT:
+      case IFF:
+      case JEQ:
+      case JNE:
+      case JLT:
+      case JLE:
+      case JGT:
+      case JGE:
+        if(!HasTarget(cop, ops)) return false;
+
+        leader[cop->target->offset] = true;
+        leader[i + 1] = true;
+        break;
+
+      // the table entries are part of the block that ends with the table
+      case TABLESWITCH:
+        if(!HasTarget(cop, ops) || i + cop->count >= count) return false;
+        leader[cop->target->offset] = true;
+
+        for(dword k = 1; k <= cop->count; k ++) {
+          Op *entry = ops[i + k];
+          if(entry->opcode != GOTO || !HasTarget(entry, ops)) return false;
+          leader[entry->target->offset] = true;
+        }
+
+        i += cop->count;
+        leader[i + 1] = true;
+        tables[i + 1] = cop;
+        break;
+
+      case SLIT:
+        break;
+
+      default:
+        if(PureOperands(cop->opcode) == 0 && ObjectOperands(cop->opcode) == 0) return false;
+        break;
+    }
+  }
+
+  // nothing may jump into a table
+  for(map<dword, Op *>::iterator t = tables.begin(); t != tables.end(); t ++) {
+    for(dword k = t->second->offset + 1; k < t->first; k ++) {
+      if(leader[k]) return false;
+    }
+  }
+
+  // split the chain, the last block stands for the exit appended by Assemble()
+  vector<SSABlock *> blockat(count + 1, (SSABlock *)null);
+  for(dword i = 0; i <= count; i ++) {
+    if(!leader[i]) continue;
+
+    dword end = i + 1;
+    while(end < count && !leader[end]) end ++;
+
+    blockat[i] = new SSABlock(i, i < count ? end : count);
+    blocks.push_back(blockat[i]);
+  }
+
+  if(blocks.size() > MaxBlocks) return false;
+
+  for(dword i = 0; i < blocks.size(); i ++) {
+    SSABlock *block = blocks[i];
+
+    if(block->begin == count) {
+      block->branch = SYS;
+      continue;
+    }
+
+    Op *lastop = ops[block->end - 1];
+    block->next = i + 1 < blocks.size() ? blocks[i + 1] : null;
+
+    map<dword, Op *>::iterator t = tables.find(block->end);
+    if(t != tables.end()) {
+      Op *table = t->second;
+      block->branch = TABLESWITCH;
+      block->low = table->operand;
+      block->target = blockat[table->target->offset];
+      block->succs.push_back(block->target);
+
+      for(dword k = 1; k <= table->count; k ++) {
+        SSABlock *to = blockat[ops[table->offset + k]->target->offset];
+        block->cases.push_back(to);
+        if(find(block->succs.begin(), block->succs.end(), to) == block->succs.end())
+          block->succs.push_back(to);
+      }
+    } else if(Assembler::IsJumpOp(lastop->opcode) && lastop->opcode != CALLS) {
+      block->branch = lastop->opcode;
+      block->target = blockat[lastop->target->offset];
+      block->succs.push_back(block->target);
+      if(lastop->opcode != GOTO) block->succs.push_back(block->next);
+    } else if(lastop->opcode == SYS && lastop->operand == SC_EXIT)
+      block->branch = SYS;
+    else if(lastop->opcode == RET)
+      block->branch = RET;
+    else
+      block->succs.push_back(block->next);
+  }
+
+  // find the stack depth on entry of every block, it has to be the same on all paths
+  vector<SSABlock *> work;
+  blocks[0]->depth = 0;
+  work.push_back(blocks[0]);
+
+  while(!work.empty()) {
+    SSABlock *block = work.back();
+    work.pop_back();
+
+    long depth = block->depth, pops, pushes;
+    for(dword i = block->begin; i < block->end; i ++) {
+      Op *cop = ops[i];
+      pops = pushes = 0;
+
+      switch(cop->opcode) {
+        case PUSH:
+        case LOAD: pushes = 1; break;
+        case POP: pops = 1; break;
+        case STORE: pops = pushes = 1; break;
+        case SYS: pops = cop->operand == SC_EXIT ? 0 : 1; break;
+        case IFT:
+        case IFF:
+        case TABLESWITCH:
+        case RET: pops = 1; break;
+
+        case CALLS:
+        case CALLM:
+          pops = cop->count;
+          pushes = 1;
+          break;
+
+        case CALL:
+          if(cop->operand >= functions.size() || functions[cop->operand] == null) return false;
+          pops = functions[cop->operand]->paramcount;
+          pushes = 1;
+          break;
+
+        case SLIT: pushes = 1; break;
+
+        default:
+          if(IsCompareOp(cop->opcode)) pops = 2;
+          else if(PureOperands(cop->opcode) > 0) {
+            pops = PureOperands(cop->opcode);
+            pushes = 1;
+          } else if(ObjectOperands(cop->opcode) > 0) {
+            pops = ObjectOperands(cop->opcode);
+            pushes = 1;
+          }
+          break;
+      }
+
+      if(depth < pops) return false;
+      depth += pushes - pops;
+    }
+
+    for(vector<SSABlock *>::iterator i = block->succs.begin(); i != block->succs.end(); i ++) {
+      if((*i)->depth < 0) {
+        (*i)->depth = depth;
+        work.push_back(*i);
+      } else if((*i)->depth != depth)
+        return false;
+    }
+  }
+
+  // drop the unreachable blocks
+  vector<SSABlock *> reachable;
+  for(vector<SSABlock *>::iterator i = blocks.begin(); i != blocks.end(); i ++) {
+    if((*i)->depth >= 0)
+      reachable.push_back(*i);
+    else
+      delete *i;
+  }
+  blocks.swap(reachable);
+
+  for(vector<SSABlock *>::iterator i = blocks.begin(); i != blocks.end(); i ++) {
+    for(vector<SSABlock *>::iterator j = (*i)->succs.begin(); j != (*i)->succs.end(); j ++)
+      (*j)->preds.push_back(*i);
+  }
+
+  Dominators();
+
+  // the parameters stay in their slots
+  for(dword i = 0; i < params.size(); i ++) {
+    SSAValue *param = NewValue(SSAValue::Param, LOAD, i, null);
+    param->slot = i;
+    param->variable = params[i];
+    blocks[0]->defs[i] = param;
+  }
+
+  // build the SSA form, the reverse post order visits most predecessors first
+  for(vector<SSABlock *>::iterator i = rpo.begin(); i != rpo.end(); i ++) {
+    SSABlock *block = *i;
+
+    TrySeal(block);
+    if(!Fill(block)) return false;
+
+    for(vector<SSABlock *>::iterator j = block->succs.begin(); j != block->succs.end(); j ++)
+      TrySeal(*j);
+  }
+
+  return true;
+}
+
+// see "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy
+void SSAForm::Dominators()
+{
+  // number the blocks in reverse post order
+  vector<pair<SSABlock *, dword> > stack;
+  vector<SSABlock *> postorder;
+
+  for(vector<SSABlock *>::iterator i = blocks.begin(); i != blocks.end(); i ++)
+    (*i)->order = (dword)-1;
+
+  blocks[0]->order = 0;
+  stack.push_back(make_pair(blocks[0], 0));
+
+  while(!stack.empty()) {
+    SSABlock *block = stack.back().first;
+    dword next = stack.back().second;
+
+    if(next < block->succs.size()) {
+      stack.back().second ++;
+      SSABlock *succ = block->succs[next];
+      if(succ->order == (dword)-1) {
+        succ->order = 0;
+        stack.push_back(make_pair(succ, 0));
+      }
+    } else {
+      postorder.push_back(block);
+      stack.pop_back();
+    }
+  }
+
+  rpo.assign(postorder.rbegin(), postorder.rend());
+  for(dword i = 0; i < rpo.size(); i ++)
+    rpo[i]->order = i;
+
+  SSABlock *entry = rpo[0];
+  entry->idom = entry;
+
+  bool changed;
+  do {
+    changed = false;
+
+    for(dword i = 1; i < rpo.size(); i ++) {
+      SSABlock *block = rpo[i], *idom = null;
+
+      for(vector<SSABlock *>::iterator j = block->preds.begin(); j != block->preds.end(); j ++) {
+        SSABlock *a = *j;
+        if(a->idom == null) continue;
+
+        if(idom == null) {
+          idom = a;
+          continue;
+        }
+
+        SSABlock *b = idom;
+        while(a != b) {
+          while(a->order > b->order) a = a->idom;
+          while(b->order > a->order) b = b->idom;
+        }
+        idom = a;
+      }
+
+      if(block->idom != idom) {
+        block->idom = idom;
+        changed = true;
+      }
+    }
+  } while(changed);
+
+  entry->idom = null;
+
+  // walk the dominator tree, a block dominates the blocks visited
+  // between entering and leaving it
+  vector<vector<SSABlock *> > children(rpo.size());
+  for(dword i = 1; i < rpo.size(); i ++)
+    children[rpo[i]->idom->order].push_back(rpo[i]);
+
+  vector<pair<SSABlock *, dword> > walk;
+  dword counter = 0;
+
+  entry->enter = counter ++;
+  walk.push_back(make_pair(entry, 0));
+
+  while(!walk.empty()) {
+    SSABlock *block = walk.back().first;
+    dword next = walk.back().second;
+
+    if(next < children[block->order].size()) {
+      walk.back().second ++;
+      SSABlock *child = children[block->order][next];
+      child->enter = counter ++;
+      walk.push_back(make_pair(child, 0));
+    } else {
+      block->leave = counter ++;
+      walk.pop_back();
+    }
+  }
+}
+
+
+//*** SSA construction
+
+SSAValue* SSAForm::Read(dword variable, SSABlock *block)
+{
+  map<dword, SSAValue *>::iterator i = block->defs.find(variable);
+  if(i != block->defs.end()) return Resolve(i->second);
+
+  return ReadRecursive(variable, block);
+}
+
+SSAValue* SSAForm::ReadRecursive(dword variable, SSABlock *block)
+{
+  SSAValue *value;
+
+  if(!block->sealed) {
+    // not all the predecessors are known yet
+    value = NewValue(SSAValue::Phi, NOOP, 0, block);
+    if(variable < symbols.size()) value->variable = symbols[variable];
+    block->phis.push_back(value);
+    block->incomplete.push_back(make_pair(variable, value));
+  } else if(block->preds.empty()) {
+    // read before written
+    value = undefined;
+  } else if(block->preds.size() == 1) {
+    value = Read(variable, block->preds[0]);
+  } else {
+    // the phi breaks cycles in the search
+    value = NewValue(SSAValue::Phi, NOOP, 0, block);
+    if(variable < symbols.size()) value->variable = symbols[variable];
+    block->phis.push_back(value);
+    block->defs[variable] = value;
+    value = AddPhiOperands(variable, value);
+  }
+
+  block->defs[variable] = value;
+  return value;
+}
+
+SSAValue* SSAForm::AddPhiOperands(dword variable, SSAValue *phi)
+{
+  SSABlock *block = phi->block;
+  for(vector<SSABlock *>::iterator i = block->preds.begin(); i != block->preds.end(); i ++)
+    phi->args.push_back(Read(variable, *i));
+
+  return TryRemoveTrivialPhi(phi);
+}
+
+// a phi that only merges a single value (and itself) is replaced by that value
+SSAValue* SSAForm::TryRemoveTrivialPhi(SSAValue *phi)
+{
+  SSAValue *same = null;
+
+  for(vector<SSAValue *>::iterator i = phi->args.begin(); i != phi->args.end(); i ++) {
+    SSAValue *arg = Resolve(*i);
+    if(arg == same || arg == phi) continue;
+    if(same != null) return phi;
+    same = arg;
+  }
+
+  if(same == null) same = undefined;
+
+  phi->forward = same;
+  return same;
+}
+
+void SSAForm::Seal(SSABlock *block)
+{
+  block->sealed = true;
+
+  for(dword i = 0; i < block->incomplete.size(); i ++)
+    AddPhiOperands(block->incomplete[i].first, block->incomplete[i].second);
+
+  block->incomplete.clear();
+}
+
+void SSAForm::TrySeal(SSABlock *block)
+{
+  if(block->sealed) return;
+
+  for(vector<SSABlock *>::iterator i = block->preds.begin(); i != block->preds.end(); i ++) {
+    if(!(*i)->filled) return;
+  }
+
+  Seal(block);
+}
+
+bool SSAForm::Fill(SSABlock *block)
+{
+  // stack slots are numbered after the variables
+  dword base = (dword)variables.size();
+
+  vector<SSAValue *> stack;
+  for(long i = 0; i < block->depth; i ++)
+    stack.push_back(Read(base + i, block));
+
+  SSAValue *a, *b;
+  for(dword i = block->begin; i < block->end; i ++) {
+    Op *cop = ops[i];
+    line = cop->line;
+    if(line != 0) block->line = line;
+
+    switch(cop->opcode) {
+      case NOOP:
+      case GOTO:
+        break;
+
+      case PUSH:
+        stack.push_back(GetConstant(cop->operand));
+        break;
+
+      case POP:
+        stack.pop_back();
+        break;
+
+      case LOAD:
+        stack.push_back(Read(variables[cop->symbol], block));
+        break;
+
+      case STORE:
+        block->defs[variables[cop->symbol]] = stack.back();
+
+        a = Resolve(stack.back());
+        if(a->variable == null && a->kind != SSAValue::Constant && a->kind != SSAValue::Undefined)
+          a->variable = cop->symbol;
+        break;
+
+      case CALL: {
+        Function *function = functions[cop->operand];
+        dword pc = function->paramcount;
+
+        a = NewValue(SSAValue::Call, CALL, cop->operand, block);
+        a->args.assign(stack.end() - pc, stack.end());
+        stack.resize(stack.size() - pc);
+        block->code.push_back(a);
+
+        // functions without a return value always leave a 0 behind
+        stack.push_back(function->returncount == 0 ? GetConstant(0) : a);
+        break;
+      }
+
+      case CALLS:
+        a = NewValue(SSAValue::Call, CALLS, cop->count, block);
+        a->target = cop->target;
+        a->args.assign(stack.end() - cop->count, stack.end());
+        stack.resize(stack.size() - cop->count);
+        block->code.push_back(a);
+        stack.push_back(a);
+        break;
+
+      case CALLM:
+        a = NewValue(SSAValue::Call, CALLM, cop->operand, block);
+        a->args.assign(stack.end() - cop->count, stack.end());
+        stack.resize(stack.size() - cop->count);
+        block->code.push_back(a);
+        stack.push_back(a);
+        break;
+
+      case SLIT:
+        a = NewValue(SSAValue::Call, SLIT, cop->operand, block);
+        block->code.push_back(a);
+        stack.push_back(a);
+        break;
+
+      case SYS:
+        if(cop->operand == SC_EXIT) break;
+
+        a = NewValue(SSAValue::Sys, SYS, cop->operand, block);
+        a->args.push_back(stack.back());
+        stack.pop_back();
+        block->code.push_back(a);
+        break;
+
+      case IFT:
+      case IFF:
+      case TABLESWITCH:
+      case RET:
+        block->cond[0] = stack.back();
+        stack.pop_back();
+        break;
+
+      default:
+        if(IsCompareOp(cop->opcode)) {
+          block->cond[1] = stack.back();
+          stack.pop_back();
+          block->cond[0] = stack.back();
+          stack.pop_back();
+        } else if(PureOperands(cop->opcode) == 1) {
+          a = stack.back();
+          stack.back() = GetPure(cop->opcode, a, null, block);
+        } else if(PureOperands(cop->opcode) == 2) {
+          b = stack.back();
+          stack.pop_back();
+          a = stack.back();
+          stack.back() = GetPure(cop->opcode, a, b, block);
+        } else if(ObjectOperands(cop->opcode) > 0) {
+          dword count = ObjectOperands(cop->opcode);
+          a = NewValue(SSAValue::Call, cop->opcode, cop->operand, block);
+          a->args.assign(stack.end() - count, stack.end());
+          stack.resize(stack.size() - count);
+          block->code.push_back(a);
+          stack.push_back(a);
+        } else
+          return false;
+        break;
+    }
+  }
+
+  // whatever is left on the stack is passed to the successors
+  for(dword i = 0; i < stack.size(); i ++)
+    block->defs[base + i] = stack[i];
+
+  block->filled = true;
+  return true;
+}
+
+
+//*** Optimizations
+
+// removing a phi can make phis that use it trivial as well
+void SSAForm::RemoveTrivialPhis()
+{
+  bool changed;
+  do {
+    changed = false;
+
+    for(vector<SSABlock *>::iterator i = blocks.begin(); i != blocks.end(); i ++) {
+      for(vector<SSAValue *>::iterator j = (*i)->phis.begin(); j != (*i)->phis.end(); j ++) {
+        if((*j)->forward == null && TryRemoveTrivialPhi(*j) != *j) changed = true;
+      }
+    }
+  } while(changed);
+}
+
+static bool EarlierBlock(SSABlock *a, SSABlock *b)
+{
+  return a->order < b->order;
+}
+
+// moves the values computed in the loop with the given header that only
+// depend on values from outside of the loop to the preheader
+void SSAForm::HoistInvariants(SSABlock *header, dword loop)
+{
+  // find the blocks of the loop by walking back from the back edges
+  vector<SSABlock *> body, work;
+  header->loop = loop;
+  body.push_back(header);
+
+  // the preheaders of inner loops are newer than the dominator tree walk,
+  // so the idoms are followed instead
+  bool backedge = false;
+  for(vector<SSABlock *>::iterator i = header->preds.begin(); i != header->preds.end(); i ++) {
+    SSABlock *block = *i;
+    while(block != null && block != header) block = block->idom;
+    if(block == null) continue;
+
+    backedge = true;
+    if((*i)->loop != loop) {
+      (*i)->loop = loop;
+      body.push_back(*i);
+      work.push_back(*i);
+    }
+  }
+
+  if(!backedge) return;
+
+  while(!work.empty()) {
+    SSABlock *block = work.back();
+    work.pop_back();
+
+    for(vector<SSABlock *>::iterator i = block->preds.begin(); i != block->preds.end(); i ++) {
+      if((*i)->loop != loop) {
+        (*i)->loop = loop;
+        body.push_back(*i);
+        work.push_back(*i);
+      }
+    }
+  }
+
+  // there has to be a single way into the loop
+  SSABlock *outside = null;
+  for(vector<SSABlock *>::iterator i = header->preds.begin(); i != header->preds.end(); i ++) {
+    if((*i)->loop == loop) continue;
+    if(outside != null && outside != *i) return;
+    outside = *i;
+  }
+
+  if(outside == null) return;
+
+  SSABlock *preheader = outside;
+  if(outside->succs.size() > 1) {
+    // put a new block on the edge into the loop, this doesn't change the
+    // order of the predecessors of the header, so the phis stay valid
+    preheader = new SSABlock(0, 0);
+    preheader->depth = header->depth;
+    preheader->sealed = preheader->filled = true;
+    preheader->next = header;
+    preheader->idom = outside;
+    preheader->order = outside->order;
+    preheader->preds.push_back(outside);
+    preheader->succs.push_back(header);
+
+    replace(outside->succs.begin(), outside->succs.end(), header, preheader);
+    replace(outside->cases.begin(), outside->cases.end(), header, preheader);
+    replace(header->preds.begin(), header->preds.end(), outside, preheader);
+    if(outside->target == header) outside->target = preheader;
+    if(outside->next == header) outside->next = preheader;
+    header->idom = preheader;
+
+    blocks.insert(find(blocks.begin(), blocks.end(), header), preheader);
+  }
+
+  // operands are numbered before the values that use them, so visiting the
+  // blocks in reverse post order moves whole invariant expressions at once
+  sort(body.begin(), body.end(), EarlierBlock);
+
+  for(vector<SSABlock *>::iterator i = body.begin(); i != body.end(); i ++) {
+    vector<SSAValue *>& code = (*i)->code;
+    vector<SSAValue *> remaining;
+
+    for(vector<SSAValue *>::iterator j = code.begin(); j != code.end(); j ++) {
+      SSAValue *value = *j;
+      bool invariant = value->kind == SSAValue::Pure && !MayTrap(value->opcode);
+
+      for(dword k = 0; invariant && k < value->args.size(); k ++) {
+        SSAValue *arg = Resolve(value->args[k]);
+        if(arg->block != null && arg->block->loop == loop) invariant = false;
+      }
+
+      if(invariant) {
+        value->block = preheader;
+        preheader->code.push_back(value);
+      } else
+        remaining.push_back(value);
+    }
+
+    code.swap(remaining);
+  }
+}
+
+void SSAForm::HoistInvariants()
+{
+  // inner loops come later in reverse post order, doing them first lets
+  // their invariants move out of the enclosing loops too
+  dword loop = 0;
+  for(vector<SSABlock *>::reverse_iterator i = rpo.rbegin(); i != rpo.rend(); i ++)
+    HoistInvariants(*i, ++ loop);
+}
+
+// marks the values the program needs and counts their uses
+void SSAForm::MarkLive()
+{
+  vector<SSAValue *> work;
+
+  for(vector<SSABlock *>::iterator i = blocks.begin(); i != blocks.end(); i ++) {
+    SSABlock *block = *i;
+
+    for(vector<SSAValue *>::iterator j = block->code.begin(); j != block->code.end(); j ++) {
+      if((*j)->kind == SSAValue::Call || (*j)->kind == SSAValue::Sys) {
+        (*j)->live = true;
+        work.push_back(*j);
+      }
+    }
+
+    for(int k = 0; k < 2; k ++) {
+      if(block->cond[k] == null) continue;
+
+      SSAValue *value = block->cond[k] = Resolve(block->cond[k]);
+      value->uses ++;
+      if(value->block != block) value->shared = true;
+      if(!value->live) {
+        value->live = true;
+        work.push_back(value);
+      }
+    }
+  }
+
+  while(!work.empty()) {
+    SSAValue *value = work.back();
+    work.pop_back();
+
+    for(vector<SSAValue *>::iterator i = value->args.begin(); i != value->args.end(); i ++) {
+      SSAValue *arg = *i = Resolve(*i);
+
+      arg->uses ++;
+      if(value->kind == SSAValue::Phi || arg->block != value->block) arg->shared = true;
+      if(!arg->live) {
+        arg->live = true;
+        work.push_back(arg);
+      }
+    }
+  }
+}
+
+void SSAForm::Optimize()
+{
+  RemoveTrivialPhis();
+  HoistInvariants();
+  MarkLive();
+}
+
+
+
+
+//*** Lowering
+
+void SSAForm::Emit(Op *op)
+{
+  if(op->opcode != NOOP && op->line == 0) op->line = line;
+
+  if(first == null) first = op;
+  else last->next = op;
+  last = op;
+}
+
+// emits the ops that leave the value on the stack, compute forces the
+// computation of a value that is otherwise loaded from its slot
+void SSAForm::EmitValue(SSAValue *value, bool compute)
+{
+  // the second member is true for the entry that emits the op itself,
+  // it is pushed before the operands so it comes out after them
+  vector<pair<SSAValue *, bool> > stack;
+  value = Resolve(value);
+
+  if(compute) {
+    stack.push_back(make_pair(value, true));
+    for(vector<SSAValue *>::reverse_iterator i = value->args.rbegin(); i != value->args.rend(); i ++)
+      stack.push_back(make_pair(Resolve(*i), false));
+  } else
+    stack.push_back(make_pair(value, false));
+
+  while(!stack.empty()) {
+    SSAValue *v = stack.back().first;
+    bool op = stack.back().second;
+    stack.pop_back();
+
+    if(op) {
+      Op *computed = new Op(v->opcode);
+      computed->line = v->line;
+      Emit(computed);
+    } else if(v->kind == SSAValue::Constant)
+      Emit(new Op(PUSH, v->operand));
+    else if(v->kind == SSAValue::Undefined)
+      Emit(new Op(PUSH, (dword)0));
+    else if(v->slot >= 0)
+      EmitSlot(LOAD, v);
+    else {
+      stack.push_back(make_pair(v, true));
+      for(vector<SSAValue *>::reverse_iterator i = v->args.rbegin(); i != v->args.rend(); i ++)
+        stack.push_back(make_pair(Resolve(*i), false));
+    }
+  }
+}
+
+// emits a LOAD or STORE of the slot of value, which is named after the
+// variable the value was stored in
+void SSAForm::EmitSlot(OPCODE opcode, SSAValue *value)
+{
+  Op *op = new Op(opcode, (dword)value->slot);
+  op->variable = value->variable;
+  Emit(op);
+}
+
+// collects the slots the ops emitted for value read
+void SSAForm::ReadSlots(SSAValue *value, vector<long>& slots)
+{
+  vector<SSAValue *> stack;
+  stack.push_back(value);
+
+  while(!stack.empty()) {
+    SSAValue *v = Resolve(stack.back());
+    stack.pop_back();
+
+    if(v->slot >= 0)
+      slots.push_back(v->slot);
+    else if(v->kind == SSAValue::Pure)
+      stack.insert(stack.end(), v->args.begin(), v->args.end());
+  }
+}
+
+bool SSAForm::HasCopies(SSABlock *from, SSABlock *to)
+{
+  dword index = (dword)(find(to->preds.begin(), to->preds.end(), from) - to->preds.begin());
+
+  for(vector<SSAValue *>::iterator i = to->phis.begin(); i != to->phis.end(); i ++) {
+    SSAValue *phi = *i;
+    if(phi->live && phi->forward == null && Resolve(phi->args[index]) != phi) return true;
+  }
+
+  return false;
+}
+
+// returns the label a jump from from to to goes to, which is a
+// trampoline if the edge needs copies
+Op* SSAForm::EdgeLabel(SSABlock *from, SSABlock *to)
+{
+  if(!HasCopies(from, to)) return to->label;
+
+  for(vector<Trampoline>::iterator i = trampolines.begin(); i != trampolines.end(); i ++) {
+    if(i->from == from && i->to == to) return i->label;
+  }
+
+  Trampoline trampoline;
+  trampoline.label = new Op(NOOP);
+  trampoline.from = from;
+  trampoline.to = to;
+  trampolines.push_back(trampoline);
+  return trampoline.label;
+}
+
+// emits the copies into the phi slots of to on the edge from from
+void SSAForm::EmitCopies(SSABlock *from, SSABlock *to)
+{
+  dword index = (dword)(find(to->preds.begin(), to->preds.end(), from) - to->preds.begin());
+
+  vector<SSAValue *> phis, sources;
+  for(vector<SSAValue *>::iterator i = to->phis.begin(); i != to->phis.end(); i ++) {
+    SSAValue *phi = *i;
+    if(!phi->live || phi->forward != null) continue;
+
+    SSAValue *source = Resolve(phi->args[index]);
+    if(source == phi) continue;
+
+    phis.push_back(phi);
+    sources.push_back(source);
+  }
+
+  dword count = (dword)phis.size(), left = count;
+  vector<vector<long> > reads(count);
+  vector<bool> done(count, false);
+
+  for(dword i = 0; i < count; i ++)
+    ReadSlots(sources[i], reads[i]);
+
+  // the copies happen in parallel, so a slot can only be overwritten once
+  // none of the other copies need its old value
+  while(left > 0) {
+    dword i;
+    for(i = 0; i < count; i ++) {
+      if(done[i]) continue;
+
+      bool read = false;
+      for(dword j = 0; j < count && !read; j ++) {
+        if(j != i && !done[j] && find(reads[j].begin(), reads[j].end(), phis[i]->slot) != reads[j].end())
+          read = true;
+      }
+
+      if(!read) break;
+    }
+
+    if(i == count) break;
+
+    EmitValue(sources[i], false);
+    EmitSlot(STORE, phis[i]);
+    Emit(new Op(POP));
+    done[i] = true;
+    left --;
+  }
+
+  // the rest form cycles, all of their values are pushed before any is stored
+  if(left > 0) {
+    for(dword i = 0; i < count; i ++) {
+      if(!done[i]) EmitValue(sources[i], false);
+    }
+
+    for(dword i = count; i -- > 0; ) {
+      if(done[i]) continue;
+      EmitSlot(STORE, phis[i]);
+      Emit(new Op(POP));
+    }
+  }
+}
+
+void SSAForm::EmitBlock(SSABlock *block, SSABlock *following)
+{
+  Emit(block->label);
+
+  for(vector<SSAValue *>::iterator i = block->code.begin(); i != block->code.end(); i ++) {
+    SSAValue *value = *i;
+    line = value->line;
+
+    if(value->kind == SSAValue::Call || value->kind == SSAValue::Sys) {
+      for(vector<SSAValue *>::iterator j = value->args.begin(); j != value->args.end(); j ++)
+        EmitValue(*j, false);
+
+      Op *call = new Op(value->opcode, value->operand);
+      if(value->opcode == CALLS) {
+        call->target = value->target;
+        call->count = value->operand;
+      } else if(value->opcode == CALLM)
+        call->count = (dword)value->args.size();
+
+      Emit(call);
+      if(value->kind == SSAValue::Sys) continue;
+
+      if(value->slot >= 0) EmitSlot(STORE, value);
+      Emit(new Op(POP));
+    } else if(value->live && value->slot >= 0) {
+      EmitValue(value, true);
+      EmitSlot(STORE, value);
+      Emit(new Op(POP));
+    }
+  }
+
+  line = block->line;
+
+  SSABlock *to;
+  switch(block->branch) {
+    case SYS:
+      // Assemble() ends the program with an exit anyway
+      if(following != null) Emit(new Op(SYS, (dword)SC_EXIT));
+      return;
+
+    case RET:
+      EmitValue(block->cond[0], false);
+      Emit(new Op(RET));
+      return;
+
+    case NOOP:
+    case GOTO:
+      to = block->succs[0];
+      EmitCopies(block, to);
+      if(to != following) Emit(new Op(GOTO, to->label));
+      return;
+  }
+
+  OPCODE opcode = block->branch;
+  SSABlock *taken = block->target, *fall = block->next;
+  SSAValue *a = block->cond[0], *b = block->cond[1];
+
+  if(opcode == TABLESWITCH) {
+    // a constant value leaves a single way out of the block
+    if(a->kind == SSAValue::Constant) {
+      dword index = a->operand - block->low;
+      to = index < block->cases.size() ? block->cases[index] : taken;
+
+      EmitCopies(block, to);
+      if(to != following) Emit(new Op(GOTO, to->label));
+      return;
+    }
+
+    EmitValue(a, false);
+
+    Op *table = new Op(TABLESWITCH, EdgeLabel(block, taken));
+    table->operand = block->low;
+    table->count = (dword)block->cases.size();
+    Emit(table);
+
+    for(vector<SSABlock *>::iterator i = block->cases.begin(); i != block->cases.end(); i ++)
+      Emit(new Op(GOTO, EdgeLabel(block, *i)));
+    return;
+  }
+
+  // a constant condition leaves a single way out of the block
+  dword r;
+  if(a->kind == SSAValue::Constant && (b == null || b->kind == SSAValue::Constant)) {
+    Evaluate(opcode, a->operand, b != null ? b->operand : 0, r);
+
+    to = r ? taken : fall;
+    EmitCopies(block, to);
+    if(to != following) Emit(new Op(GOTO, to->label));
+    return;
+  }
+
+  // a jump that needs copies goes through a trampoline, turning
+  // the condition around often saves that
+  if(IsCompareOp(opcode) && HasCopies(block, taken) && !HasCopies(block, fall)) {
+    swap(taken, fall);
+    opcode = InvertCompare(opcode);
+  }
+
+  EmitValue(a, false);
+  if(b != null) EmitValue(b, false);
+
+  Emit(new Op(opcode, EdgeLabel(block, taken)));
+
+  EmitCopies(block, fall);
+  if(fall != following) Emit(new Op(GOTO, fall->label));
+}
+
+Op* SSAForm::Lower(dword& slotcount)
+{
+  first = last = null;
+
+  // the parameters keep their slots
+  slots = (dword)params.size();
+
+  // values that are used more than once or outside of their block are kept
+  // in slots, the others are computed right where they are used
+  for(vector<SSAValue *>::iterator i = values.begin(); i != values.end(); i ++) {
+    SSAValue *value = *i;
+    if(!value->live || value->forward != null) continue;
+
+    switch(value->kind) {
+      case SSAValue::Phi:
+        value->slot = slots ++;
+        break;
+
+      case SSAValue::Call:
+        if(value->uses > 0) value->slot = slots ++;
+        break;
+
+      case SSAValue::Pure:
+        if(value->uses > 1 || value->shared) value->slot = slots ++;
+        break;
+    }
+  }
+
+  if(slots > MaxSlots) return null;
+
+  for(vector<SSABlock *>::iterator i = blocks.begin(); i != blocks.end(); i ++)
+    (*i)->label = new Op(NOOP);
+
+  for(dword i = 0; i < blocks.size(); i ++)
+    EmitBlock(blocks[i], i + 1 < blocks.size() ? blocks[i + 1] : null);
+
+  if(!trampolines.empty()) {
+    Emit(new Op(SYS, (dword)SC_EXIT));
+
+    for(vector<Trampoline>::iterator i = trampolines.begin(); i != trampolines.end(); i ++) {
+      line = i->from->line;
+      Emit(i->label);
+      EmitCopies(i->from, i->to);
+      Emit(new Op(GOTO, i->to->label));
+    }
+  }
+
+  slotcount = slots;
+  return first;
+}
+
+SSAForm::SSAForm(vector<Function *>& functions, SymbolVector& params) :
+  functions(functions), params(params), first(null), last(null), slots(0), line(0)
+{
+  undefined = NewValue(SSAValue::Undefined, PUSH, 0, null);
+}
+
+SSAForm::~SSAForm()
+{
+  for(vector<SSAValue *>::iterator i = values.begin(); i != values.end(); i ++)
+    delete *i;
+
+  for(vector<SSABlock *>::iterator i = blocks.begin(); i != blocks.end(); i ++)
+    delete *i;
+}
+
+
+//*** Slot allocation
+
+static bool LowerIndex(const pair<dword, dword>& a, const pair<dword, dword>& b)
+{
+  return a.first < b.first;
+}
+
+// gives the virtual slots of the lowered chain real local variable indices,
+// slots that are never live at the same time share an index
+// the first params slots are the parameters, which keep their indices
+// ordered colors the slots in the order of the indices of the variables they
+// stand for, so that the variables a profile numbered first get the lowest
+// indices, otherwise they are colored in slot order
+static void AllocateSlots(Op *op, dword slots, dword params, dword& locals, bool ordered)
+{
+  locals = params;
+  if(slots == 0) return;
+
+  vector<Op *> ops;
+  for(Op *cop = op; cop != null; cop = cop->next) {
+    cop->offset = (dword)ops.size();
+    ops.push_back(cop);
+  }
+
+  // split the chain into blocks
+  dword count = (dword)ops.size();
+  vector<bool> leader(count + 1, false);
+  leader[0] = true;
+
+  for(dword i = 0; i < count; i ++) {
+    if(Assembler::IsJumpOp(ops[i]->opcode) && ops[i]->opcode != CALLS) {
+      leader[ops[i]->target->offset] = true;
+      leader[i + 1] = true;
+    } else if(ops[i]->opcode == RET || (ops[i]->opcode == SYS && ops[i]->operand == SC_EXIT))
+      leader[i + 1] = true;
+  }
+
+  vector<dword> begin, blockat(count);
+  for(dword i = 0; i < count; i ++) {
+    if(leader[i]) begin.push_back(i);
+    blockat[i] = (dword)begin.size() - 1;
+  }
+
+  dword blockcount = (dword)begin.size();
+  begin.push_back(count);
+
+  vector<vector<dword> > succs(blockcount);
+  for(dword b = 0; b < blockcount; b ++) {
+    Op *lastop = ops[begin[b + 1] - 1];
+
+    if(Assembler::IsJumpOp(lastop->opcode) && lastop->opcode != CALLS)
+      succs[b].push_back(blockat[lastop->target->offset]);
+
+    // every entry of a jump table is a block of its own
+    if(lastop->opcode == TABLESWITCH) {
+      for(dword k = 1; k <= lastop->count; k ++)
+        succs[b].push_back(blockat[lastop->offset + k]);
+    }
+
+    bool stops = lastop->opcode == GOTO || lastop->opcode == TABLESWITCH || lastop->opcode == RET ||
+      (lastop->opcode == SYS && lastop->operand == SC_EXIT);
+    if(!stops && b + 1 < blockcount) succs[b].push_back(b + 1);
+  }
+
+  // liveness, one bit per slot
+  dword words = (slots + 31) / 32;
+  vector<dword> use(blockcount * words, 0), def(blockcount * words, 0);
+  vector<dword> in(blockcount * words, 0), out(blockcount * words, 0);
+
+  for(dword b = 0; b < blockcount; b ++) {
+    dword *u = &use[b * words], *d = &def[b * words];
+
+    for(dword i = begin[b]; i < begin[b + 1]; i ++) {
+      dword s = ops[i]->operand;
+      if(ops[i]->opcode == LOAD && !(d[s / 32] & (1 << (s % 32)))) u[s / 32] |= 1 << (s % 32);
+      if(ops[i]->opcode == STORE) d[s / 32] |= 1 << (s % 32);
+    }
+  }
+
+  bool changed;
+  do {
+    changed = false;
+
+    for(dword b = blockcount; b -- > 0; ) {
+      for(dword w = 0; w < words; w ++) {
+        dword o = 0;
+        for(vector<dword>::iterator j = succs[b].begin(); j != succs[b].end(); j ++)
+          o |= in[*j * words + w];
+
+        dword n = use[b * words + w] | (o & ~def[b * words + w]);
+        if(n != in[b * words + w]) changed = true;
+
+        out[b * words + w] = o;
+        in[b * words + w] = n;
+      }
+    }
+  } while(changed);
+
+  // a slot interferes with all the slots that are live where it is stored
+  vector<dword> interference(slots * words, 0), live(words);
+
+  for(dword b = 0; b < blockcount; b ++) {
+    copy(out.begin() + b * words, out.begin() + (b + 1) * words, live.begin());
+
+    for(dword i = begin[b + 1]; i -- > begin[b]; ) {
+      dword s = ops[i]->operand;
+
+      if(ops[i]->opcode == STORE) {
+        for(dword w = 0; w < words; w ++) {
+          for(dword bits = live[w]; bits != 0; bits &= bits - 1) {
+            dword t = w * 32;
+            while(!(bits & (1 << (t % 32)))) t ++;
+            if(t == s) continue;
+
+            interference[s * words + t / 32] |= 1 << (t % 32);
+            interference[t * words + s / 32] |= 1 << (s % 32);
+          }
+        }
+
+        live[s / 32] &= ~(1 << (s % 32));
+      } else if(ops[i]->opcode == LOAD)
+        live[s / 32] |= 1 << (s % 32);
+    }
+  }
+
+  // the slots in the order they are colored, the slots that don't stand for
+  // a variable go last
+  vector<pair<dword, dword> > order;
+  for(dword s = params; s < slots; s ++)
+    order.push_back(make_pair((dword)-1, s));
+
+  if(ordered) {
+    for(dword i = 0; i < count; i ++) {
+      Op *cop = ops[i];
+      if(cop->opcode != STORE || cop->variable == null || cop->operand < params) continue;
+
+      dword& index = order[cop->operand - params].first;
+      if(cop->variable->index < index) index = cop->variable->index;
+    }
+
+    stable_sort(order.begin(), order.end(), LowerIndex);
+  }
+
+  // greedy coloring
+  vector<long> color(slots, -1);
+  vector<bool> used;
+
+  for(dword s = 0; s < params; s ++)
+    color[s] = s;
+
+  for(dword k = 0; k < order.size(); k ++) {
+    dword s = order[k].second;
+    used.assign(locals + 1, false);
+
+    for(dword t = 0; t < slots; t ++) {
+      if(color[t] >= 0 && (interference[s * words + t / 32] & (1 << (t % 32))))
+        used[color[t]] = true;
+    }
+
+    dword c = 0;
+    while(used[c]) c ++;
+
+    color[s] = c;
+    if(c + 1 > locals) locals = c + 1;
+  }
+
+  for(dword i = 0; i < count; i ++) {
+    if(ops[i]->opcode == LOAD || ops[i]->opcode == STORE)
+      ops[i]->operand = color[ops[i]->operand];
+  }
+}
+
+Op* Compiler::OptimizeSSA(Op *op, dword& localcount, SymbolVector& params)
+{
+  // the imported functions by index, calls need their parameter counts
+  vector<Function *> calls(functions.size(), (Function *)null);
+  forEach(SymbolTable, functions, i)
+    calls[(*i).second->index] = (Function *)(*i).second->data;
+
+  SSAForm form(calls, params);
+  if(!form.Build(op)) return op;
+
+  form.Optimize();
+
+  dword slots;
+  Op *lowered = form.Lower(slots);
+  if(lowered == null) return op;
+
+  AllocateSlots(lowered, slots, (dword)params.size(), localcount, profile != null);
+  return lowered;
+}
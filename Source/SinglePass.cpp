@@ -0,0 +1,440 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include <ctype.h>
+
+#include "TyroDebug.h"
+
+
+//*** Single pass compiler
+
+// compiles source straight to bytecode, every construct is written as soon
+// as it has been parsed and jumps forward are patched once their target is known
+// any error or anything it doesn't handle stops it, Compile() reports the errors
+class SinglePass
+{
+  Assembly& assembly;
+  ImportList& importlist;
+
+  const char *pos;        // the next character of the source
+  dword line;
+
+  enum TokenType { T_END, T_NAME, T_INT, T_OTHER };
+
+  TokenType type;         // the current token
+  string token;
+  int binary;             // the index of the token in operators, -1 if it isn't one
+
+  NameTable<dword> variables;       // the indices of the variables
+  NameTable<dword> calls;           // the indices of the imported functions that are called
+  vector<Function *> pointers;      // the imported functions by index
+
+  bool failed;
+
+  void Next();
+  bool Is(const char *s) { return type != T_END && token == s; }
+  void Expect(const char *s);
+  void Fail() { failed = true; type = T_END; }
+
+  dword Emit(OPCODE opcode, dword operand = 0);
+  void Patch(dword offset, dword target) { if(!failed) assembly.GetByteCode()[offset + 1] = target; }
+  dword Here() { return assembly.GetSize(); }
+
+  // the expression functions return the compare and branch op that jumps
+  // if a comparison is true if they leave that to the caller, NOOP if the
+  // value is on the stack
+  OPCODE Binary(int level);
+  OPCODE Unary();
+  OPCODE Primary();
+  OPCODE Expression() { return Binary(1); }
+
+  // leaves the value of a comparison on the stack
+  void Value(OPCODE pending);
+
+  // writes a jump if the value is false (or true), returns its offset
+  dword JumpIf(bool value, OPCODE pending);
+
+  void ShortCircuit(bool value, int level, OPCODE pending);
+  void Statement();
+
+public:
+
+  SinglePass(Assembly& assembly, ImportList& importlist, const char *source);
+
+  bool Compile();
+};
+
+// the binary operators, from the lowest to the highest precedence
+// the comparisons are the jumps taken when they are true
+static struct
+{
+  const char *name;
+  int level;
+  OPCODE opcode;
+
+} operators[] = {
+  {"||", 1, NOOP}, {"&&", 2, NOOP},
+  {"|", 3, BOR}, {"^", 4, BXOR}, {"&", 5, BAND},
+  {"==", 6, JEQ}, {"!=", 6, JNE},
+  {"<", 7, JLT}, {"<=", 7, JLE}, {">", 7, JGT}, {">=", 7, JGE},
+  {"<<", 8, SHL}, {">>", 8, SAR},
+  {"+", 9, IADD}, {"-", 9, ISUB},
+  {"*", 10, IMUL}, {"/", 10, IDIV}, {"%", 10, IMOD},
+};
+
+enum { MaxLevel = 10, OperatorCount = sizeof(operators)/sizeof(operators[0]) };
+
+static const char *keywords[] = {
+  "if", "else", "while", "do", "for", "switch", "case", "default", "function", "return", "true", "false"
+};
+
+static OPCODE InvertCompare(OPCODE opcode)
+{
+  switch(opcode) {
+    case JEQ: return JNE;
+    case JNE: return JEQ;
+    case JLT: return JGE;
+    case JLE: return JGT;
+    case JGT: return JLE;
+    case JGE: return JLT;
+  }
+
+  return opcode;
+}
+
+SinglePass::SinglePass(Assembly& a, ImportList& i, const char *source) :
+  assembly(a), importlist(i), pos(source), line(1), type(T_END), binary(-1), failed(false)
+{
+}
+
+void SinglePass::Next()
+{
+  if(failed) return;
+
+  // skip white space and comments
+  for(;;) {
+    while(isspace(*pos)) {
+      if(*pos == '\n') line ++;
+      pos ++;
+    }
+
+    if(pos[0] != '/' || pos[1] != '/') break;
+    while(*pos != '\0' && *pos != '\n') pos ++;
+  }
+
+  const char *start = pos;
+  if(*pos == '\0') {
+    type = T_END;
+    token.clear();
+    return;
+  }
+
+  if(isalpha(*pos) || *pos == '_') {
+    while(isalnum(*pos) || *pos == '_') pos ++;
+    type = T_NAME;
+  } else if(isdigit(*pos)) {
+    while(isdigit(*pos)) pos ++;
+
+    // floats take the full compiler
+    if(*pos == '.' || isalpha(*pos)) {
+      Fail();
+      return;
+    }
+    type = T_INT;
+  } else {
+    static const char *pairs[] = { "==", "!=", "<=", ">=", "&&", "||", "<<", ">>" };
+
+    pos ++;
+    for(dword i = 0; i < sizeof(pairs)/sizeof(pairs[0]); i ++) {
+      if(start[0] == pairs[i][0] && start[1] == pairs[i][1]) {
+        pos ++;
+        break;
+      }
+    }
+    type = T_OTHER;
+  }
+
+  token.assign(start, pos - start);
+
+  // looked up once here rather than at every precedence level
+  binary = -1;
+  if(type == T_OTHER) {
+    for(int i = 0; i < OperatorCount; i ++) {
+      if(token == operators[i].name) {
+        binary = i;
+        break;
+      }
+    }
+  }
+}
+
+void SinglePass::Expect(const char *s)
+{
+  if(Is(s)) Next();
+  else Fail();
+}
+
+dword SinglePass::Emit(OPCODE opcode, dword operand)
+{
+  dword offset = Here();
+  if(failed) return offset;
+
+  assembly.AddLine(offset, line);
+  assembly.WriteOp(opcode, operand);
+  return offset;
+}
+
+void SinglePass::Value(OPCODE pending)
+{
+  if(pending == NOOP) return;
+
+  dword jump = Emit(pending);
+  Emit(PUSH, 0);
+  dword skip = Emit(GOTO);
+  Patch(jump, Here());
+  Emit(PUSH, 1);
+  Patch(skip, Here());
+}
+
+dword SinglePass::JumpIf(bool value, OPCODE pending)
+{
+  if(pending != NOOP)
+    return Emit(value ? pending : InvertCompare(pending));
+
+  // any value other than 0 is true
+  Emit(PUSH, 0);
+  return Emit(value ? JNE : JEQ);
+}
+
+// a && b && c jumps to 0 as soon as a value is false, a || b || c to 1 as
+// soon as one is true, value is the value that ends the evaluation
+void SinglePass::ShortCircuit(bool value, int level, OPCODE pending)
+{
+  vector<dword> jumps;
+  jumps.push_back(JumpIf(value, pending));
+
+  while(Is(value ? "||" : "&&")) {
+    Next();
+    jumps.push_back(JumpIf(value, Binary(level + 1)));
+  }
+
+  Emit(PUSH, value ? 0 : 1);
+  dword skip = Emit(GOTO);
+
+  for(dword i = 0; i < jumps.size(); i ++)
+    Patch(jumps[i], Here());
+
+  Emit(PUSH, value ? 1 : 0);
+  Patch(skip, Here());
+}
+
+OPCODE SinglePass::Binary(int level)
+{
+  if(level > MaxLevel) return Unary();
+
+  OPCODE pending = Binary(level + 1);
+
+  for(;;) {
+    int i = binary;
+    if(failed || i < 0 || operators[i].level != level) return pending;
+
+    if(operators[i].opcode == NOOP) {
+      ShortCircuit(level == 1, level, pending);
+      pending = NOOP;
+      continue;
+    }
+
+    Next();
+    Value(pending);
+    Value(Binary(level + 1));
+
+    // comparisons are left to the caller, they may become the branch itself
+    if(operators[i].opcode >= JEQ && operators[i].opcode <= JGE)
+      pending = operators[i].opcode;
+    else {
+      Emit(operators[i].opcode);
+      pending = NOOP;
+    }
+  }
+}
+
+OPCODE SinglePass::Unary()
+{
+  // there is no not op, ~a is a ^ 0xffffffff
+  if(Is("~")) {
+    Next();
+    Value(Unary());
+    Emit(PUSH, 0xffffffff);
+    Emit(BXOR);
+    return NOOP;
+  }
+
+  return Primary();
+}
+
+OPCODE SinglePass::Primary()
+{
+  if(type == T_INT) {
+    Emit(PUSH, (dword)atoi(token.c_str()));
+    Next();
+    return NOOP;
+  }
+
+  if(Is("(")) {
+    Next();
+    OPCODE pending = Expression();
+    Expect(")");
+    return pending;
+  }
+
+  if(Is("true") || Is("false")) {
+    Emit(PUSH, Is("true") ? 1 : 0);
+    Next();
+    return NOOP;
+  }
+
+  if(type != T_NAME) {
+    Fail();
+    return NOOP;
+  }
+
+  for(dword i = 0; i < sizeof(keywords)/sizeof(keywords[0]); i ++) {
+    if(token == keywords[i]) {
+      Fail();
+      return NOOP;
+    }
+  }
+
+  string name = token;
+  Next();
+
+  // a call of an imported function, anything else takes the full compiler
+  if(Is("(")) {
+    Function *function = importlist.Find(name);
+    if(function == null) {
+      Fail();
+      return NOOP;
+    }
+
+    Next();
+    dword count = 0;
+    while(!failed && !Is(")")) {
+      if(count > 0) Expect(",");
+      Value(Expression());
+      count ++;
+    }
+    Expect(")");
+
+    if(count != function->paramcount) {
+      Fail();
+      return NOOP;
+    }
+
+    NameTable<dword>::iterator i = calls.find(name);
+    if(i == calls.end()) {
+      i = calls.insert(make_pair(name, (dword)pointers.size())).first;
+      pointers.push_back(function);
+    }
+
+    Emit(CALL, (*i).second);
+    return NOOP;
+  }
+
+  NameTable<dword>::iterator i = variables.find(name);
+  if(i == variables.end())
+    i = variables.insert(make_pair(name, (dword)variables.size())).first;
+
+  // the store leaves the value on the stack
+  if(Is("=")) {
+    Next();
+    Value(Expression());
+    Emit(STORE, (*i).second);
+    return NOOP;
+  }
+
+  Emit(LOAD, (*i).second);
+  return NOOP;
+}
+
+void SinglePass::Statement()
+{
+  dword top, jump, skip;
+
+  if(Is(";")) {
+    Next();
+  } else if(Is("{")) {
+    Next();
+    while(!failed && type != T_END && !Is("}")) Statement();
+    Expect("}");
+  } else if(Is("if")) {
+    Next();
+    Expect("(");
+    jump = JumpIf(false, Expression());
+    Expect(")");
+    Statement();
+
+    if(Is("else")) {
+      Next();
+      skip = Emit(GOTO);
+      Patch(jump, Here());
+      Statement();
+      Patch(skip, Here());
+    } else
+      Patch(jump, Here());
+  } else if(Is("while")) {
+    Next();
+    top = Here();
+    Expect("(");
+    jump = JumpIf(false, Expression());
+    Expect(")");
+    Statement();
+    Emit(GOTO, top);
+    Patch(jump, Here());
+  } else if(Is("do")) {
+    Next();
+    top = Here();
+    Statement();
+    Expect("while");
+    Expect("(");
+    Patch(JumpIf(true, Expression()), top);
+    Expect(")");
+    Expect(";");
+  } else {
+    Value(Expression());
+    Emit(POP);
+    Expect(";");
+  }
+}
+
+bool SinglePass::Compile()
+{
+  assembly.Clear();
+
+  // the number of variables is only known at the end
+  dword local = Emit(LOCAL);
+
+  Next();
+  while(!failed && type != T_END)
+    Statement();
+
+  if(failed) {
+    assembly.Clear();
+    return false;
+  }
+
+  assembly.GetByteCode()[local + 1] = (dword)variables.size();
+  Emit(SYS, SC_EXIT);
+
+  Function **functions = new Function*[pointers.size()];
+  for(dword i = 0; i < pointers.size(); i ++)
+    functions[i] = pointers[i];
+
+  assembly.SetFunctions(functions, (dword)pointers.size());
+  return true;
+}
+
+bool Compiler::CompileSinglePass(const char *source, Assembly& assembly, ImportList& importlist)
+{
+  SinglePass pass(assembly, importlist, source);
+  return pass.Compile();
+}
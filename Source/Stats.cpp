@@ -0,0 +1,98 @@
+#include "Compiler.h"
+
+#include "TyroDebug.h"
+
+
+//*** CompileStats
+
+static const char *phasenames[CompileStats::PhaseCount] = {
+  "parse", "functions", "imports", "semantics", "optimize",
+  "build", "ssa", "peephole", "layout", "assemble"
+};
+
+const char* CompileStats::GetName(Phase phase)
+{
+  return phase < PhaseCount ? phasenames[phase] : "";
+}
+
+void CompileStats::Clear()
+{
+  memset(phases, 0, sizeof(phases));
+  compiles = nodes = ops = symbols = code = 0;
+}
+
+void CompileStats::Add(const CompileStats& stats)
+{
+  for(dword i = 0; i < PhaseCount; i ++) {
+    phases[i].time += stats.phases[i].time;
+    phases[i].allocations += stats.phases[i].allocations;
+    if(stats.phases[i].memory > phases[i].memory) phases[i].memory = stats.phases[i].memory;
+  }
+
+  compiles += stats.compiles;
+  nodes += stats.nodes;
+  ops += stats.ops;
+  symbols += stats.symbols;
+  code += stats.code;
+}
+
+void CompileStats::Print(FILE *out)
+{
+  double total = 0;
+  dword allocations = 0;
+  size_t memory = 0;
+
+  fprintf(out, "%-12s %10s %6s %12s %12s\n", "phase", "ms", "%", "allocations", "memory");
+
+  for(dword i = 0; i < PhaseCount; i ++)
+    total += phases[i].time;
+
+  for(dword i = 0; i < PhaseCount; i ++) {
+    PhaseStats& phase = phases[i];
+    fprintf(out, "%-12s %10.3f %6.1f %12u %12u\n", phasenames[i], phase.time,
+      total > 0 ? phase.time * 100 / total : 0.0, phase.allocations, (dword)phase.memory);
+
+    allocations += phase.allocations;
+    if(phase.memory > memory) memory = phase.memory;
+  }
+
+  fprintf(out, "%-12s %10.3f %6.1f %12u %12u\n", "total", total, total > 0 ? 100.0 : 0.0,
+    allocations, (dword)memory);
+  fprintf(out, "%u compilations, %u nodes, %u ops, %u symbols, %u dwords of code\n",
+    compiles, nodes, ops, symbols, code);
+}
+
+
+//*** Compiler
+
+void Compiler::BeginPhases()
+{
+  if(stats == null) return;
+
+  stats->compiles ++;
+  nodecount = opcount = 0;
+  phaseallocations = 0;
+  QueryPerformanceCounter(&phasestart);
+}
+
+void Compiler::EndPhase(CompileStats::Phase phase)
+{
+  if(stats == null) return;
+
+  LARGE_INTEGER now, frequency;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&frequency);
+
+  // the arena is cleared between the compilations, not between the phases
+  CompileStats::PhaseStats& counts = stats->phases[phase];
+  counts.time += (double)(now.QuadPart - phasestart.QuadPart) * 1000 / frequency.QuadPart;
+  counts.allocations += arena.GetAllocations() - phaseallocations;
+  if(arena.GetSize() > counts.memory) counts.memory = arena.GetSize();
+
+  stats->nodes += nodecount;
+  stats->ops += opcount;
+  nodecount = opcount = 0;
+
+  phaseallocations = arena.GetAllocations();
+  phasestart = now;
+}
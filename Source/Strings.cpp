@@ -0,0 +1,303 @@
+#include "Assembly.h"
+
+#include <intrin.h>
+#include <emmintrin.h>
+
+#include "TyroDebug.h"
+
+
+//*** Kernels
+
+// the searches have a plain version and an SSE2 version, the cpu decides
+// which one is used when the first string is compared
+
+struct StringKernels
+{
+  // returns the offset of the first byte that differs in a and b, n if there is none
+  dword (*mismatch)(const char *a, const char *b, dword n);
+
+  // returns the offset of the first t in s, -1 if there is none, t isn't empty
+  long (*find)(const char *s, dword n, const char *t, dword m);
+};
+
+
+static dword Mismatch(const char *a, const char *b, dword n)
+{
+  dword i = 0;
+  while(i < n && a[i] == b[i]) i ++;
+  return i;
+}
+
+static long Find(const char *s, dword n, const char *t, dword m)
+{
+  for(dword i = 0; i + m <= n; i ++) {
+    if(s[i] == t[0] && memcmp(s + i + 1, t + 1, m - 1) == 0) return (long)i;
+  }
+
+  return -1;
+}
+
+
+// compares 16 bytes at a time
+static dword MismatchSSE2(const char *a, const char *b, dword n)
+{
+  dword i = 0;
+  for(; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    dword equal = (dword)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if(equal != 0xffff) {
+      dword k;
+      _BitScanForward(&k, ~equal);
+      return i + k;
+    }
+  }
+
+  return i + Mismatch(a + i, b + i, n - i);
+}
+
+// tests 16 positions at a time for the first and the last byte of t and
+// only compares the rest of t where both of them are there
+static long FindSSE2(const char *s, dword n, const char *t, dword m)
+{
+  if(m > n) return -1;
+
+  __m128i first = _mm_set1_epi8(t[0]);
+  __m128i last = _mm_set1_epi8(t[m - 1]);
+
+  // the positions t can start at
+  dword positions = n - m + 1, i = 0;
+  for(; i + 16 <= positions; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+    dword found = (dword)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, first), _mm_cmpeq_epi8(y, last)));
+
+    while(found != 0) {
+      dword k;
+      _BitScanForward(&k, found);
+      if(m <= 2 || memcmp(s + i + k + 1, t + 1, m - 2) == 0) return (long)(i + k);
+      found &= found - 1;
+    }
+  }
+
+  long r = Find(s + i, n - i, t, m);
+  return r >= 0 ? (long)i + r : -1;
+}
+
+
+static const StringKernels plain = { Mismatch, Find };
+static const StringKernels sse2 = { MismatchSSE2, FindSSE2 };
+
+// SSE2 is cpuid function 1 edx bit 26
+static const StringKernels* SelectKernels()
+{
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0 ? &sse2 : &plain;
+}
+
+static const StringKernels *kernels = SelectKernels();
+
+
+//*** VirtualMachine
+
+const char* VirtualMachine::GetString(dword handle, dword& length)
+{
+  if((handle & LiteralHandle) != 0) {
+    handle &= ~LiteralHandle;
+    if(literals != null && handle < literals->size()) {
+      length = (dword)(*literals)[handle].size();
+      return (*literals)[handle].data();
+    }
+  } else if(handle - 1 < strings.size()) {
+    length = strings[handle - 1].length;
+    return strings[handle - 1].GetData();
+  }
+
+  length = 0;
+  return "";
+}
+
+bool VirtualMachine::NewString(const char *data, dword length, dword& handle)
+{
+  if(length == 0) {
+    handle = 0;
+    return true;
+  }
+
+  if(length > MaxStringLength || strings.size() + 1 >= LiteralHandle) return false;
+
+  String string;
+  string.length = length;
+  string.hash = 0;
+  string.block = 0;
+  string.data = null;
+
+  if(length <= String::SmallSize)
+    memcpy(string.small, data, length);
+  else {
+    StringBlock block;
+    block.capacity = length * 2 > StringBlockSize ? length * 2 : StringBlockSize;
+    block.data = (char *)malloc(block.capacity);
+    if(block.data == null) return false;
+
+    memcpy(block.data, data, length);
+    block.size = length;
+    blocks.push_back(block);
+
+    string.data = block.data;
+    string.block = (dword)blocks.size() - 1;
+  }
+
+  strings.push_back(string);
+  handle = (dword)strings.size();
+  return true;
+}
+
+bool VirtualMachine::Concatenate(dword a, dword b, dword& handle)
+{
+  dword alength, blength;
+  const char *adata = GetString(a, alength), *bdata = GetString(b, blength);
+
+  if(blength == 0 || alength == 0) {
+    handle = blength == 0 ? a : b;
+    return true;
+  }
+
+  dword length = alength + blength;
+  if(length > MaxStringLength || strings.size() + 1 >= LiteralHandle) return false;
+
+  // a string that ends where its block does grows in place, so that a loop
+  // that keeps appending to a string doesn't copy it every time, the strings
+  // that share the block end before the part that is written to
+  if((a & LiteralHandle) == 0 && a - 1 < strings.size() && strings[a - 1].data != null) {
+    String& first = strings[a - 1];
+    StringBlock& block = blocks[first.block];
+
+    if(first.data + alength == block.data + block.size && block.capacity - block.size >= blength) {
+      memcpy(block.data + block.size, bdata, blength);
+      block.size += blength;
+
+      String string = first;
+      string.length = length;
+      string.hash = 0;
+      strings.push_back(string);
+      handle = (dword)strings.size();
+      return true;
+    }
+  }
+
+  // bdata may be in the entry of a small string, which moves when the entries
+  // grow, so the bytes are put together before the new one is added
+  if(length <= String::SmallSize) {
+    char small[String::SmallSize];
+    memcpy(small, adata, alength);
+    memcpy(small + alength, bdata, blength);
+    return NewString(small, length, handle);
+  }
+
+  StringBlock block;
+  block.capacity = length * 2 > StringBlockSize ? length * 2 : StringBlockSize;
+  block.data = (char *)malloc(block.capacity);
+  if(block.data == null) return false;
+
+  memcpy(block.data, adata, alength);
+  memcpy(block.data + alength, bdata, blength);
+  block.size = length;
+  blocks.push_back(block);
+
+  String string;
+  string.data = block.data;
+  string.length = length;
+  string.hash = 0;
+  string.block = (dword)blocks.size() - 1;
+  strings.push_back(string);
+  handle = (dword)strings.size();
+  return true;
+}
+
+bool VirtualMachine::Substring(dword s, dword from, dword to, dword& handle)
+{
+  dword length;
+  const char *data = GetString(s, length);
+  if(from > to || to > length) return false;
+
+  // a part of a string in a block shares the block
+  if((s & LiteralHandle) == 0 && s - 1 < strings.size() && strings[s - 1].data != null &&
+    to - from > String::SmallSize) {
+    if(strings.size() + 1 >= LiteralHandle) return false;
+
+    String string = strings[s - 1];
+    string.data += from;
+    string.length = to - from;
+    string.hash = 0;
+    strings.push_back(string);
+    handle = (dword)strings.size();
+    return true;
+  }
+
+  // the bytes of a small string move when the entries grow
+  if(to - from <= String::SmallSize) {
+    char small[String::SmallSize];
+    memcpy(small, data + from, to - from);
+    return NewString(small, to - from, handle);
+  }
+
+  return NewString(data + from, to - from, handle);
+}
+
+int VirtualMachine::CompareStrings(dword a, dword b)
+{
+  dword alength, blength;
+  const char *adata = GetString(a, alength), *bdata = GetString(b, blength);
+
+  dword n = alength < blength ? alength : blength;
+  dword k = kernels->mismatch(adata, bdata, n);
+  if(k < n) return (byte)adata[k] < (byte)bdata[k] ? -1 : 1;
+
+  return alength < blength ? -1 : alength > blength ? 1 : 0;
+}
+
+bool VirtualMachine::EqualStrings(dword a, dword b)
+{
+  if(a == b) return true;
+
+  dword alength, blength;
+  const char *adata = GetString(a, alength), *bdata = GetString(b, blength);
+  return alength == blength && kernels->mismatch(adata, bdata, alength) == alength;
+}
+
+// FNV-1a, a string of the virtual machine keeps its hash
+dword VirtualMachine::HashString(dword s)
+{
+  bool cached = (s & LiteralHandle) == 0 && s - 1 < strings.size();
+  if(cached && strings[s - 1].hash != 0) return strings[s - 1].hash;
+
+  dword length;
+  const char *data = GetString(s, length);
+
+  dword hash = 2166136261u;
+  for(dword i = 0; i < length; i ++)
+    hash = (hash ^ (byte)data[i]) * 16777619u;
+
+  if(cached) strings[s - 1].hash = hash;
+  return hash;
+}
+
+long VirtualMachine::FindString(dword s, dword t)
+{
+  dword n, m;
+  const char *sdata = GetString(s, n), *tdata = GetString(t, m);
+  if(m == 0) return 0;
+
+  return kernels->find(sdata, n, tdata, m);
+}
+
+void VirtualMachine::ClearStrings()
+{
+  for(dword i = 0; i < blocks.size(); i ++)
+    free(blocks[i].data);
+
+  blocks.clear();
+  strings.clear();
+}
@@ -0,0 +1,138 @@
+#include "Assembly.h"
+#include "Compiler.h"
+
+#include <map>
+#include <algorithm>
+
+#include "TyroDebug.h"
+
+
+//*** Switch statements
+
+#define tosigned(x) (*((long *)x))  // signed int
+
+// orders cases by their (signed) values
+static bool LowerCase(Node *a, Node *b)
+{
+  dword x = a->child[0]->symbol->ToDword(), y = b->child[0]->symbol->ToDword();
+  return tosigned(&x) < tosigned(&y);
+}
+
+Node* Compiler::GetCases(Node *node, NodeVector& cases, dword *defaultcount)
+{
+  Node *def = null;
+  NodeVector stack;
+
+  if(defaultcount != null) *defaultcount = 0;
+  stack.push_back(node->child[1]);
+
+  while(!stack.empty()) {
+    Node *n = stack.back();
+    stack.pop_back();
+    if(n == null) continue;
+
+    switch(n->type) {
+      case NT_STMT:
+        stack.push_back(n->child[1]);
+        stack.push_back(n->child[0]);
+        break;
+
+      case NT_CASE:
+        // the values of invalid cases are unknown, CheckNode() reports them
+        if(n->child[0]->type == NT_INT) cases.push_back(n);
+        break;
+
+      case NT_DEFAULT:
+        def = n;
+        if(defaultcount != null) (*defaultcount) ++;
+        break;
+    }
+  }
+
+  stable_sort(cases.begin(), cases.end(), LowerCase);
+  return def;
+}
+
+void Compiler::FormSwitches(Node *node)
+{
+  NodeVector order, absorbed;
+  PostOrder(node, order);
+
+  // parents come before their children in reverse post order,
+  // so every chain is found at its first test
+  for(NodeVector::reverse_iterator i = order.rbegin(); i != order.rend(); i ++) {
+    Node *chain = *i, *n = chain, *rest = null, *variable = null;
+    NodeVector cases;
+    map<dword, bool> values;
+
+    absorbed.clear();
+
+    // if(x == 1) a; else if(x == 2) b; ... else c;
+    for(;;) {
+      if(n->type != NT_IFTHEN && n->type != NT_IFTHENELSE) {
+        rest = n;
+        break;
+      }
+
+      Node *cond = n->child[0], *a = null, *b = null;
+      if(cond->type == NT_EQUAL) {
+        a = cond->child[0];
+        b = cond->child[1];
+        if(a->type == NT_INT && b->type == NT_IDENT) swap(a, b);
+      }
+
+      // the chain ends at anything that isn't a test of the same variable,
+      // and at the second test of a value, which never succeeds
+      bool test = a != null && a->type == NT_IDENT && b->type == NT_INT &&
+        (variable == null || a->symbol == variable->symbol) &&
+        values.find(b->symbol->ToDword()) == values.end();
+
+      if(!test) {
+        rest = n;
+        break;
+      }
+
+      variable = a;
+      values[b->symbol->ToDword()] = true;
+
+      Node *c = new Node(NT_CASE, b, n->child[1]);
+      c->line = n->line;
+      c->rettype = DT_VOID;
+      cases.push_back(c);
+
+      if(n != chain) absorbed.push_back(n);
+      if(n->type == NT_IFTHEN) break;
+      n = n->child[2];
+    }
+
+    if(cases.size() < MinSwitchCases) continue;
+
+    Node *list = cases[0];
+    for(dword j = 1; j < cases.size(); j ++) {
+      list = new Node(NT_STMT, list, cases[j]);
+      list->line = cases[j]->line;
+      list->rettype = DT_VOID;
+    }
+
+    if(rest != null) {
+      Node *def = new Node(NT_DEFAULT, rest);
+      def->line = rest->line;
+      def->rettype = DT_VOID;
+
+      list = new Node(NT_STMT, list, def);
+      list->rettype = DT_VOID;
+    }
+
+    Node *value = new Node(NT_IDENT);
+    *value = *variable;
+
+    chain->type = NT_SWITCH;
+    chain->child[0] = value;
+    chain->child[1] = list;
+    chain->child[2] = null;
+
+    // the inner tests are no longer part of the tree
+    for(NodeVector::iterator j = absorbed.begin(); j != absorbed.end(); j ++)
+      (*j)->type = NT_EMPTY;
+  }
+}
@@ -1,6 +1,9 @@
 #include "Assembly.h"
+#include "Linker.h"
+#include "Profile.h"
 
 #include <windows.h>
+#include <intrin.h>
 #include <stdio.h>
 
 #include "TyroDebug.h"
@@ -12,31 +15,124 @@
 #define tosigned(x) (*((long *)x))  // signed int
 
 
-VirtualMachine::VirtualMachine() : stackpos(stack)
+// true if the cpu has the popcnt instruction (cpuid function 1, ecx bit 23)
+static bool HasPopcnt()
+{
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 23)) != 0;
+}
+
+static dword PopCount(dword value)
+{
+  static bool popcnt = HasPopcnt();
+  if(popcnt) return __popcnt(value);
+
+  value = value - ((value >> 1) & 0x55555555);
+  value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+  value = (value + (value >> 4)) & 0x0f0f0f0f;
+  return (value * 0x01010101) >> 24;
+}
+
+
+dword VirtualMachine::Evaluate(OPCODE opcode, dword a, dword b)
+{
+  dword index;
+
+  switch(opcode) {
+    case POPCNT: return PopCount(a);
+    case CLZ:    return _BitScanReverse(&index, a) ? 31 - index : 32;
+    case CTZ:    return _BitScanForward(&index, a) ? index : 32;
+    case ROTL:   return _rotl(a, b & 31);
+    case ROTR:   return _rotr(a, b & 31);
+    case BSWAP:  return _byteswap_ulong(a);
+  }
+
+  return 0;
+}
+
+VirtualMachine::VirtualMachine() : stackpos(stack), framepos(frames), profile(null), literals(null)
 {
   memset(stack, 0, sizeof(stack));
 }
 
 VirtualMachine::~VirtualMachine()
 {
+  ClearArrays();
+  ClearStrings();
 }
 
 bool VirtualMachine::Execute(Assembly& assembly)
+{
+  return Execute(assembly, 0, false);
+}
+
+bool VirtualMachine::Resume(Assembly& assembly, dword offset)
+{
+  return Execute(assembly, offset, true);
+}
+
+bool VirtualMachine::Execute(Assembly& assembly, dword offset, bool resume)
 {
   // check if there's a "SYS SC_EXIT" op at the end of the bytecode stream
   dword *lastop = assembly.GetByteCode() + assembly.GetSize() - 2;
   if(!(lastop[0] == SYS && lastop[1] == SC_EXIT))
     assembly.WriteOp(SYS, SC_EXIT); // if not, add it
 
-  dword *localvars = null;
+  // a resumed run still has the arrays and the strings in its variables
+  if(!resume) {
+    ClearArrays();
+    ClearStrings();
+  }
+
+  literals = &assembly.GetLiterals();
+
+  if(profile == null) return Run<false>(assembly, offset, resume, null, null);
+
+  // the counts are kept for the code as it is, so all of it is linked in first
+  if(assembly.GetLinker() != null && !assembly.GetLinker()->Link(assembly)) return false;
+
+  dword size = assembly.GetSize();
+  dword *executed = new dword[size];
+  dword *taken = new dword[size];
+  memset(executed, 0, sizeof(dword) * size);
+  memset(taken, 0, sizeof(dword) * size);
+
+  // a failed run is counted as well, up to the point where it failed
+  bool result = Run<true>(assembly, offset, resume, executed, taken);
+  profile->Add(assembly, executed, taken);
+
+  delete[] executed;
+  delete[] taken;
+  return result;
+}
+
+template<bool profiling> bool VirtualMachine::Run(Assembly& assembly, dword offset, bool resume,
+  dword *executed, dword *taken)
+{
+  // the variables of the program are always at the bottom of the stack
+  dword *localvars = resume ? stack : null;
   dword *bytecode = assembly.GetByteCode();
-  dword *cur = bytecode;
+  dword *cur = bytecode + offset;
   stackpos = stack;
+  framepos = frames;
+
+  dword a, b, c;
 
-  dword a, b;
+  // the op that was executed last and the one that follows it
+  dword *last = null, *next = cur;
 
   // the only way we exit this loop is when we encounter "SYS SC_EXIT"
   for(;;) {
+    if(profiling) {
+      // the last op jumped if it isn't followed by the next one
+      if(cur != next) taken[last - bytecode] ++;
+      executed[cur - bytecode] ++;
+
+      last = cur;
+      next = cur + Assembler::OpSize(*cur);
+    }
+
     dword opcode = *(cur ++);
     dword operand = *(cur ++);
 
@@ -45,11 +141,17 @@ bool VirtualMachine::Execute(Assembly& assembly)
         break;
 
       case LOCAL:
+        // a resumed run keeps the variables it has and adds the new ones,
+        // like a FRAME it fails unless there is room for them
+        if((localvars != null ? localvars : stackpos) + operand + StackReserve >= stack + StackSize) return false;
+
+        if(localvars == null) {
 #ifdef _DEBUG
-        memset(stackpos, 0xcafebabe, sizeof(dword) * operand);
+          memset(stackpos, 0xcafebabe, sizeof(dword) * operand);
 #endif
-        localvars = stackpos;
-        stackpos += operand;
+          localvars = stackpos;
+        }
+        stackpos = localvars + operand;
         break;
 
       case CALL:
@@ -195,6 +297,286 @@ bool VirtualMachine::Execute(Assembly& assembly)
         else *stackpos = 0;
         break;
 
+      case JEQ:
+        b = *(stackpos --);
+        a = *(stackpos --);
+        if(a == b) cur = bytecode + operand;
+        break;
+
+      case JNE:
+        b = *(stackpos --);
+        a = *(stackpos --);
+        if(a != b) cur = bytecode + operand;
+        break;
+
+      case JLT:
+        b = *(stackpos --);
+        a = *(stackpos --);
+        if(tosigned(&a) < tosigned(&b)) cur = bytecode + operand;
+        break;
+
+      case JLE:
+        b = *(stackpos --);
+        a = *(stackpos --);
+        if(tosigned(&a) <= tosigned(&b)) cur = bytecode + operand;
+        break;
+
+      case JGT:
+        b = *(stackpos --);
+        a = *(stackpos --);
+        if(tosigned(&a) > tosigned(&b)) cur = bytecode + operand;
+        break;
+
+      case JGE:
+        b = *(stackpos --);
+        a = *(stackpos --);
+        if(tosigned(&a) >= tosigned(&b)) cur = bytecode + operand;
+        break;
+
+      case SHL:
+        b = *(stackpos --);
+        a = *stackpos;
+        *stackpos = a << (b & 31);
+        break;
+
+      case SHR:
+        b = *(stackpos --);
+        a = *stackpos;
+        *stackpos = a >> (b & 31);
+        break;
+
+      case SAR:
+        b = *(stackpos --);
+        a = *stackpos;
+        *((long *)stackpos) = tosigned(&a) >> (b & 31);
+        break;
+
+      case BAND:
+        b = *(stackpos --);
+        a = *stackpos;
+        *stackpos = a & b;
+        break;
+
+      case BOR:
+        b = *(stackpos --);
+        a = *stackpos;
+        *stackpos = a | b;
+        break;
+
+      case BXOR:
+        b = *(stackpos --);
+        a = *stackpos;
+        *stackpos = a ^ b;
+        break;
+
+      case POPCNT:
+        *stackpos = PopCount(*stackpos);
+        break;
+
+      case CLZ:
+        if(_BitScanReverse(&a, *stackpos))
+          *stackpos = 31 - a;
+        else
+          *stackpos = 32;
+        break;
+
+      case CTZ:
+        if(_BitScanForward(&a, *stackpos))
+          *stackpos = a;
+        else
+          *stackpos = 32;
+        break;
+
+      case ROTL:
+        b = *(stackpos --);
+        *stackpos = _rotl(*stackpos, b & 31);
+        break;
+
+      case ROTR:
+        b = *(stackpos --);
+        *stackpos = _rotr(*stackpos, b & 31);
+        break;
+
+      case BSWAP:
+        *stackpos = _byteswap_ulong(*stackpos);
+        break;
+
+      case LOOPINC:
+        a = ++ localvars[cur[0]];
+        b = localvars[cur[1]];
+        cur += 2;
+        if(tosigned(&a) < tosigned(&b)) cur = bytecode + operand;
+        break;
+
+      case LOOPINCC:
+        a = ++ localvars[cur[0]];
+        b = cur[1];
+        cur += 2;
+        if(tosigned(&a) < tosigned(&b)) cur = bytecode + operand;
+        break;
+
+      case TABLESWITCH:
+        // unsigned, so values below low are out of range as well
+        a = *(stackpos --) - cur[0];
+        if(a < cur[1])
+          cur = bytecode + cur[2 * a + 3];
+        else
+          cur = bytecode + operand;
+        break;
+
+      case CALLS:
+        if(framepos == frames + MaxCallDepth) return false;
+        framepos->ret = cur;
+        framepos->localvars = localvars;
+        framepos ++;
+        cur = bytecode + operand;
+        break;
+
+      case CALLM:
+        // the first call links the module in and the op becomes a CALLS,
+        // the code that follows it may have moved
+        a = (dword)(cur - bytecode);
+        if(assembly.GetLinker() == null || !assembly.GetLinker()->Resolve(assembly, operand, b)) return false;
+
+        if(assembly.GetByteCode() != bytecode) {
+          for(Frame *frame = frames; frame < framepos; frame ++)
+            frame->ret = assembly.GetByteCode() + (frame->ret - bytecode);
+
+          bytecode = assembly.GetByteCode();
+          cur = bytecode + a;
+        }
+
+        cur[-2] = CALLS;
+        cur[-1] = b;
+
+        if(framepos == frames + MaxCallDepth) return false;
+        framepos->ret = cur;
+        framepos->localvars = localvars;
+        framepos ++;
+        cur = bytecode + b;
+        break;
+
+      case FRAME:
+        // the arguments are already on the stack
+        localvars = stackpos - operand + 1;
+        stackpos = localvars + cur[0] - 1;
+#ifdef _DEBUG
+        memset(localvars + operand, 0xcafebabe, sizeof(dword) * (cur[0] - operand));
+#endif
+        cur += 2;
+        if(stackpos + StackReserve >= stack + StackSize) return false;
+        break;
+
+      case ANEW:
+        if((*stackpos = NewArray(*stackpos)) == 0) return false;
+        break;
+
+      case ALEN:
+        a = *stackpos - 1;
+        *stackpos = a < arrays.size() ? arrays[a].length : 0;
+        break;
+
+      // the indices are compared unsigned, so negative ones are out of range as well
+      case ALOAD:
+        b = *(stackpos --);
+        a = *stackpos - 1;
+        if(a >= arrays.size() || b >= arrays[a].length) return false;
+        *stackpos = arrays[a].data[b];
+        break;
+
+      case ASTORE:
+        c = *(stackpos --);
+        b = *(stackpos --);
+        a = *stackpos - 1;
+        if(a >= arrays.size() || b >= arrays[a].length) return false;
+        *stackpos = arrays[a].data[b] = c;
+        break;
+
+      case ALOADU:
+        b = *(stackpos --);
+        *stackpos = arrays[*stackpos - 1].data[b];
+        break;
+
+      case ASTOREU:
+        c = *(stackpos --);
+        b = *(stackpos --);
+        *stackpos = arrays[*stackpos - 1].data[b] = c;
+        break;
+
+      case ASLICE:
+        c = *(stackpos --);
+        b = *(stackpos --);
+        if((*stackpos = Slice(*stackpos, b, c)) == 0) return false;
+        break;
+
+      case AFILL:
+      case VADD:
+      case VMUL:
+      case VLESS:
+      case VSELECT:
+      case VDOT:
+      case VSUM:
+        if(!Kernel((OPCODE)opcode, (ELEMENTTYPE)operand)) return false;
+        break;
+
+      case SLIT:
+        *(++ stackpos) = LiteralHandle | operand;
+        break;
+
+      case SCAT:
+        b = *(stackpos --);
+        if(!Concatenate(*stackpos, b, *stackpos)) return false;
+        break;
+
+      case SEQ:
+        b = *(stackpos --);
+        *stackpos = EqualStrings(*stackpos, b) ? 1 : 0;
+        break;
+
+      case SCMP:
+        b = *(stackpos --);
+        *stackpos = (dword)CompareStrings(*stackpos, b);
+        break;
+
+      case SLEN:
+        GetString(*stackpos, *stackpos);
+        break;
+
+      case SHASH:
+        *stackpos = HashString(*stackpos);
+        break;
+
+      case SCHAR:
+        b = *(stackpos --);
+        {
+          const char *data = GetString(*stackpos, a);
+          if(b >= a) return false;
+          *stackpos = (byte)data[b];
+        }
+        break;
+
+      case SSUB:
+        c = *(stackpos --);
+        b = *(stackpos --);
+        if(!Substring(*stackpos, b, c, *stackpos)) return false;
+        break;
+
+      case SFIND:
+        b = *(stackpos --);
+        *stackpos = (dword)FindString(*stackpos, b);
+        break;
+
+      case RET:
+        // the return value takes the place of the arguments
+        a = *stackpos;
+        stackpos = localvars;
+        *stackpos = a;
+
+        framepos --;
+        cur = framepos->ret;
+        localvars = framepos->localvars;
+        break;
+
       default:
         return false;
     }
@@ -223,6 +605,15 @@ bool VirtualMachine::System(SYSCODE operand)
       // note: platform dependant
       Sleep(*(stackpos --));
       return true;
+
+    case SC_PRINTS:
+      {
+        dword length;
+        const char *data = GetString(*(stackpos --), length);
+        fwrite(data, 1, length, stdout);
+        putchar('\n');
+      }
+      return true;
   }
 
   return false;
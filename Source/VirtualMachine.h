@@ -2,6 +2,9 @@
 
 #include "Tyro.h"
 
+#include <string>
+#include <vector>
+
 
 // when updating these, make sure to update opcodes[] in Assembler.cpp
 enum OPCODE
@@ -56,6 +59,91 @@ enum OPCODE
   FDIV,
 
   FCMP,
+
+  // fused compare and branch ops, these pop b and a and jump
+  // to the operand if the signed comparison a ? b is true
+  JEQ,
+  JNE,
+  JLT,
+  JLE,
+  JGT,
+  JGE,
+
+  // bitwise ops, pop b and a and push a ? b
+  // shifts only use the low 5 bits of b
+  SHL,
+  SHR,          // logical shift right
+  SAR,          // arithmetic shift right
+  BAND,
+  BOR,
+  BXOR,
+
+  // bit manipulation, these map to single x86 instructions
+  POPCNT,       // number of bits set
+  CLZ,          // number of leading zero bits, 32 for 0
+  CTZ,          // number of trailing zero bits, 32 for 0
+  ROTL,         // pops b and a and pushes a rotated left by b
+  ROTR,         // pops b and a and pushes a rotated right by b
+  BSWAP,        // reverses the byte order
+
+  // fused loop increments, these add 1 to variable i and jump to the operand
+  // if the signed comparison i < n is true, the op is followed by a second
+  // pair of dwords: the index of i and the index of variable n (LOOPINC)
+  // or the constant n (LOOPINCC)
+  LOOPINC,
+  LOOPINCC,
+
+  // pops v and jumps to the target of table entry v - low, or to the operand
+  // if there is no such entry, the op is followed by a pair of dwords (low and
+  // the number of entries) and then by the table, which is a GOTO per entry
+  TABLESWITCH,
+
+  // script functions, the caller pushes the arguments and CALLS saves the
+  // return address and the caller's local variables before it jumps to the
+  // FRAME op of the function, the arguments become the first local variables
+  CALLS,
+  RET,          // pops the return value, drops the frame and returns to the caller
+  FRAME,        // the operand is the number of parameters, followed by a second
+                // pair of dwords: the number of local variables and 0
+
+  CALLM,        // calls a function of a module, the operand is the index of its name
+                // in the externals of the assembly, the linker turns it into a CALLS
+                // (see Linker), at the latest when it is executed for the first time
+
+  // arrays, an array value is the handle of an array the virtual machine owns,
+  // 0 is no array, the elements are ints or floats
+  ANEW,         // pops n and pushes a new array of n zeros
+  ALEN,         // pops an array and pushes its length, 0 if there is no array
+  ALOAD,        // pops i and a and pushes a[i], fails unless 0 <= i < length
+  ASTORE,       // pops v, i and a, stores v in a[i] and pushes v, fails unless 0 <= i < length
+  ALOADU,       // ALOAD and ASTORE without the checks, for the indices the
+  ASTOREU,      // compiler proved to be in range
+  AFILL,        // pops v and sets every element of the array left on the stack to v
+  ASLICE,       // pops j, i and a and pushes an array that shares elements i to j - 1 of a
+
+  // element-wise kernels, the operand is the type of the elements (see ELEMENTTYPE)
+  // the arrays have to have the same length, the result is left in d, which is
+  // the array left on the stack
+  VADD,         // pops b and a, d[k] = a[k] + b[k]
+  VMUL,         // pops b and a, d[k] = a[k] * b[k]
+  VLESS,        // pops b and a, d[k] = a[k] < b[k], d is an int array
+  VSELECT,      // pops b, a and m, d[k] = m[k] != 0 ? a[k] : b[k], m is an int array
+  VDOT,         // pops b and a and pushes the sum of a[k] * b[k]
+  VSUM,         // pops a and pushes the sum of a[k]
+
+  // strings, a string value is the handle of a string the virtual machine
+  // owns or of a literal of the assembly, 0 is the empty string
+  // strings never change, the ops that don't create one treat a handle
+  // that isn't valid as the empty string
+  SLIT,         // pushes the literal the operand is the index of
+  SCAT,         // pops b and a and pushes a followed by b
+  SEQ,          // pops b and a and pushes 1 if they are the same, 0 if not
+  SCMP,         // pops b and a and pushes -1, 0 or 1 as a sorts before, with or after b
+  SLEN,         // pops s and pushes its length in bytes
+  SHASH,        // pops s and pushes its hash, which is the same in every run
+  SCHAR,        // pops i and s and pushes the byte s[i], fails unless 0 <= i < length
+  SSUB,         // pops j, i and s and pushes bytes i to j - 1 of s, fails unless 0 <= i <= j <= length
+  SFIND,        // pops t and s and pushes the offset of the first t in s, -1 if there is none
 };
 
 enum SYSCODE
@@ -65,19 +153,134 @@ enum SYSCODE
   SC_PRINTI  = 2,    // prints an int
   SC_PRINTF  = 3,    // prints a float
   SC_SLEEP   = 4,    // sleeps, ms specified by the int on stack
+  SC_PRINTS  = 5,    // prints a string and a new line
+};
+
+enum ELEMENTTYPE
+{
+  ET_INT     = 0,
+  ET_FLOAT   = 1,
 };
 
 class Assembly;
 class Function;
+class Profile;
+
+// an array of the virtual machine, slices share the elements of the array they
+// are taken from, the elements of a new array are aligned for the SIMD kernels
+struct Array
+{
+  dword *data;
+  dword length;
+  void *block;        // the memory the array owns, null for a slice
+};
+
+// a string of the virtual machine, the short ones are kept in the entry
+// itself, the others in a block they may share with the strings they were
+// appended to or taken from
+struct String
+{
+  enum Constant { SmallSize = 16 };
+
+  const char *data;   // the bytes, null if they are in small
+  dword length;
+  dword hash;         // 0 until it is computed
+  dword block;        // the index of the block data points into
+  char small[SmallSize];
+
+  const char* GetData() const { return data != null ? data : small; }
+};
+
+// the memory of the strings that don't fit in their entries, a string that
+// ends where the used part of the block does is appended to in place
+struct StringBlock
+{
+  char *data;
+  dword size;         // the bytes in use
+  dword capacity;
+};
 
 class VirtualMachine
 {
-  dword stack[256];
+  // a FRAME or a LOCAL fails unless StackReserve dwords are left for the expressions that follow
+  // new arrays are aligned to ArrayAlignment bytes, the blocks of the strings
+  // hold at least StringBlockSize bytes
+  enum Constant { StackSize = 4096, StackReserve = 64, MaxCallDepth = 1024, ArrayAlignment = 32,
+    StringBlockSize = 64 };
+
+  dword stack[StackSize];
   dword *stackpos;
 
   dword vararray[256];
 
+  // the return address and the local variables of the caller of every active script function
+  struct Frame
+  {
+    dword *ret;
+    dword *localvars;
+  };
+
+  Frame frames[MaxCallDepth];
+  Frame *framepos;
+
+  Profile *profile;   // receives the execution counts, null if there is no profiling
+
+  // the arrays by handle - 1, they live until the next run starts
+  std::vector<Array> arrays;
+
+  // creates an array of length zeros or a slice of array, returns its handle
+  // or 0 if it fails (see Arrays.cpp)
+  dword NewArray(dword length);
+  dword Slice(dword array, dword from, dword to);
+
+  // runs an element-wise kernel (VADD to VSUM) on the arrays on the stack,
+  // stackpos is moved past the operands and the result is left in their place
+  bool Kernel(OPCODE opcode, ELEMENTTYPE type);
+
+  // releases all the arrays
+  void ClearArrays();
+
+  // the strings by handle - 1 and their blocks, they live until the next run
+  // starts, the literals are the ones of the assembly that is running
+  std::vector<String> strings;
+  std::vector<StringBlock> blocks;
+  std::vector<std::string> *literals;
+
+  // returns the bytes of the string with the given handle (see Strings.cpp)
+  const char* GetString(dword handle, dword& length);
+
+  // creates a string of the length bytes at data, or of a followed by b,
+  // or of bytes from to to - 1 of s, returns false if it fails
+  bool NewString(const char *data, dword length, dword& handle);
+  bool Concatenate(dword a, dword b, dword& handle);
+  bool Substring(dword s, dword from, dword to, dword& handle);
+
+  // compares the strings like memcmp(), the shorter one sorts first if it
+  // is the start of the other one
+  int CompareStrings(dword a, dword b);
+  bool EqualStrings(dword a, dword b);
+  dword HashString(dword s);
+  long FindString(dword s, dword t);
+
+  // releases all the strings
+  void ClearStrings();
+
+  // runs the bytecode, when profiling it counts how many times each op
+  // is executed and how many times each jump is taken, by offset
+  // the run starts at offset, a resumed run starts with the local variables
+  // of the last one
+  template<bool profiling> bool Run(Assembly& assembly, dword offset, bool resume,
+    dword *executed, dword *taken);
+
+  bool Execute(Assembly& assembly, dword offset, bool resume);
+
 public:
+
+  // the longest array, the compiler relies on indices below it not overflowing
+  // when a loop adds a small step to them
+  // the handles of the literals have LiteralHandle set, the other handles
+  // stay below it
+  enum Limit { MaxArrayLength = 0x10000000, MaxStringLength = 0x40000000, LiteralHandle = 0x80000000 };
   
   VirtualMachine();
   ~VirtualMachine();
@@ -87,6 +290,18 @@ public:
 
   bool Execute(Assembly& assembly);
 
+  // runs the code at offset with the values the last run left in the local
+  // variables, the code a session appended to the assembly (see Compiler::BeginSession())
+  bool Resume(Assembly& assembly, dword offset);
+
+  // adds the counts of the following runs to profile, null turns profiling off
+  // profiling slows execution down, so it is off by default
+  void SetProfile(Profile *profile) { this->profile = profile; }
+
+  // returns the result of a bit manipulation op (POPCNT to BSWAP) exactly
+  // like Execute() computes it, b is only used by the rotates
+  static dword Evaluate(OPCODE opcode, dword a, dword b);
+
   // prints all the values on the stack, for debugging
   void DumpStack();
 };